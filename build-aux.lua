@@ -20,6 +20,11 @@ local __default_configurations = {
     links = { 'c++' },
   },
 
+  linux = {
+    buildoptions = { '-pthread' },
+    linkoptions = { '-pthread' },
+  },
+
   Debug = __debug_options,
   Release = __release_options,
   ['Debug-*'] = __debug_options,
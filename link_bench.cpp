@@ -0,0 +1,265 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vm_opcode.h"
+#include "vm_unit.h"
+#include "vm_value.h"
+
+
+/**
+ * Link-time benchmark. Generates synthetic bytecode units with many label,
+ * extern, and data relocations and times linking them into one vm_unit.
+ *
+ * Usage: link_bench [UNITS [INSTRUCTIONS_PER_UNIT [RUNS]]]
+ */
+
+
+namespace {
+
+
+/** Writes bytecode chunks in the layout vm_unit::read expects. */
+class unit_writer
+{
+  std::string _buffer;
+
+public:
+  template <typename T>
+  void write(T value)
+  {
+    _buffer.append(reinterpret_cast<char const *>(&value), sizeof value);
+  }
+
+
+  void write_value(int32_t type, int64_t value)
+  {
+    write<int32_t>(type);
+    write<int64_t>(value);
+  }
+
+
+  void write_string(std::string const &str)
+  {
+    write<int32_t>(static_cast<int32_t>(str.size()));
+    _buffer.append(str);
+  }
+
+
+  /** Begins a table chunk. Returns its offset for end_table. */
+  size_t begin_table(vm_chunk_id id, int32_t count)
+  {
+    size_t const offset = _buffer.size();
+    write<int32_t>(id);
+    write<int32_t>(0);
+    write<int32_t>(count);
+    return offset;
+  }
+
+
+  /** Fills in the byte size of a chunk started at offset. */
+  void end_table(size_t offset)
+  {
+    int32_t const size = static_cast<int32_t>(_buffer.size() - offset);
+    std::copy(
+      reinterpret_cast<char const *>(&size),
+      reinterpret_cast<char const *>(&size) + sizeof size,
+      &_buffer[offset + sizeof(int32_t)]
+      );
+  }
+
+
+  std::string const &str() const { return _buffer; }
+};
+
+
+struct relocation
+{
+  int32_t pointer;
+  uint32_t mask;
+};
+
+
+/**
+ * Builds a unit of instruction_count instructions. Even instructions call one
+ * of the unit's exported labels (one per four instructions) or, every eighth
+ * call, an extern defined by the previous unit. Odd instructions load a data
+ * block reference.
+ */
+std::string make_unit(int unit_index, int32_t instruction_count)
+{
+  int32_t const export_count = std::max<int32_t>(instruction_count / 4, 1);
+  int32_t const data_count = 64;
+  bool const has_extern = unit_index > 0;
+
+  std::vector<relocation> label_rels;
+  std::vector<relocation> extern_rels;
+  std::vector<relocation> data_rels;
+
+  unit_writer instructions;
+  size_t table = instructions.begin_table(CHUNK_INST, instruction_count);
+  for (int32_t index = 0; index < instruction_count; ++index) {
+    if (index % 2 == 0) {
+      bool const is_extern = has_extern && index % 16 == 0;
+      // Scattered so lookups don't walk the label tables in order.
+      int64_t const target = is_extern ? 0 : (int64_t(index / 2) * 7919 % export_count) * 2;
+      instructions.write<uint16_t>(CALL);
+      instructions.write<uint16_t>(0x3);
+      instructions.write_value(vm_value::SIGNED, target);
+      instructions.write_value(vm_value::SIGNED, 0);
+      (is_extern ? extern_rels : label_rels).push_back(relocation { index, 0x1 });
+    } else {
+      instructions.write<uint16_t>(LOAD);
+      instructions.write<uint16_t>(0x2);
+      instructions.write_value(vm_value::SIGNED, 4);
+      instructions.write_value(vm_value::DATA, 1 + index % data_count);
+      data_rels.push_back(relocation { index, 0x2 });
+    }
+  }
+  instructions.end_table(table);
+
+  // Chunks after the version and offsets, in file order.
+  std::vector<std::pair<vm_chunk_id, std::string>> chunks;
+  chunks.emplace_back(CHUNK_INST, instructions.str());
+
+  auto relocation_chunk = [](vm_chunk_id id, std::vector<relocation> const &rels) {
+    unit_writer chunk;
+    size_t const start = chunk.begin_table(id, static_cast<int32_t>(rels.size()));
+    for (relocation const &rel : rels) {
+      chunk.write<int32_t>(rel.pointer);
+      chunk.write<uint32_t>(rel.mask);
+    }
+    chunk.end_table(start);
+    return chunk.str();
+  };
+
+  {
+    unit_writer chunk;
+    size_t const start = chunk.begin_table(CHUNK_IMPT, 1);
+    chunk.write<int32_t>(-1);
+    chunk.write_string("print");
+    chunk.end_table(start);
+    chunks.emplace_back(CHUNK_IMPT, chunk.str());
+  }
+
+  {
+    unit_writer chunk;
+    size_t const start = chunk.begin_table(CHUNK_EXPT, export_count);
+    for (int32_t index = 0; index < export_count; ++index) {
+      chunk.write<int32_t>(index * 2);
+      chunk.write_string("unit" + std::to_string(unit_index) + "_fn" + std::to_string(index));
+    }
+    chunk.end_table(start);
+    chunks.emplace_back(CHUNK_EXPT, chunk.str());
+  }
+
+  chunks.emplace_back(CHUNK_LREL, relocation_chunk(CHUNK_LREL, label_rels));
+
+  {
+    unit_writer chunk;
+    size_t const start = chunk.begin_table(CHUNK_EXTS, has_extern ? 1 : 0);
+    if (has_extern) {
+      chunk.write_string("unit" + std::to_string(unit_index - 1) + "_fn0");
+    }
+    chunk.end_table(start);
+    chunks.emplace_back(CHUNK_EXTS, chunk.str());
+  }
+
+  chunks.emplace_back(CHUNK_EREL, relocation_chunk(CHUNK_EREL, extern_rels));
+
+  {
+    unit_writer chunk;
+    size_t const start = chunk.begin_table(CHUNK_DATA, data_count);
+    for (int32_t index = 0; index < data_count; ++index) {
+      chunk.write_string(std::string(16, static_cast<char>('a' + index % 26)));
+    }
+    chunk.end_table(start);
+    chunks.emplace_back(CHUNK_DATA, chunk.str());
+  }
+
+  chunks.emplace_back(CHUNK_DREL, relocation_chunk(CHUNK_DREL, data_rels));
+
+  unit_writer unit;
+  unit.write<int32_t>(CHUNK_VERS);
+  unit.write<int32_t>(12);
+  unit.write<int32_t>(9);
+
+  int32_t const offsets_size = 12 + 8 * static_cast<int32_t>(chunks.size() + 2);
+  int32_t offset = 12 + offsets_size;
+  size_t const offsets_start = unit.begin_table(CHUNK_OFFS, static_cast<int32_t>(chunks.size() + 2));
+  unit.write<int32_t>(CHUNK_VERS);
+  unit.write<int32_t>(0);
+  unit.write<int32_t>(CHUNK_OFFS);
+  unit.write<int32_t>(12);
+  for (auto const &chunk : chunks) {
+    unit.write<int32_t>(chunk.first);
+    unit.write<int32_t>(offset);
+    offset += static_cast<int32_t>(chunk.second.size());
+  }
+  unit.end_table(offsets_start);
+
+  std::string result = unit.str();
+  for (auto const &chunk : chunks) {
+    result += chunk.second;
+  }
+  return result;
+}
+
+
+} // namespace
+
+
+
+int main(int argc, char const *argv[])
+{
+  int const unit_count = argc > 1 ? std::atoi(argv[1]) : 4;
+  int32_t const instruction_count = argc > 2 ? std::atoi(argv[2]) : 100000;
+  int const runs = argc > 3 ? std::atoi(argv[3]) : 5;
+
+  std::vector<std::string> units;
+  for (int index = 0; index < unit_count; ++index) {
+    units.push_back(make_unit(index, instruction_count));
+  }
+
+  // Every instruction has one relocated operand.
+  int64_t const relocation_count = int64_t(unit_count) * instruction_count;
+  int64_t best_ns = INT64_MAX;
+
+  for (int run = 0; run < runs; ++run) {
+    std::vector<std::istringstream> inputs;
+    for (std::string const &unit : units) {
+      inputs.emplace_back(unit);
+    }
+
+    auto const start = std::chrono::steady_clock::now();
+    vm_unit linked;
+    for (std::istringstream &input : inputs) {
+      linked.read(input);
+    }
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+
+    if (!linked.is_valid()) {
+      std::cerr << "Linked unit is not valid." << std::endl;
+      return 1;
+    }
+    best_ns = std::min<int64_t>(best_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  }
+
+  std::cout
+    << unit_count << " units, " << relocation_count << " relocations: "
+    << (best_ns / 1000) << " us (" << (best_ns / relocation_count) << " ns per relocation)"
+    << std::endl;
+
+  return 0;
+}
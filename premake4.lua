@@ -11,7 +11,7 @@ configurations {
 library {
   'rusalka',
   files = { '**.cpp' },
-  excludes = { '**_test.*' },
+  excludes = { '**_test.*', '**_bench.*' },
   configs = {
     ['*-Static'] = { kind = 'StaticLib' },
     ['*-Shared'] = { kind = 'SharedLib' },
@@ -25,6 +25,12 @@ console_app {
   links = { 'rusalka' },
 }
 
+console_app {
+  'link_bench',
+  files = { 'link_bench.cpp' },
+  links = { 'rusalka' },
+}
+
 console_app {
   'value_test',
   files = { 'value_test.cpp' },
@@ -52,16 +52,12 @@ defdata woop "wooperton"
         push buffer
         call ^prints 1
 
-        push buffer
-        push buffer
-        call .rot13 2
+        call .rot13(buffer, buffer)
 
         push buffer
         call ^prints 1
 
-        push buffer
-        push buffer
-        call .rot13 2
+        call .rot13(buffer, buffer)
 
         push buffer
         call ^prints 1
@@ -86,9 +82,9 @@ defdata woop "wooperton"
     return
 
 // function rot13(mem_in, mem_out) -> bytes written
-// function rot13(mem_in, mem_out) -> bytes written
+// Takes its arguments in registers (function%), so calls to it use RCALL.
 // .rot13: let* mem_in, mem_out, length {
-function rot13(mem_in, mem_out; index, char, base, length) {
+function% rot13(mem_in, mem_out; index, char, base, length) {
     let* length_out {
         memlen length     mem_in
         memlen length_out mem_out
@@ -131,3 +127,291 @@ function rot13(mem_in, mem_out; index, char, base, length) {
     return
 }
 
+
+// sum3(a, b, c) -> a + b + c, taking its arguments in registers.
+function% sum3(a, b, c) {
+    add rp a b
+    add rp rp c
+    return
+}
+
+// rcall_sum(x) -> 4x + 3. Calls sum3 through RCALL and then reads x again, so
+// x has to survive the call in its non-volatile register.
+.rcall_sum:
+    let x, y, z {
+        pop x
+        add y x 1.0
+        add z x 2.0
+        call .sum3(x, y, z)
+        add rp rp x
+        return
+    }
+
+// square(x) -> x * x. Traps if x is negative.
+.square:
+    let x {
+        pop x
+        if x < 0.0 {
+            trap
+        }
+        mul rp x x
+        return
+    }
+
+// bump(x) -> x + y, where y is a register the function never writes.
+.bump:
+    let x, y {
+        pop x
+        add rp x y
+        return
+    }
+
+// count(n) -> n, counting up to it one at a time.
+.count:
+    let n, i {
+        pop n
+        load i 0.0
+        for i < n {
+            add i i 1.0
+        }
+        load rp i
+        return
+    }
+
+// fib(n), deferring one of each pair of recursive calls.
+.fib:
+    let n, a, b, t {
+        pop n
+        if n < 2.0 {
+            load rp n
+            return
+        }
+        sub a n 1.0
+        defer t
+        if t == -1 {
+            push a
+            call .fib 1
+            return
+        }
+        sub b n 2.0
+        push b
+        call .fib 1
+        load b rp
+        join t a
+        add rp a b
+        return
+    }
+
+// joined_id() -> the ID of a deferred thread, after it's been joined. The
+// deferred thread calls the host's note callback first.
+.joined_id:
+    let t, r {
+        defer t
+        if t == -1 {
+            call ^note 0
+            load rp 0.0
+            return
+        }
+        join t r
+        load rp t
+        return
+    }
+
+// fork_window(depth) pushes depth values and then calls fork_inner, so the
+// caller's frame is below fork_inner's on the stack.
+.fork_window:
+    let depth, i {
+        pop depth
+        load i 0.0
+        for i < depth {
+            push i
+            add i i 1.0
+        }
+        call .fork_inner 0
+        return
+    }
+
+// fork_inner() pushes 7 and 8 and defers. The deferred thread returns
+// EBP * 1000 + (ESP - EBP) * 100 + its top value, so 208 if its stack holds
+// only fork_inner's frame.
+.fork_inner:
+    let t, size, top {
+        load top 7.0
+        push top
+        load top 8.0
+        push top
+        defer t
+        if t == -1 {
+            sub size esp ebp
+            pop top
+            mul rp ebp 1000.0
+            mul size size 100.0
+            add rp rp size
+            add rp rp top
+            return
+        }
+        join t rp
+        return
+    }
+
+// deep(n) -> n + (n - 1) + ... + 1, keeping n on the stack across each
+// recursive call so the stack grows with n.
+.deep:
+    let n, m {
+        pop n
+        if n < 1.0 {
+            load rp 0.0
+            return
+        }
+        push n
+        sub m n 1.0
+        push m
+        call .deep 1
+        pop m
+        add rp rp m
+        return
+    }
+
+// high_register() -> 9, passed through register 200.
+.high_register:
+    load %200 9.0
+    load rp %200
+    return
+
+// squares(n) yields i * i for i in [0, n), then returns -1.
+.squares:
+    let n, i, square {
+        pop n
+        load i 0.0
+        for i < n {
+            mul square i i
+            yield square
+            add i i 1.0
+        }
+        load rp -1.0
+        return
+    }
+
+// fetch_pair(x) -> fetch(x) + fetch(x + 1), where fetch is a host callback
+// that may park the thread.
+.fetch_pair:
+    let x, first {
+        pop x
+        push x
+        call ^fetch 1
+        load first rp
+        add x x 1.0
+        push x
+        call ^fetch 1
+        add rp rp first
+        return
+    }
+
+// produce(chan, n) sends 0 through n - 1 to chan and closes it.
+.produce:
+    let chan, n, i {
+        pop n
+        pop chan
+        load i 0.0
+        for i < n {
+            send chan i
+            add i i 1.0
+        }
+        close chan
+        load rp 0.0
+        return
+    }
+
+// consume(chan) -> the sum of the values received until chan closes.
+.consume:
+    let chan, value, ok, sum {
+        pop chan
+        load sum 0.0
+        recv value ok chan
+        for ok == 1 {
+            add sum sum value
+            recv value ok chan
+        }
+        load rp sum
+        return
+    }
+
+// pipe(n) -> the sum of [0, n), sent from a deferred producer.
+.pipe:
+    let n, chan, t, sum {
+        pop n
+        channel chan 4
+        defer t
+        if t == -1 {
+            push chan
+            push n
+            call .produce 2
+            return
+        }
+        push chan
+        call .consume 1
+        load sum rp
+        join t chan
+        load rp sum
+        return
+    }
+
+// relay_early() -> 5, sent to a deferred receiver before joining it.
+.relay_early:
+    let chan, t, value, ok {
+        channel chan 1
+        defer t
+        if t == -1 {
+            recv value ok chan
+            load rp value
+            return
+        }
+        send chan 5.0
+        join t value
+        load rp value
+        return
+    }
+
+// relay_late() joins a deferred receiver before sending to it, so the
+// receiver waits on a send that can't happen until the join returns.
+.relay_late:
+    let chan, t, value, ok {
+        channel chan 1
+        defer t
+        if t == -1 {
+            recv value ok chan
+            load rp value
+            return
+        }
+        join t value
+        send chan 5.0
+        load rp value
+        return
+    }
+
+// make_table(n) -> a new block holding the float64 squares of [0, n).
+.make_table:
+    let n, table, i, square, offset {
+        pop n
+        mul offset n 8.0
+        realloc table 0 offset
+        load i 0.0
+        for i < n {
+            mul square i i
+            mul offset i 8.0
+            poke table square offset MEMOP_FLOAT64
+            add i i 1.0
+        }
+        load rp table
+        return
+    }
+
+// table_at(table, i) -> entry i of a block made by make_table.
+.table_at:
+    let table, i, offset {
+        pop i
+        pop table
+        mul offset i 8.0
+        peek rp table offset MEMOP_FLOAT64
+        return
+    }
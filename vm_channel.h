@@ -0,0 +1,66 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+
+#include "_types.h"
+#include "vm_value.h"
+
+
+/** Outcome of a channel send or receive. @see vm_state::try_send */
+enum vm_channel_status : uint8_t
+{
+  /** The value was sent or received. */
+  VM_CHANNEL_OK,
+  /** The channel is full (for sends) or empty (for receives). */
+  VM_CHANNEL_BLOCKED,
+  /** The channel is closed and, for receives, has no values left. */
+  VM_CHANNEL_CLOSED,
+};
+
+
+/**
+ * A bounded FIFO of values passed between VM threads by the SEND and RECV
+ * instructions. Channels are owned by a vm_state and referred to by ID.
+ *
+ * Threads that can't send or receive yet park on the channel if they're
+ * running the outermost host call, or help their scheduler run other threads
+ * if they were deferred to one (see vm_thread::wait_for_channel). Parked
+ * threads are listed by their async tokens and woken one at a time as values
+ * are sent or received, or all at once when the channel is closed.
+ */
+class vm_channel
+{
+  friend class vm_state;
+
+  std::mutex _lock;
+  /** Values sent but not yet received. */
+  std::deque<vm_value> _values;
+  /** Maximum number of values held by the channel. */
+  size_t _capacity;
+  bool _closed = false;
+  /** Async tokens of threads parked on receives, in the order they parked. */
+  std::deque<int64_t> _parked_receivers;
+  /** Async tokens of threads parked on sends, in the order they parked. */
+  std::deque<int64_t> _parked_senders;
+
+  /** Returns whether a send or receive would not block. Requires _lock. */
+  bool ready(bool sending) const
+  {
+    return _closed || (sending ? _values.size() < _capacity : !_values.empty());
+  }
+
+public:
+  explicit vm_channel(size_t capacity) : _capacity(capacity) { /* nop */ }
+
+  vm_channel(vm_channel const &) = delete;
+  vm_channel &operator = (vm_channel const &) = delete;
+};
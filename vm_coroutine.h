@@ -0,0 +1,164 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+/*
+  Awaitable adapters for calling into the VM from C++20 coroutines. Only
+  defined when the compiler supports coroutines, since the rest of the VM
+  doesn't require them.
+
+  VM calls run on the host thread that awaits them. A call that returns,
+  yields, or runs out of fuel doesn't suspend the awaiting coroutine, which
+  gets the call's vm_resume_result right away. A call that parks on an async
+  callback (see vm_state::park_thread) suspends the coroutine instead, and the
+  coroutine is resumed from vm_state::run_completed once the call stops
+  again, so one host thread can drive many coroutines waiting on I/O:
+
+    vm_resume_result r = co_await vm_call(thread, fn, 1.0, 2.0);
+    while (r.status == VM_CALL_YIELDED) {
+      consume(r.value);
+      r = co_await vm_resume(thread);
+    }
+
+    // Elsewhere, on the same host thread:
+    while (vm.wait_completed()) {
+      vm.run_completed();
+    }
+
+  An awaiter uses its thread's resume hook (see vm_thread::set_resume_hook)
+  while the coroutine is suspended. Destroying the thread while it's parked
+  leaves the coroutine suspended for good.
+*/
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <utility>
+#include <vector>
+
+#include "vm_function.h"
+#include "vm_thread.h"
+#include "vm_value.h"
+
+
+/**
+ * Base of the VM awaiters. Keeps the awaiting coroutine suspended while the
+ * awaited call is parked and resumes it from vm_state::run_completed once the
+ * call returns, yields, or runs out of fuel.
+ */
+class vm_awaiter
+{
+  std::coroutine_handle<> _waiting;
+
+  static void resumed(vm_thread &thread, vm_resume_result result, void *context)
+  {
+    vm_awaiter &awaiter = *static_cast<vm_awaiter *>(context);
+    if (result.status == VM_CALL_PARKED) {
+      // Parked on another callback before stopping.
+      thread.set_resume_hook(&resumed, &awaiter);
+      return;
+    }
+    awaiter._result = result;
+    awaiter._waiting.resume();
+  }
+
+protected:
+  vm_thread &_thread;
+  vm_resume_result _result { VM_CALL_COMPLETE, vm_value::undefined() };
+
+  explicit vm_awaiter(vm_thread &thread) : _thread(thread) { /* nop */ }
+
+  /**
+   * Called by await_suspend once the awaited call has stopped and its outcome
+   * is in _result. Returns whether the coroutine stays suspended.
+   */
+  bool suspend_if_parked(std::coroutine_handle<> waiting)
+  {
+    if (_result.status != VM_CALL_PARKED) {
+      return false;
+    }
+    _waiting = waiting;
+    _thread.set_resume_hook(&resumed, this);
+    return true;
+  }
+
+public:
+  vm_awaiter(vm_awaiter const &) = delete;
+  vm_awaiter &operator = (vm_awaiter const &) = delete;
+
+  bool await_ready() const noexcept { return false; }
+  vm_resume_result await_resume() const { return _result; }
+};
+
+
+
+/** Awaitable returned by vm_call. */
+class vm_call_awaiter : public vm_awaiter
+{
+  vm_function_handle _fn;
+  std::vector<vm_value> _args;
+
+public:
+  vm_call_awaiter(vm_thread &thread, vm_function_handle const &fn, std::vector<vm_value> &&args)
+  : vm_awaiter(thread)
+  , _fn(fn)
+  , _args(std::move(args))
+  {
+    /* nop */
+  }
+
+  bool await_suspend(std::coroutine_handle<> waiting)
+  {
+    int64_t const argc = static_cast<int64_t>(_args.size());
+    vm_value const result = _thread.call_function_nt(_fn, argc, _args.data());
+    vm_call_status const status = _thread.call_status();
+    bool const has_value = status == VM_CALL_COMPLETE || status == VM_CALL_YIELDED;
+    _result = { status, has_value ? result : vm_value::undefined() };
+    return suspend_if_parked(waiting);
+  }
+};
+
+
+
+/** Awaitable returned by vm_resume. */
+class vm_resume_awaiter : public vm_awaiter
+{
+public:
+  explicit vm_resume_awaiter(vm_thread &thread) : vm_awaiter(thread) { /* nop */ }
+
+  bool await_suspend(std::coroutine_handle<> waiting)
+  {
+    _result = _thread.resume();
+    return suspend_if_parked(waiting);
+  }
+};
+
+
+
+/**
+ * Returns an awaitable that calls a function handle on the thread with the
+ * given arguments.
+ */
+template <class... ARGS>
+vm_call_awaiter vm_call(vm_thread &thread, vm_function_handle const &fn, ARGS &&... args)
+{
+  return vm_call_awaiter(thread, fn, { make_value(std::forward<ARGS>(args))... });
+}
+
+
+
+/**
+ * Returns an awaitable that resumes the thread's suspended host call.
+ */
+inline vm_resume_awaiter vm_resume(vm_thread &thread)
+{
+  return vm_resume_awaiter(thread);
+}
+
+#endif
@@ -37,12 +37,29 @@ struct vm_null_access_error;
 struct vm_invalid_argument_count;
 /** Exception thrown for using a thread with the wrong process. */
 struct vm_wrong_process;
+/**
+ * Exception thrown for resuming a thread that isn't suspended or calling into
+ * one that is.
+ */
+struct vm_thread_state_error;
+/** Thrown for a thread ID that doesn't name a live thread. */
+struct vm_bad_thread;
+/**
+ * Thrown for creating a channel with no capacity, using one that doesn't
+ * exist, or sending to a closed one.
+ */
+struct vm_bad_channel;
 /** Thrown if bytecode contains an unrecognized opcode. */
 struct vm_bad_opcode;
 /** Generic unit loading consistency error */
 struct vm_bad_unit;
 /** Generic unit loading IO error */
 struct vm_unit_io_error;
+/**
+ * Thrown for a snapshot that can't be read or doesn't match the state it's
+ * restored into.
+ */
+struct vm_bad_snapshot;
 /**
  * Exception thrown specifically for units that are of an unsupported
  * bytecode version.
@@ -70,10 +87,14 @@ VM_DECLARE_EXCEPTION(vm_memory_permission_error, vm_memory_access_error);
 VM_DECLARE_EXCEPTION(vm_null_access_error, vm_memory_access_error);
 VM_DECLARE_EXCEPTION(vm_invalid_argument_count, vm_logic_error);
 VM_DECLARE_EXCEPTION(vm_wrong_process, vm_logic_error);
+VM_DECLARE_EXCEPTION(vm_thread_state_error, vm_logic_error);
+VM_DECLARE_EXCEPTION(vm_bad_thread, vm_logic_error);
+VM_DECLARE_EXCEPTION(vm_bad_channel, vm_logic_error);
 
 VM_DECLARE_EXCEPTION(vm_bad_opcode, vm_runtime_error);
 VM_DECLARE_EXCEPTION(vm_unit_io_error, vm_runtime_error);
 VM_DECLARE_EXCEPTION(vm_bad_unit, vm_runtime_error);
+VM_DECLARE_EXCEPTION(vm_bad_snapshot, vm_runtime_error);
 
 VM_DECLARE_EXCEPTION(vm_unsupported_unit_version, vm_bad_unit);
 
@@ -12,5 +12,5 @@
 
 vm_value vm_function::operator() ()
 {
-  return _thread.call_function(_pointer, 0);
+  return _thread.call_function_nt(_handle, 0);
 }
@@ -11,21 +11,79 @@
 #include <cstdint>
 #include <utility>
 
+#include "_types.h"
 #include "vm_value.h"
 
 
 class vm_thread;
+class vm_state;
+class vm_function_handle;
 
 
 // Semi-internal.
 template <class... ARGS>
-vm_value vm_invoke_function(vm_thread &thread, int64_t pointer, ARGS &&... args);
+vm_value vm_invoke_function(vm_thread &thread, vm_function_handle const &fn, ARGS &&... args);
+
+
+
+/**
+ * A function resolved against a specific VM state.
+ *
+ * A handle is looked up once (see vm_state::find_function_handle) and caches
+ * what's needed to call the function: its entry instruction pointer, its
+ * callback slot if it's a host callback, and its declared arity. It may be
+ * called from any thread of the state that resolved it without any further
+ * name lookups. Handles are invalidated by changing the state's unit.
+ */
+class vm_function_handle
+{
+  /** The state the handle was resolved against. Null if unresolved. */
+  vm_state const *_process = nullptr;
+  /**
+   * The instruction pointer of the function.
+   *
+   * If negative, points to a host callback.
+   */
+  int64_t _pointer = 0;
+  /** Index of the host callback in the state, or -1 for VM functions. */
+  int64_t _callback = -1;
+  /** The number of arguments the function takes. -1 if not checked. */
+  int64_t _arity = -1;
+
+  vm_function_handle(vm_state const &process, int64_t pointer, int64_t arity)
+  : _process(&process)
+  , _pointer(pointer)
+  , _callback(pointer < 0 ? -(pointer + 1) : -1)
+  , _arity(arity)
+  {
+    // nop
+  }
+
+  friend vm_state;
+  friend vm_thread;
+
+public:
+  /** Constructs an unresolved handle. Calling it is an error. */
+  vm_function_handle() = default;
+
+  /** Returns whether the handle was resolved against a state. */
+  bool is_valid() const { return _process != nullptr; }
+  /** Returns whether the handle refers to a host callback. */
+  bool is_callback() const { return _callback >= 0; }
+  /** Returns the function's instruction pointer. */
+  int64_t pointer() const { return _pointer; }
+  /** Returns the function's declared arity, or -1 if it isn't checked. */
+  int64_t arity() const { return _arity; }
+};
+
+
+using vm_found_handle_t = vm_find_result<vm_function_handle>;
 
 
 /**
  * Invokable function type for Rusalka.
  *
- * vm_function is bound to a specific thread and, given an instruction pointer,
+ * vm_function is bound to a specific thread and, given a function handle,
  * can be used to call a VM function (whether it's a host callback or bytecode
  * function) similar to a normal function. Automagically converts its arguments
  * to VM values.
@@ -34,16 +92,12 @@ class vm_function
 {
   /** The thread the function is bound to. */
   vm_thread &_thread;
-  /**
-   * The instruction pointer of the function.
-   *
-   * If negative, points to a host callback.
-   */
-  int64_t _pointer;
+  /** The function to call. */
+  vm_function_handle _handle;
 
-  vm_function(vm_thread &thread, int64_t pointer)
+  vm_function(vm_thread &thread, vm_function_handle const &handle)
   : _thread(thread)
-  , _pointer(pointer)
+  , _handle(handle)
   {
     // nop
   }
@@ -74,5 +128,5 @@ public:
 template <class... ARGS>
 vm_value vm_function::operator()(ARGS&&... args)
 {
-  return vm_invoke_function(_thread, _pointer, std::forward<ARGS>(args)...);
+  return vm_invoke_function(_thread, _handle, std::forward<ARGS>(args)...);
 }
@@ -45,4 +45,10 @@ INSTRUCTION( PEEK,            PEEK,         34,         5,    output, input, inp
 INSTRUCTION( POKE,            POKE,         35,         5,    regonly, input, input, input, litflag ) // r(mem), lr(value), lr(offset), lr(kind), litflag
 INSTRUCTION( DEFER,           DEFER,        36,         1,    output )
 INSTRUCTION( JOIN,            JOIN,         37,         2,    output, regonly )
+INSTRUCTION( RCALL,           RCALL,        38,         3,    input, input, litflag )
+INSTRUCTION( YIELD,           YIELD,        39,         2,    input, litflag )
+INSTRUCTION( CHANNEL,         CHANNEL,      40,         3,    output, input, litflag )
+INSTRUCTION( SEND,            SEND,         41,         3,    input, input, litflag )
+INSTRUCTION( RECV,            RECV,         42,         4,    output, output, input, litflag )
+INSTRUCTION( CLOSE,           CLOSE,        43,         2,    input, litflag )
 // END INSTRUCTIONS
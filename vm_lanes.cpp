@@ -0,0 +1,404 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <algorithm>
+
+#include "vm_lanes.h"
+#include "vm_state.h"
+#include "vm_op.h"
+#include "vm_exception.h"
+#include "vm_thread+math.inl"
+
+
+
+/**
+ * Constructs a kernel for the function at entry. The kernel isn't usable until
+ * it's been verified.
+ */
+vm_lane_kernel::vm_lane_kernel(vm_state const &process, int64_t entry, int64_t arity)
+: _process(&process)
+, _entry(entry)
+, _arity(arity)
+{
+  std::fill(std::begin(_register_slots), std::end(_register_slots), -1);
+}
+
+
+
+/**
+ * Walks every instruction reachable from the kernel's entry point and checks
+ * that the function can run in lanes, assigning lane register slots to every
+ * register it uses along the way. Returns false if the function doesn't
+ * qualify.
+ */
+bool vm_lane_kernel::verify()
+{
+  vm_unit const &unit = _process->_unit;
+  int64_t const source_size = _process->_source_size;
+  std::vector<bool> visited(source_size, false);
+  std::vector<int64_t> pending { _entry };
+
+  // RP always needs a slot since it's read for each row's result.
+  use_register(vm_value(int64_t(vm_thread::R_RP)));
+
+  while (!pending.empty()) {
+    int64_t const ip = pending.back();
+    pending.pop_back();
+
+    if (ip < 0 || ip >= source_size) {
+      return false;
+    } else if (visited[ip]) {
+      continue;
+    }
+    visited[ip] = true;
+
+    vm_op const op = unit.fetch_op(ip);
+    uint64_t const litflag = op.litflag();
+
+    switch (op.opcode()) {
+    case ADD: case SUB: case DIV: case IDIV: case MUL: case POW: case MOD:
+    case IMOD: case OR: case AND: case XOR: case ARITHSHIFT: case BITSHIFT:
+      if (!use_register(op[0]) ||
+          !use_input(op[1], litflag & 0x2) ||
+          !use_input(op[2], litflag & 0x4)) {
+        return false;
+      }
+      pending.push_back(ip + 1);
+      break;
+
+    case NEG: case NOT: case FLOOR: case CEIL: case ROUND: case RINT:
+      if (!use_register(op[0]) || !use_register(op[1])) {
+        return false;
+      }
+      pending.push_back(ip + 1);
+      break;
+
+    case EQ: case LT: case LE:
+      if (!use_input(op[0], litflag & 0x1) || !use_input(op[1], litflag & 0x2)) {
+        return false;
+      }
+      pending.push_back(ip + 1);
+      pending.push_back(ip + 2);
+      break;
+
+    case JUMP: {
+      // Jumps through registers can't be followed ahead of time.
+      vm_value const target = op[0].as(vm_value::SIGNED);
+      if (!(litflag & 0x1) || target.is_undefined() || target.is_error()) {
+        return false;
+      }
+      pending.push_back(target);
+    } break;
+
+    case LOAD:
+      if (!use_register(op[0]) || !use_input(op[1], litflag & 0x2)) {
+        return false;
+      }
+      pending.push_back(ip + 1);
+      break;
+
+    case POP:
+      if (!use_register(op[0])) {
+        return false;
+      }
+      pending.push_back(ip + 1);
+      break;
+
+    case RETURN:
+    case TRAP:
+      break;
+
+    default:
+      return false;
+    }
+  }
+
+  _lane_registers.resize(_slot_count * VM_LANE_COUNT);
+  return true;
+}
+
+
+
+/**
+ * Assigns a lane register slot to a register operand. Returns false if the
+ * operand isn't a register lanes may use (IP, EBP, ESP, and stack-relative
+ * operands are excluded).
+ */
+bool vm_lane_kernel::use_register(vm_value operand)
+{
+  int64_t const reg = operand;
+  if (reg < vm_thread::R_RP || reg >= vm_thread::REGISTER_COUNT) {
+    return false;
+  } else if (_register_slots[reg] < 0) {
+    _register_slots[reg] = _slot_count++;
+  }
+  return true;
+}
+
+
+
+/**
+ * Assigns a lane register slot to an input operand if it's not a literal.
+ */
+bool vm_lane_kernel::use_input(vm_value operand, bool literal)
+{
+  return literal || use_register(operand);
+}
+
+
+
+/**
+ * Returns the lane values of a register used by the kernel, indexed by lane.
+ */
+vm_value *vm_lane_kernel::lane_register(int64_t reg)
+{
+  return &_lane_registers[_register_slots[reg] * VM_LANE_COUNT];
+}
+
+
+
+/**
+ * Returns a per-lane view of an input operand.
+ */
+auto vm_lane_kernel::lane_input(vm_value operand, bool literal) -> lane_operand
+{
+  return lane_operand { operand, literal ? nullptr : lane_register(operand) };
+}
+
+
+
+template <vm_opcode OPCODE>
+void vm_lane_kernel::exec_binary(vm_op const &op, lane_set const &lanes)
+{
+  uint64_t const litflag = op.litflag();
+  vm_value *const out = lane_register(op[0]);
+  lane_operand const lhs = lane_input(op[1], litflag & 0x2);
+  lane_operand const rhs = lane_input(op[2], litflag & 0x4);
+
+  for (int32_t index = 0; index < lanes.count; ++index) {
+    int32_t const lane = lanes.index[index];
+    vm_binary_op<OPCODE>(out[lane], lhs[lane], rhs[lane]);
+  }
+}
+
+
+
+template <vm_opcode OPCODE>
+void vm_lane_kernel::exec_unary(vm_op const &op, lane_set const &lanes)
+{
+  vm_value *const out = lane_register(op[0]);
+  vm_value const *const in = lane_register(op[1]);
+
+  for (int32_t index = 0; index < lanes.count; ++index) {
+    int32_t const lane = lanes.index[index];
+    vm_unary_op<OPCODE>(out[lane], in[lane]);
+  }
+}
+
+
+
+/**
+ * Runs a comparison for each lane, skipping the next instruction for lanes
+ * whose result doesn't match the expected result.
+ */
+template <vm_opcode OPCODE>
+void vm_lane_kernel::exec_compare(vm_op const &op, lane_set const &lanes, int64_t *lane_ip)
+{
+  uint64_t const litflag = op.litflag();
+  lane_operand const lhs = lane_input(op[0], litflag & 0x1);
+  lane_operand const rhs = lane_input(op[1], litflag & 0x2);
+  bool const expected = op[2] != 0;
+
+  for (int32_t index = 0; index < lanes.count; ++index) {
+    int32_t const lane = lanes.index[index];
+    if (vm_compare_op<OPCODE>(lhs[lane], rhs[lane]) != expected) {
+      lane_ip[lane] += 1;
+    }
+  }
+}
+
+
+
+/**
+ * Calls the kernel once for each of `rows` argument tuples and returns the
+ * number of rows before the first row that trapped (or `rows` if none did).
+ *
+ * Arguments and results are laid out the same way as for
+ * vm_thread::call_batch. Rows run in groups of VM_LANE_COUNT; if a row traps,
+ * the rest of its group still finishes, but later groups are skipped.
+ */
+int64_t vm_lane_kernel::call_batch(
+  int64_t rows,
+  const vm_value *args,
+  int64_t stride,
+  vm_value *results,
+  vm_call_status *status
+  )
+{
+  if (!is_valid()) {
+    throw vm_invalid_instruction_pointer("Attempt to call an unresolved lane kernel");
+  } else if (rows < 0) {
+    throw vm_invalid_argument_count("Attempt to call a batch with fewer than 0 rows");
+  } else if (_arity > stride) {
+    throw vm_invalid_argument_count("Batch stride is smaller than the function's declared arity");
+  }
+
+  int64_t first_trap = rows;
+  int64_t row = 0;
+
+  while (row < rows && first_trap == rows) {
+    int32_t const lanes = static_cast<int32_t>(std::min<int64_t>(VM_LANE_COUNT, rows - row));
+    int64_t const trapped = run_lanes(row, lanes, args, stride, results, status);
+    row += lanes;
+    if (trapped < row) {
+      first_trap = trapped;
+    }
+  }
+
+  if (status) {
+    std::fill(status + row, status + rows, VM_CALL_SKIPPED);
+  }
+
+  return first_trap;
+}
+
+
+
+/**
+ * Runs one group of rows, starting at first_row, in lanes. Returns the first
+ * row in the group that trapped, or first_row + lanes if none did.
+ */
+int64_t vm_lane_kernel::run_lanes(
+  int64_t first_row,
+  int32_t lanes,
+  const vm_value *args,
+  int64_t stride,
+  vm_value *results,
+  vm_call_status *status
+  )
+{
+  vm_unit const &unit = _process->_unit;
+  int64_t lane_ip[VM_LANE_COUNT];
+  int64_t lane_args[VM_LANE_COUNT];
+  bool lane_running[VM_LANE_COUNT] {};
+  int32_t running = lanes;
+  int64_t first_trap = first_row + lanes;
+
+  std::fill(_lane_registers.begin(), _lane_registers.end(), vm_value { 0.0 });
+  for (int32_t lane = 0; lane < lanes; ++lane) {
+    lane_ip[lane] = _entry;
+    lane_args[lane] = _arity;
+    lane_running[lane] = true;
+  }
+
+  vm_value *const rp = lane_register(vm_thread::R_RP);
+
+  while (running > 0) {
+    int64_t ip = INT64_MAX;
+    for (int32_t lane = 0; lane < lanes; ++lane) {
+      if (lane_running[lane] && lane_ip[lane] < ip) {
+        ip = lane_ip[lane];
+      }
+    }
+
+    lane_set active { 0, {} };
+    for (int32_t lane = 0; lane < lanes; ++lane) {
+      if (lane_running[lane] && lane_ip[lane] == ip) {
+        active.index[active.count++] = lane;
+        lane_ip[lane] = ip + 1;
+      }
+    }
+
+    vm_op const op = unit.fetch_op(ip);
+
+    switch (op.opcode()) {
+    case ADD: exec_binary<ADD>(op, active); break;
+    case SUB: exec_binary<SUB>(op, active); break;
+    case DIV: exec_binary<DIV>(op, active); break;
+    case IDIV: exec_binary<IDIV>(op, active); break;
+    case MUL: exec_binary<MUL>(op, active); break;
+    case POW: exec_binary<POW>(op, active); break;
+    case MOD: exec_binary<MOD>(op, active); break;
+    case IMOD: exec_binary<IMOD>(op, active); break;
+    case OR: exec_binary<OR>(op, active); break;
+    case AND: exec_binary<AND>(op, active); break;
+    case XOR: exec_binary<XOR>(op, active); break;
+    case ARITHSHIFT: exec_binary<ARITHSHIFT>(op, active); break;
+    case BITSHIFT: exec_binary<BITSHIFT>(op, active); break;
+
+    case NEG: exec_unary<NEG>(op, active); break;
+    case NOT: exec_unary<NOT>(op, active); break;
+    case FLOOR: exec_unary<FLOOR>(op, active); break;
+    case CEIL: exec_unary<CEIL>(op, active); break;
+    case ROUND: exec_unary<ROUND>(op, active); break;
+    case RINT: exec_unary<RINT>(op, active); break;
+
+    case EQ: exec_compare<EQ>(op, active, lane_ip); break;
+    case LT: exec_compare<LT>(op, active, lane_ip); break;
+    case LE: exec_compare<LE>(op, active, lane_ip); break;
+
+    case JUMP: {
+      int64_t const target = op[0].as(vm_value::SIGNED);
+      for (int32_t index = 0; index < active.count; ++index) {
+        lane_ip[active.index[index]] = target;
+      }
+    } break;
+
+    case LOAD: {
+      vm_value *const out = lane_register(op[0]);
+      lane_operand const input = lane_input(op[1], op.litflag() & 0x2);
+      for (int32_t index = 0; index < active.count; ++index) {
+        int32_t const lane = active.index[index];
+        out[lane] = input[lane];
+      }
+    } break;
+
+    // Pops the lane's arguments in the same order a CALL would.
+    case POP: {
+      vm_value *const out = lane_register(op[0]);
+      for (int32_t index = 0; index < active.count; ++index) {
+        int32_t const lane = active.index[index];
+        if (lane_args[lane] <= 0) {
+          throw vm_stack_underflow("Attempt to pop from stack when ESP is EBP");
+        }
+        out[lane] = args[(first_row + lane) * stride + --lane_args[lane]];
+      }
+    } break;
+
+    case RETURN: {
+      for (int32_t index = 0; index < active.count; ++index) {
+        int32_t const lane = active.index[index];
+        results[first_row + lane] = rp[lane];
+        if (status) {
+          status[first_row + lane] = VM_CALL_COMPLETE;
+        }
+        lane_running[lane] = false;
+      }
+      running -= active.count;
+    } break;
+
+    case TRAP: {
+      for (int32_t index = 0; index < active.count; ++index) {
+        int32_t const lane = active.index[index];
+        if (status) {
+          status[first_row + lane] = VM_CALL_TRAPPED;
+        }
+        first_trap = std::min(first_trap, first_row + lane);
+        lane_running[lane] = false;
+      }
+      running -= active.count;
+    } break;
+
+    default:
+      // Unreachable for verified kernels.
+      throw vm_bad_opcode("Invalid opcode in lane kernel");
+    }
+  }
+
+  return first_trap;
+}
@@ -0,0 +1,131 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "_types.h"
+#include "vm_function.h"
+#include "vm_opcode.h"
+#include "vm_thread.h"
+#include "vm_value.h"
+
+
+#ifndef VM_LANE_COUNT
+#define VM_LANE_COUNT 8
+#endif
+
+
+/**
+ * Runs a pure arithmetic VM function over several argument rows at once.
+ *
+ * A lane kernel gives each of VM_LANE_COUNT rows ("lanes") its own copy of the
+ * registers the function uses and executes one instruction for every lane
+ * waiting on it, so each instruction is fetched and decoded once per group of
+ * rows instead of once per row. Lanes that branch differently are tracked by
+ * their own instruction pointers and rejoin once they reach the same
+ * instruction (the lowest pending instruction always runs next).
+ *
+ * A function qualifies if every instruction reachable from its entry point is
+ * an arithmetic, bitwise, rounding, or comparison instruction, a LOAD, a POP
+ * of one of its arguments, a JUMP to a literal address, RETURN, or TRAP, and
+ * it only accesses registers from RP onward. This is checked once when the
+ * kernel is resolved (see vm_state::find_lane_kernel).
+ *
+ * Every row's registers start at 0.0, as a new thread's do. A function that
+ * reads a register before writing it sees 0.0 in every row, where a call on a
+ * thread would see whatever was last left in the register, so such functions
+ * only give the same results in lanes as on a fresh thread.
+ */
+class vm_lane_kernel
+{
+  friend class vm_state;
+
+  /** A set of lane indices to execute an instruction for. */
+  struct lane_set
+  {
+    int32_t count;
+    int32_t index[VM_LANE_COUNT];
+  };
+
+  /**
+   * A per-lane view of an instruction operand. Literal operands are the same
+   * value for every lane.
+   */
+  struct lane_operand
+  {
+    vm_value literal;
+    vm_value const *lanes;
+
+    vm_value operator [] (int32_t lane) const { return lanes ? lanes[lane] : literal; }
+  };
+
+  /** The state the kernel was resolved against. */
+  vm_state const *_process = nullptr;
+  /** The function's instruction pointer. */
+  int64_t _entry = 0;
+  /** The number of arguments passed to each row. */
+  int64_t _arity = 0;
+  /** Number of registers the function uses. */
+  int32_t _slot_count = 0;
+  /**
+   * Maps VM register numbers to lane register slots. Registers the function
+   * doesn't use are -1.
+   */
+  int32_t _register_slots[vm_thread::REGISTER_COUNT] {};
+  /** Lane registers, stored as VM_LANE_COUNT values per slot. */
+  std::vector<vm_value> _lane_registers;
+
+  vm_lane_kernel(vm_state const &process, int64_t entry, int64_t arity);
+
+  bool verify();
+  bool use_register(vm_value operand);
+  bool use_input(vm_value operand, bool literal);
+
+  vm_value *lane_register(int64_t reg);
+  lane_operand lane_input(vm_value operand, bool literal);
+
+  int64_t run_lanes(
+    int64_t first_row,
+    int32_t lanes,
+    const vm_value *args,
+    int64_t stride,
+    vm_value *results,
+    vm_call_status *status
+    );
+
+  template <vm_opcode OPCODE>
+  void exec_binary(vm_op const &op, lane_set const &lanes);
+
+  template <vm_opcode OPCODE>
+  void exec_unary(vm_op const &op, lane_set const &lanes);
+
+  template <vm_opcode OPCODE>
+  void exec_compare(vm_op const &op, lane_set const &lanes, int64_t *lane_ip);
+
+public:
+  /** Constructs an unresolved kernel. Calling it is an error. */
+  vm_lane_kernel() = default;
+
+  /** Returns whether the kernel was resolved against a state. */
+  bool is_valid() const { return _process != nullptr; }
+  /** Returns the number of arguments passed to each row. */
+  int64_t arity() const { return _arity; }
+
+  int64_t call_batch(
+    int64_t rows,
+    const vm_value *args,
+    int64_t stride,
+    vm_value *results,
+    vm_call_status *status = nullptr
+    );
+};
+
+
+using vm_found_lanes_t = vm_find_result<vm_lane_kernel>;
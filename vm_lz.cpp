@@ -0,0 +1,115 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "vm_lz.h"
+
+
+namespace {
+
+
+/** Size of the fixed copies used for short literal runs and matches. */
+constexpr size_t FAST_COPY = 16;
+
+
+/**
+ * Reads extra length bytes after a length of 15 in a token. Returns false if
+ * the input ends first.
+ */
+bool read_length(uint8_t const *&ip, uint8_t const *end, size_t &length)
+{
+  uint8_t byte;
+  do {
+    if (ip == end) {
+      return false;
+    }
+    byte = *ip++;
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+
+} // namespace
+
+
+
+bool vm_lz_decompress(void const *src, size_t src_size, void *dst, size_t dst_size)
+{
+  uint8_t const *ip = static_cast<uint8_t const *>(src);
+  uint8_t const *const ip_end = ip + src_size;
+  uint8_t *const op_start = static_cast<uint8_t *>(dst);
+  uint8_t *op = op_start;
+  uint8_t *const op_end = op_start + dst_size;
+
+  while (ip < ip_end) {
+    uint8_t const token = *ip++;
+
+    size_t literals = token >> 4;
+    if (literals == 15 && !read_length(ip, ip_end, literals)) {
+      return false;
+    } else if (literals > static_cast<size_t>(ip_end - ip) ||
+               literals > static_cast<size_t>(op_end - op)) {
+      return false;
+    }
+
+    // Short runs are copied with a fixed-size copy when both buffers have
+    // room for it, which is much cheaper than a variable-length one.
+    if (literals <= FAST_COPY && static_cast<size_t>(ip_end - ip) >= FAST_COPY &&
+        static_cast<size_t>(op_end - op) >= FAST_COPY) {
+      std::memcpy(op, ip, FAST_COPY);
+    } else {
+      std::memcpy(op, ip, literals);
+    }
+    ip += literals;
+    op += literals;
+
+    // The final run ends with its literals.
+    if (ip == ip_end) {
+      break;
+    } else if (ip_end - ip < 2) {
+      return false;
+    }
+
+    size_t const offset = static_cast<size_t>(ip[0]) | (static_cast<size_t>(ip[1]) << 8);
+    ip += 2;
+
+    size_t length = token & 0xF;
+    if (length == 15 && !read_length(ip, ip_end, length)) {
+      return false;
+    }
+    length += VM_LZ_MIN_MATCH;
+
+    if (offset == 0 || offset > static_cast<size_t>(op - op_start) ||
+        length > static_cast<size_t>(op_end - op)) {
+      return false;
+    }
+
+    uint8_t const *const match = op - offset;
+    if (length <= FAST_COPY && offset >= FAST_COPY && static_cast<size_t>(op_end - op) >= FAST_COPY) {
+      std::memcpy(op, match, FAST_COPY);
+      op += length;
+    } else if (offset >= length) {
+      std::memcpy(op, match, length);
+      op += length;
+    } else {
+      // Overlapping matches repeat the last offset bytes. Each copy doubles
+      // how much of the pattern has been written, so it's copied in larger
+      // pieces as it goes.
+      for (uint8_t *const match_end = op + length; op < match_end; ) {
+        size_t const piece = std::min(static_cast<size_t>(op - match), static_cast<size_t>(match_end - op));
+        std::memcpy(op, match, piece);
+        op += piece;
+      }
+    }
+  }
+
+  return op == op_end;
+}
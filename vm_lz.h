@@ -0,0 +1,40 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+  Minimum length of a match in LZ-compressed data.
+*/
+const size_t VM_LZ_MIN_MATCH = 4;
+
+
+
+/**
+  Decompresses LZ-compressed data, as used by compressed data blocks in
+  bytecode units, into a buffer of exactly the decompressed size.
+
+  Compressed data is a sequence of runs. Each run starts with a token byte
+  whose high four bits are a literal length and whose low four bits are a
+  match length minus VM_LZ_MIN_MATCH. A length of 15 is followed by extra
+  length bytes, each added to it, until one is less than 255. The literals
+  follow the literal length, then a 16-bit little-endian offset back into the
+  output and the extra match length bytes. The final run has no match.
+
+  @param src      The compressed data.
+  @param src_size The size of the compressed data.
+  @param dst      The buffer to decompress into.
+  @param dst_size The size of the decompressed data.
+  @return Whether the data decompressed to exactly dst_size bytes. Malformed
+  input never reads or writes outside of either buffer.
+*/
+bool vm_lz_decompress(void const *src, size_t src_size, void *dst, size_t dst_size);
@@ -0,0 +1,210 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include "vm_exception.h"
+#include "vm_round_robin.h"
+
+
+/**
+ * Creates a round robin over the given state's threads, giving priority 1
+ * threads quantum instructions per turn.
+ */
+vm_round_robin::vm_round_robin(vm_state &process, int64_t quantum)
+: _process(process)
+, _quantum(quantum)
+{
+  if (quantum < 1) {
+    throw vm_logic_error("Round robin quantum must be at least 1");
+  }
+}
+
+
+
+/**
+ * Starts a call to a function handle on the thread and schedules it. The call
+ * doesn't run until the thread's turn. Once the call returns, the thread is
+ * no longer scheduled.
+ *
+ * A thread with priority N runs N times as many instructions per turn as a
+ * thread with priority 1.
+ */
+void vm_round_robin::start(
+  vm_thread &thread,
+  vm_function_handle const &fn,
+  int64_t argc,
+  const vm_value *argv,
+  int64_t priority
+  )
+{
+  if (&thread.process() != &_process) {
+    throw vm_wrong_process("Thread process doesn't match the round robin's process");
+  } else if (_entries.count(&thread)) {
+    throw vm_thread_state_error("Attempt to start a call on a thread that's already scheduled");
+  } else if (thread.suspended()) {
+    throw vm_thread_state_error("Attempt to start a call on a thread with a suspended call");
+  } else if (priority < 1) {
+    throw vm_logic_error("Thread priority must be at least 1");
+  }
+
+  thread.start_call(fn, argc, argv);
+  _entries.emplace(&thread, entry { &thread, priority });
+  _runnable.push_back(&thread);
+}
+
+
+
+/**
+ * Changes a scheduled thread's priority. Takes effect on its next turn.
+ */
+void vm_round_robin::set_priority(vm_thread &thread, int64_t priority)
+{
+  auto const iter = _entries.find(&thread);
+  if (iter == _entries.end()) {
+    throw vm_thread_state_error("Attempt to set the priority of a thread that isn't scheduled");
+  } else if (priority < 1) {
+    throw vm_logic_error("Thread priority must be at least 1");
+  }
+  iter->second.priority = priority;
+}
+
+
+
+/**
+ * Puts the thread to sleep for the given number of milliseconds. Meant to be
+ * called from a host callback bound for scripts to sleep with, e.g.:
+ *
+ *   vm_value sleep_fn(vm_thread &thread, int32_t argc, vm_value const *argv, void *context)
+ *   {
+ *     static_cast<vm_round_robin *>(context)->sleep(thread, argv[0]);
+ *     return vm_value(0.0);
+ *   }
+ *
+ * The thread is parked once the callback returns and is runnable again after
+ * the delay. Like any parked thread, it must be running the outermost host
+ * call.
+ */
+void vm_round_robin::sleep(vm_thread &thread, int64_t milliseconds)
+{
+  int64_t const token = _process.park_thread(thread);
+  clock_type_t::time_point const wake_time = clock_type_t::now() + std::chrono::milliseconds(milliseconds);
+  _sleepers.emplace(wake_time, token);
+}
+
+
+
+/**
+ * Completes the async waits of threads whose sleep has ended.
+ */
+void vm_round_robin::wake_sleepers()
+{
+  clock_type_t::time_point const now = clock_type_t::now();
+  while (!_sleepers.empty() && _sleepers.begin()->first <= now) {
+    _process.complete_async(_sleepers.begin()->second, vm_value(0.0));
+    _sleepers.erase(_sleepers.begin());
+  }
+}
+
+
+
+/**
+ * Makes threads whose async waits have been completed runnable again. Threads
+ * that aren't scheduled are resumed right away, as run_completed would.
+ */
+void vm_round_robin::take_completed()
+{
+  while (vm_thread *const thread = _process.take_completed()) {
+    if (_entries.count(thread)) {
+      _runnable.push_back(thread);
+    } else {
+      thread->resume();
+    }
+  }
+}
+
+
+
+/**
+ * Runs a thread for one turn and reschedules it based on how the turn ended.
+ */
+void vm_round_robin::run_turn(vm_thread *thread)
+{
+  auto const iter = _entries.find(thread);
+  thread->set_fuel(_quantum * iter->second.priority);
+
+  vm_resume_result outcome;
+  try {
+    outcome = thread->resume();
+  } catch (...) {
+    thread->set_fuel(VM_UNLIMITED_FUEL);
+    _entries.erase(iter);
+    throw;
+  }
+
+  switch (outcome.status) {
+  case VM_CALL_COMPLETE:
+    thread->set_fuel(VM_UNLIMITED_FUEL);
+    _entries.erase(iter);
+    break;
+
+  case VM_CALL_YIELDED:
+  case VM_CALL_SUSPENDED:
+    _runnable.push_back(thread);
+    break;
+
+  default:
+    // Parked. Made runnable again by take_completed.
+    return;
+  }
+
+  if (_on_result && outcome.status != VM_CALL_SUSPENDED) {
+    _on_result(*thread, outcome, _result_context);
+  }
+}
+
+
+
+/**
+ * Gives every runnable thread one turn, in order. Threads woken during the
+ * round wait for the next one. Returns whether any threads are still
+ * scheduled.
+ *
+ * If a thread throws, it's unscheduled and the exception is passed on. The
+ * round can be continued by calling run_round again.
+ */
+bool vm_round_robin::run_round()
+{
+  wake_sleepers();
+  take_completed();
+
+  for (size_t turns = _runnable.size(); turns > 0; --turns) {
+    vm_thread *const thread = _runnable.front();
+    _runnable.pop_front();
+    run_turn(thread);
+  }
+
+  return !_entries.empty();
+}
+
+
+
+/**
+ * Runs rounds until every scheduled thread has returned. Waits for sleeping
+ * and parked threads to be woken when no threads are runnable.
+ */
+void vm_round_robin::run()
+{
+  while (run_round()) {
+    if (!_runnable.empty()) {
+      continue;
+    } else if (!_sleepers.empty()) {
+      _process.wait_completed(_sleepers.begin()->first);
+    } else if (!_process.wait_completed()) {
+      throw vm_thread_state_error("Scheduled threads can't be woken");
+    }
+  }
+}
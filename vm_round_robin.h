@@ -0,0 +1,96 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <unordered_map>
+
+#include "_types.h"
+#include "vm_state.h"
+#include "vm_thread.h"
+
+
+/**
+ * Number of instructions a priority 1 thread runs per turn.
+ */
+#ifndef VM_ROUND_ROBIN_QUANTUM
+#define VM_ROUND_ROBIN_QUANTUM 10000
+#endif
+
+
+/**
+ * Runs many VM threads of one state on the calling host thread by giving each
+ * runnable thread a bounded number of instructions per turn and rotating
+ * through them, so no long-running script can starve the others.
+ *
+ * A thread's turn is metered with fuel (see vm_thread::set_fuel), so it ends
+ * at the first call or backward jump after its quantum runs out. A thread's
+ * quantum is the scheduler's base quantum times its priority. Threads that
+ * park (on an async callback or a channel) or sleep are skipped until they're
+ * woken. A YIELD ends the thread's turn early.
+ *
+ * While a round robin runs a state, it also takes over resuming the state's
+ * other parked threads, so vm_state::run_completed shouldn't be used. Threads
+ * must not be destroyed while they're scheduled.
+ */
+class vm_round_robin
+{
+  using clock_type_t = std::chrono::steady_clock;
+
+  /** A scheduled thread. */
+  struct entry
+  {
+    vm_thread *thread;
+    int64_t priority;
+  };
+
+  vm_state &_process;
+  /** Number of instructions a priority 1 thread runs per turn. */
+  int64_t _quantum;
+  /** Every scheduled thread. */
+  std::unordered_map<vm_thread *, entry> _entries;
+  /** Threads waiting for a turn, in turn order. */
+  std::deque<vm_thread *> _runnable;
+  /** Async tokens of sleeping threads by wake time. */
+  std::multimap<clock_type_t::time_point, int64_t> _sleepers;
+  vm_resumed_fn_t *_on_result = nullptr;
+  void *_result_context = nullptr;
+
+  void wake_sleepers();
+  void take_completed();
+  void run_turn(vm_thread *thread);
+
+public:
+  explicit vm_round_robin(vm_state &process, int64_t quantum = VM_ROUND_ROBIN_QUANTUM);
+
+  vm_round_robin(vm_round_robin const &) = delete;
+  vm_round_robin &operator = (vm_round_robin const &) = delete;
+
+  void start(vm_thread &thread, vm_function_handle const &fn, int64_t argc, const vm_value *argv, int64_t priority = 1);
+  void set_priority(vm_thread &thread, int64_t priority);
+  void sleep(vm_thread &thread, int64_t milliseconds);
+
+  /**
+   * Sets a function called with a thread's result whenever a scheduled thread
+   * yields or returns.
+   */
+  void set_result_callback(vm_resumed_fn_t *on_result, void *context = nullptr)
+  {
+    _on_result = on_result;
+    _result_context = context;
+  }
+
+  /** Returns the number of threads scheduled, including parked ones. */
+  size_t thread_count() const { return _entries.size(); }
+
+  bool run_round();
+  void run();
+};
@@ -0,0 +1,249 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <chrono>
+
+#include "vm_scheduler.h"
+#include "vm_state.h"
+#include "vm_thread.h"
+
+
+namespace {
+/** The scheduler the current host thread is a worker of, if any. */
+thread_local vm_scheduler const *t_scheduler = nullptr;
+/** The current host thread's worker index. Only valid if t_scheduler is set. */
+thread_local size_t t_worker_index = 0;
+}
+
+
+
+/**
+ * Starts the given number of worker threads. At least one worker is always
+ * started.
+ */
+vm_scheduler::vm_scheduler(size_t worker_count)
+{
+  if (worker_count == 0) {
+    worker_count = 1;
+  }
+
+  _queues.reserve(worker_count);
+  for (size_t index = 0; index < worker_count; ++index) {
+    _queues.emplace_back(new worker_queue);
+  }
+
+  _workers.reserve(worker_count);
+  for (size_t index = 0; index < worker_count; ++index) {
+    _workers.emplace_back(&vm_scheduler::worker_main, this, index);
+  }
+}
+
+
+
+/**
+ * Stops and joins all workers. Tasks still queued are not run, so any states
+ * using the scheduler should be destroyed first.
+ */
+vm_scheduler::~vm_scheduler()
+{
+  {
+    std::lock_guard<std::mutex> guard { _idle_lock };
+    _stopping = true;
+  }
+  _idle.notify_all();
+
+  for (std::thread &worker : _workers) {
+    worker.join();
+  }
+}
+
+
+
+/**
+ * Hands a thread just created by DEFER to the scheduler.
+ */
+void vm_scheduler::defer(vm_thread &thread)
+{
+  task_pointer_t const pending { new task { &thread, { TASK_QUEUED }, nullptr } };
+  thread._task = pending;
+  thread._process._deferred_count.fetch_add(1, std::memory_order_relaxed);
+  submit(pending);
+}
+
+
+
+/**
+ * Waits for a deferred thread to finish. If no worker has started it yet, it's
+ * run on the calling thread. Rethrows anything the thread threw.
+ */
+void vm_scheduler::join(vm_thread &thread)
+{
+  task_pointer_t const pending = thread._task;
+  int expected = TASK_QUEUED;
+
+  if (pending->state.compare_exchange_strong(expected, TASK_RUNNING, std::memory_order_acq_rel)) {
+    run_task(*pending);
+  } else {
+    help_until([&pending] {
+      return pending->state.load(std::memory_order_acquire) == TASK_DONE;
+    });
+  }
+
+  if (pending->error) {
+    std::rethrow_exception(pending->error);
+  }
+}
+
+
+
+/**
+ * Pushes a task onto the current worker's deque, or onto the next worker's
+ * deque in turn if called from outside the scheduler.
+ */
+void vm_scheduler::submit(task_pointer_t const &pending)
+{
+  size_t const queue_index =
+    t_scheduler == this
+    ? t_worker_index
+    : static_cast<size_t>(_next_queue.fetch_add(1, std::memory_order_relaxed) % _queues.size());
+
+  {
+    worker_queue &queue = *_queues[queue_index];
+    std::lock_guard<std::mutex> guard { queue.lock };
+    queue.tasks.push_back(pending);
+  }
+
+  {
+    // Taken so a worker can't miss the wakeup between checking _queued and
+    // going to sleep.
+    std::lock_guard<std::mutex> guard { _idle_lock };
+    _queued.fetch_add(1, std::memory_order_release);
+    ++_progress;
+  }
+  _idle.notify_one();
+  _progressed.notify_all();
+}
+
+
+
+/**
+ * Takes the newest task from the given queue if it's the current worker's own
+ * queue, or the oldest task if it's being stolen. Returns null if the queue is
+ * empty.
+ */
+auto vm_scheduler::take(size_t queue_index) -> task_pointer_t
+{
+  bool const own = t_scheduler == this && t_worker_index == queue_index;
+  worker_queue &queue = *_queues[queue_index];
+  std::lock_guard<std::mutex> guard { queue.lock };
+
+  if (queue.tasks.empty()) {
+    return nullptr;
+  }
+
+  task_pointer_t pending;
+  if (own) {
+    pending = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+  } else {
+    pending = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+  }
+  _queued.fetch_sub(1, std::memory_order_relaxed);
+  return pending;
+}
+
+
+
+/**
+ * Runs a single queued task, checking the current worker's own deque first and
+ * then stealing from the others. Returns false if there was nothing to run.
+ */
+bool vm_scheduler::run_one()
+{
+  size_t const queue_count = _queues.size();
+  size_t const first = t_scheduler == this ? t_worker_index : 0;
+
+  for (size_t offset = 0; offset < queue_count; ++offset) {
+    task_pointer_t pending = take((first + offset) % queue_count);
+    if (!pending) {
+      continue;
+    }
+
+    // A JOIN may have claimed and run the task while it was still queued, in
+    // which case it's only dropped here.
+    int expected = TASK_QUEUED;
+    if (pending->state.compare_exchange_strong(expected, TASK_RUNNING, std::memory_order_acq_rel)) {
+      run_task(*pending);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
+/**
+ * Runs a claimed task's thread until it exits and marks the task done. The
+ * thread must not be touched after it's marked done, since its joiner may
+ * destroy it.
+ */
+void vm_scheduler::run_task(task &pending)
+{
+  vm_thread &thread = *pending.thread;
+  vm_state &process = thread._process;
+
+  try {
+    thread.run_deferred();
+  } catch (...) {
+    pending.error = std::current_exception();
+  }
+
+  pending.state.store(TASK_DONE, std::memory_order_release);
+  process._deferred_count.fetch_sub(1, std::memory_order_release);
+  signal_progress();
+}
+
+
+
+/**
+ * Wakes host threads blocked in help_until so they check whether they're done
+ * or there's something to run.
+ */
+void vm_scheduler::signal_progress()
+{
+  {
+    std::lock_guard<std::mutex> guard { _idle_lock };
+    ++_progress;
+  }
+  _progressed.notify_all();
+}
+
+
+
+/**
+ * Worker thread loop. Runs tasks until the scheduler is destroyed, sleeping
+ * while there's nothing queued.
+ */
+void vm_scheduler::worker_main(size_t index)
+{
+  t_scheduler = this;
+  t_worker_index = index;
+
+  while (!_stopping.load(std::memory_order_acquire)) {
+    if (run_one()) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock { _idle_lock };
+    _idle.wait_for(lock, std::chrono::milliseconds(10), [this] {
+      return _stopping.load(std::memory_order_relaxed) || _queued.load(std::memory_order_acquire) > 0;
+    });
+  }
+}
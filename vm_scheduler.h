@@ -0,0 +1,146 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "_types.h"
+
+
+/**
+ * Runs deferred VM threads eagerly on a pool of host worker threads.
+ *
+ * Without a scheduler, a thread created by DEFER only runs once it's JOINed,
+ * inline on the joining thread. When a scheduler is attached to a state (see
+ * vm_state::set_scheduler), DEFER hands the new thread to the scheduler
+ * instead and a worker starts running it right away. JOIN then only waits
+ * until the thread is done: if no worker has started it yet, the joining
+ * thread runs it itself, otherwise it helps run other deferred threads until
+ * the result is ready, blocking while there are none to run.
+ *
+ * Each worker has its own deque of deferred threads. A worker pushes threads
+ * deferred by the VM thread it's running onto the back of its own deque and
+ * takes work from the back, while idle workers steal from the front of other
+ * workers' deques, so fanned-out work spreads across workers without a shared
+ * queue.
+ *
+ * A scheduler may be shared by multiple states and must outlive them.
+ */
+class vm_scheduler
+{
+  friend class vm_thread;
+  friend class vm_state;
+
+  /** Progress of a deferred thread. */
+  enum task_state : int
+  {
+    TASK_QUEUED,
+    TASK_RUNNING,
+    TASK_DONE,
+  };
+
+  /**
+   * A deferred thread handed to the scheduler. Tasks are shared between the
+   * deques and the thread they run, and may outlive the thread once done.
+   */
+  struct task
+  {
+    vm_thread *thread;
+    std::atomic<int> state;
+    /** Set if running the thread threw. Rethrown by JOIN. */
+    std::exception_ptr error;
+  };
+
+  using task_pointer_t = std::shared_ptr<task>;
+
+  /** A single worker's deque of tasks. */
+  struct worker_queue
+  {
+    std::mutex lock;
+    std::deque<task_pointer_t> tasks;
+  };
+
+  /** One deque per worker. */
+  std::vector<std::unique_ptr<worker_queue>> _queues;
+  /** The worker threads. */
+  std::vector<std::thread> _workers;
+  /** Number of tasks sitting in deques. Used to put idle workers to sleep. */
+  std::atomic<int64_t> _queued { 0 };
+  /** Queue that the next task submitted from outside a worker goes to. */
+  std::atomic<uint64_t> _next_queue { 0 };
+  /** Set when the scheduler is being destroyed. */
+  std::atomic<bool> _stopping { false };
+  /**
+   * Bumped whenever a task is queued or finishes, or a channel changes, so
+   * helpers with nothing to run know when to check again. Guarded by
+   * _idle_lock.
+   */
+  uint64_t _progress = 0;
+  std::mutex _idle_lock;
+  std::condition_variable _idle;
+  /** Signalled when _progress changes. */
+  std::condition_variable _progressed;
+
+  void defer(vm_thread &thread);
+  void join(vm_thread &thread);
+  template <typename PRED>
+  void help_until(PRED &&done);
+
+  void submit(task_pointer_t const &pending);
+  task_pointer_t take(size_t queue_index);
+  bool run_one();
+  void run_task(task &pending);
+  void signal_progress();
+  void worker_main(size_t index);
+
+public:
+  explicit vm_scheduler(size_t worker_count = std::thread::hardware_concurrency());
+  ~vm_scheduler();
+
+  vm_scheduler(vm_scheduler const &) = delete;
+  vm_scheduler &operator = (vm_scheduler const &) = delete;
+
+  /** Returns the number of worker threads. */
+  size_t worker_count() const { return _workers.size(); }
+};
+
+
+
+/**
+ * Runs deferred threads on the calling thread until done() returns true.
+ * Whenever there's nothing to run, blocks until a task is queued or finishes
+ * or a channel changes, since done() can't change otherwise.
+ */
+template <typename PRED>
+void vm_scheduler::help_until(PRED &&done)
+{
+  for (;;) {
+    uint64_t progress;
+    {
+      std::lock_guard<std::mutex> guard { _idle_lock };
+      progress = _progress;
+    }
+
+    if (done()) {
+      return;
+    } else if (run_one()) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock { _idle_lock };
+    _progressed.wait(lock, [this, progress] { return _progress != progress; });
+  }
+}
@@ -0,0 +1,314 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <unordered_set>
+
+#include "vm_exception.h"
+#include "vm_snapshot.h"
+#include "vm_state.h"
+
+
+namespace {
+
+
+/** Magic number at the start of a written snapshot ('RSNP'). */
+constexpr uint32_t SNAPSHOT_MAGIC = 0x504E5352u;
+/** Version of the snapshot stream format. */
+constexpr int32_t SNAPSHOT_VERSION = 1;
+/** Block contents are read in runs of at most this many bytes. */
+constexpr int64_t SNAPSHOT_READ_RUN = 65536;
+
+
+
+template <typename T>
+void write_field(std::ostream &output, T value)
+{
+  output.write(reinterpret_cast<char const *>(&value), sizeof value);
+}
+
+
+
+template <>
+void write_field<vm_value>(std::ostream &output, vm_value value)
+{
+  write_field<int32_t>(output, value.type);
+  write_field<uint64_t>(output, value.u64_);
+}
+
+
+
+template <typename T>
+T read_field(std::istream &input)
+{
+  T value {};
+  if (!input.read(reinterpret_cast<char *>(&value), sizeof value)) {
+    throw vm_bad_snapshot("Snapshot is truncated");
+  }
+  return value;
+}
+
+
+
+template <>
+vm_value read_field<vm_value>(std::istream &input)
+{
+  int32_t const type = read_field<int32_t>(input);
+  return vm_value { type, read_field<uint64_t>(input) };
+}
+
+
+
+/**
+ * Reads a count written before a list. Negative counts mean the snapshot is
+ * corrupt.
+ */
+int64_t read_count(std::istream &input)
+{
+  int64_t const count = read_field<int64_t>(input);
+  if (count < 0) {
+    throw vm_bad_snapshot("Snapshot has a negative count");
+  }
+  return count;
+}
+
+
+
+void write_values(std::ostream &output, std::vector<vm_value> const &values)
+{
+  write_field<int64_t>(output, static_cast<int64_t>(values.size()));
+  for (vm_value const &value : values) {
+    write_field(output, value);
+  }
+}
+
+
+
+// Values are appended one at a time, so a corrupt count fails on the stream
+// running out rather than on one huge allocation.
+void read_values(std::istream &input, std::vector<vm_value> &values)
+{
+  values.clear();
+  for (int64_t count = read_count(input); count > 0; --count) {
+    values.push_back(read_field<vm_value>(input));
+  }
+}
+
+
+
+void write_integers(std::ostream &output, std::vector<int64_t> const &integers)
+{
+  write_field<int64_t>(output, static_cast<int64_t>(integers.size()));
+  for (int64_t const integer : integers) {
+    write_field(output, integer);
+  }
+}
+
+
+
+void read_integers(std::istream &input, std::vector<int64_t> &integers)
+{
+  integers.clear();
+  for (int64_t count = read_count(input); count > 0; --count) {
+    integers.push_back(read_field<int64_t>(input));
+  }
+}
+
+
+
+/** Returns whether a stack pointer lies within a stack of the given size. */
+bool within_stack(int64_t pointer, int64_t stack_size)
+{
+  return pointer >= 0 && pointer <= stack_size;
+}
+
+
+} // namespace
+
+
+
+/**
+ * Writes the snapshot to a binary stream. The format is only meant to be read
+ * back by vm_snapshot::read on a host with the same byte order.
+ */
+void vm_snapshot::write(std::ostream &output) const
+{
+  write_field(output, SNAPSHOT_MAGIC);
+  write_field(output, SNAPSHOT_VERSION);
+  write_field(output, _source_size);
+  write_field(output, _register_count);
+  write_field(output, _block_counter);
+
+  write_field<int64_t>(output, static_cast<int64_t>(_blocks.size()));
+  for (block_image const &block : _blocks) {
+    write_field(output, block.id);
+    write_field(output, block.size);
+    write_field(output, block.flags);
+    write_field<int64_t>(output, static_cast<int64_t>(block.data.size()));
+    output.write(block.data.data(), static_cast<std::streamsize>(block.data.size()));
+  }
+
+  write_field(output, _thread_slot_count);
+  write_integers(output, _slot_generations);
+  write_integers(output, _free_slots);
+
+  write_field<int64_t>(output, static_cast<int64_t>(_threads.size()));
+  for (thread_image const &thread : _threads) {
+    write_field(output, thread.thread_id);
+    write_field(output, thread.sequence);
+    write_field(output, thread.trap);
+    write_field(output, thread.fuel);
+    write_field(output, thread.stack_size);
+    write_values(output, thread.registers);
+    write_values(output, thread.stack);
+
+    write_field<int64_t>(output, static_cast<int64_t>(thread.frames.size()));
+    for (vm_thread::call_frame const &frame : thread.frames) {
+      write_field(output, frame.from_ip);
+      write_field(output, frame.ebp);
+      write_field(output, frame.esp);
+      write_field(output, frame.sequence);
+      for (vm_value const &value : frame.registers) {
+        write_field(output, value);
+      }
+    }
+  }
+
+  write_field(output, _channel_counter);
+  write_field<int64_t>(output, static_cast<int64_t>(_channels.size()));
+  for (channel_image const &channel : _channels) {
+    write_field(output, channel.id);
+    write_field(output, channel.capacity);
+    write_field<uint8_t>(output, channel.closed ? 1 : 0);
+    write_values(output, channel.values);
+  }
+
+  if (!output) {
+    throw vm_unit_io_error("Unable to write snapshot");
+  }
+}
+
+
+
+/**
+ * Replaces the snapshot with one read from a stream written by
+ * vm_snapshot::write. Throws vm_bad_snapshot if the stream doesn't hold a
+ * snapshot, ends early, or holds one that couldn't have been taken (duplicate
+ * IDs, stack pointers outside their stack, and so on), in which case the
+ * snapshot is left unchanged. What depends on the state it's restored into is
+ * checked by vm_state::restore.
+ */
+void vm_snapshot::read(std::istream &input)
+{
+  if (read_field<uint32_t>(input) != SNAPSHOT_MAGIC) {
+    throw vm_bad_snapshot("Stream doesn't hold a snapshot");
+  } else if (read_field<int32_t>(input) != SNAPSHOT_VERSION) {
+    throw vm_bad_snapshot("Unsupported snapshot version");
+  }
+
+  vm_snapshot result;
+  result._source_size = read_field<int64_t>(input);
+  result._register_count = read_field<int64_t>(input);
+  result._block_counter = read_field<int64_t>(input);
+  if (result._register_count <= vm_thread::R_LAST_ARGUMENT ||
+      result._register_count > vm_thread::REGISTER_COUNT) {
+    throw vm_bad_snapshot("Snapshot has a malformed register count");
+  }
+
+  // Blocks are written by ascending ID, which also rules out duplicates.
+  int64_t previous_block = VM_NULL_BLOCK;
+  for (int64_t count = read_count(input); count > 0; --count) {
+    block_image block;
+    block.id = read_field<int64_t>(input);
+    block.size = read_field<int64_t>(input);
+    block.flags = read_field<uint32_t>(input);
+
+    int64_t const data_size = read_count(input);
+    if (block.id <= previous_block || block.id >= result._block_counter ||
+        block.size <= 0 || data_size != ((block.flags & VM_MEM_STATIC) ? 0 : block.size)) {
+      throw vm_bad_snapshot("Snapshot has a malformed memory block");
+    }
+    for (int64_t offset = 0; offset < data_size; offset += SNAPSHOT_READ_RUN) {
+      int64_t const run = std::min(data_size - offset, SNAPSHOT_READ_RUN);
+      block.data.resize(static_cast<size_t>(offset + run));
+      if (!input.read(&block.data[static_cast<size_t>(offset)], static_cast<std::streamsize>(run))) {
+        throw vm_bad_snapshot("Snapshot is truncated");
+      }
+    }
+    previous_block = block.id;
+    result._blocks.push_back(std::move(block));
+  }
+
+  result._thread_slot_count = read_field<int64_t>(input);
+  read_integers(input, result._slot_generations);
+  read_integers(input, result._free_slots);
+  if (static_cast<int64_t>(result._slot_generations.size()) != result._thread_slot_count) {
+    throw vm_bad_snapshot("Snapshot has a malformed thread table");
+  }
+  std::vector<bool> free_slots(result._slot_generations.size(), false);
+  for (int64_t const slot_index : result._free_slots) {
+    if (slot_index < 0 || slot_index >= result._thread_slot_count ||
+        free_slots[static_cast<size_t>(slot_index)]) {
+      throw vm_bad_snapshot("Snapshot has a malformed thread table");
+    }
+    free_slots[static_cast<size_t>(slot_index)] = true;
+  }
+
+  for (int64_t count = read_count(input); count > 0; --count) {
+    thread_image thread;
+    thread.thread_id = read_field<int64_t>(input);
+    thread.sequence = read_field<int64_t>(input);
+    thread.trap = read_field<int64_t>(input);
+    thread.fuel = read_field<int64_t>(input);
+    thread.stack_size = read_field<int64_t>(input);
+    read_values(input, thread.registers);
+    read_values(input, thread.stack);
+    if (static_cast<int64_t>(thread.registers.size()) != result._register_count ||
+        thread.stack_size > VM_SNAPSHOT_MAX_STACK ||
+        static_cast<int64_t>(thread.stack.size()) > thread.stack_size ||
+        !within_stack(thread.registers[vm_thread::R_EBP].i64(), thread.stack_size) ||
+        !within_stack(thread.registers[vm_thread::R_ESP].i64(), thread.stack_size)) {
+      throw vm_bad_snapshot("Snapshot has a malformed thread");
+    }
+
+    for (int64_t frames = read_count(input); frames > 0; --frames) {
+      vm_thread::call_frame frame;
+      frame.from_ip = read_field<int64_t>(input);
+      frame.ebp = read_field<int64_t>(input);
+      frame.esp = read_field<int64_t>(input);
+      frame.sequence = read_field<int64_t>(input);
+      for (vm_value &value : frame.registers) {
+        value = read_field<vm_value>(input);
+      }
+      if (!within_stack(frame.ebp, thread.stack_size) || !within_stack(frame.esp, thread.stack_size)) {
+        throw vm_bad_snapshot("Snapshot has a malformed thread");
+      }
+      thread.frames.push_back(frame);
+    }
+    result._threads.push_back(std::move(thread));
+  }
+
+  result._channel_counter = read_field<int64_t>(input);
+  std::unordered_set<int64_t> channel_ids;
+  for (int64_t count = read_count(input); count > 0; --count) {
+    channel_image channel;
+    channel.id = read_field<int64_t>(input);
+    channel.capacity = read_field<int64_t>(input);
+    channel.closed = read_field<uint8_t>(input) != 0;
+    read_values(input, channel.values);
+    if (channel.id <= 0 || channel.id > result._channel_counter ||
+        !channel_ids.insert(channel.id).second || channel.capacity < 1) {
+      throw vm_bad_snapshot("Snapshot has a malformed channel");
+    }
+    result._channels.push_back(std::move(channel));
+  }
+
+  *this = std::move(result);
+}
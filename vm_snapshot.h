@@ -0,0 +1,107 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+#include <iosfwd>
+#include <vector>
+
+#include "_types.h"
+#include "vm_thread.h"
+#include "vm_value.h"
+
+
+/**
+ * Largest thread stack, in values, that vm_snapshot::read accepts, so a
+ * corrupt snapshot can't ask restore for a huge allocation.
+ */
+#ifndef VM_SNAPSHOT_MAX_STACK
+#define VM_SNAPSHOT_MAX_STACK (int64_t(1) << 24)
+#endif
+
+
+/**
+ * An image of a VM state's memory blocks, threads, and channels, taken by
+ * vm_state::snapshot and restored by vm_state::restore.
+ *
+ * Snapshots let a process run an expensive init once and then start new
+ * states from its result instead of re-running it. A snapshot only holds what
+ * running the unit can change: the unit's static data isn't copied, so a
+ * snapshot can only be restored into a state with the same unit, and bound
+ * callbacks aren't part of it.
+ *
+ * Snapshots can be written to and read from streams to keep them on disk.
+ */
+class vm_snapshot
+{
+  friend class vm_state;
+
+  /** A memory block. Static blocks are only recorded, not copied. */
+  struct block_image
+  {
+    int64_t id;
+    int64_t size;
+    uint32_t flags;
+    /** The block's contents. Empty for static blocks. */
+    std::vector<char> data;
+  };
+
+  /** A thread that isn't running. */
+  struct thread_image
+  {
+    int64_t thread_id;
+    int64_t sequence;
+    int64_t trap;
+    int64_t fuel;
+    int64_t stack_size;
+    std::vector<vm_value> registers;
+    /** Stack slots up to the thread's touched mark. Every slot past it is zero. */
+    std::vector<vm_value> stack;
+    std::vector<vm_thread::call_frame> frames;
+  };
+
+  /** An open channel or a closed one with values left. */
+  struct channel_image
+  {
+    int64_t id;
+    int64_t capacity;
+    bool closed;
+    std::vector<vm_value> values;
+  };
+
+  /** Number of instructions in the unit. Used to check restores. */
+  int64_t _source_size = 0;
+  /** Number of registers per thread. Used to check restores. */
+  int64_t _register_count = 0;
+  int64_t _block_counter = 1;
+  /** Every memory block, including static ones, by ascending ID. */
+  std::vector<block_image> _blocks;
+  int64_t _thread_slot_count = 0;
+  /** Generation of each thread slot handed out. */
+  std::vector<int64_t> _slot_generations;
+  /** Free thread slots in the order they'd be reused. */
+  std::vector<int64_t> _free_slots;
+  std::vector<thread_image> _threads;
+  int64_t _channel_counter = 0;
+  std::vector<channel_image> _channels;
+
+public:
+  vm_snapshot() = default;
+
+  vm_snapshot(vm_snapshot const &) = default;
+  vm_snapshot &operator = (vm_snapshot const &) = default;
+
+  vm_snapshot(vm_snapshot &&) = default;
+  vm_snapshot &operator = (vm_snapshot &&) = default;
+
+  void write(std::ostream &output) const;
+  void read(std::istream &input);
+
+  /** Returns the number of threads in the snapshot. */
+  size_t thread_count() const { return _threads.size(); }
+};
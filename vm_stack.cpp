@@ -0,0 +1,116 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <algorithm>
+
+#include "vm_stack.h"
+
+
+/**
+ * Calls func(values, count, position) for each contiguous run of slots in the
+ * range [begin, end), where position is the index of the run's first slot.
+ * The range must be within the stack.
+ */
+template <typename FN>
+void vm_stack::for_each_run(size_t begin, size_t end, FN &&func)
+{
+  if (begin >= end) {
+    return;
+  }
+
+  size_t segment, offset;
+  locate(begin, segment, offset);
+
+  while (begin < end) {
+    size_t const count = std::min(segment_size(segment) - offset, end - begin);
+    func(&_segments[segment][offset], count, begin);
+    begin += count;
+    ++segment;
+    offset = 0;
+  }
+}
+
+
+
+/**
+ * Copy constructor. Allocates the same segments as the other stack and copies
+ * their contents.
+ */
+vm_stack::vm_stack(vm_stack const &other)
+{
+  *this = other;
+}
+
+
+
+/**
+ * Copy assignment. Segments the receiving stack already has are reused.
+ */
+vm_stack &vm_stack::operator = (vm_stack const &other)
+{
+  if (this == &other) {
+    return *this;
+  }
+
+  resize(other._size);
+  for (size_t segment = 0; segment < other._segments.size(); ++segment) {
+    vm_value const *const values = other._segments[segment].get();
+    std::copy(values, values + segment_size(segment), _segments[segment].get());
+  }
+  // Any segments past the other stack's are left as they were.
+  clear(other._size, _size);
+  return *this;
+}
+
+
+
+/**
+ * Grows the stack to hold at least the given number of slots. Never shrinks
+ * the stack or moves existing values.
+ */
+void vm_stack::resize(size_t size)
+{
+  while (_size < size) {
+    size_t const added = segment_size(_segments.size());
+    _segments.emplace_back(new vm_value[added]());
+    _size += added;
+  }
+}
+
+
+
+/**
+ * Zeroes the slots in the range [begin, end).
+ */
+void vm_stack::clear(size_t begin, size_t end)
+{
+  for_each_run(begin, std::min(end, _size), [](vm_value *values, size_t count, size_t) {
+    std::fill_n(values, count, vm_value {});
+  });
+}
+
+
+
+/**
+ * Copies the slots in the range [begin, end) of the source stack to the
+ * receiving stack, starting at dest. The receiving stack must already be large
+ * enough to hold them.
+ */
+void vm_stack::copy(vm_stack const &source, size_t begin, size_t end, size_t dest)
+{
+  if (begin >= end) {
+    return;
+  }
+
+  for_each_run(dest, dest + (end - begin), [&](vm_value *values, size_t count, size_t position) {
+    size_t const from = begin + (position - dest);
+    for (size_t index = 0; index < count; ++index) {
+      values[index] = source[from + index];
+    }
+  });
+}
@@ -0,0 +1,115 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "_types.h"
+#include "vm_value.h"
+
+
+/**
+ * Number of values in a stack's first segment. Must be a power of two.
+ */
+#ifndef VM_STACK_SEGMENT_SIZE
+#define VM_STACK_SEGMENT_SIZE 64
+#endif
+
+
+/**
+ * A VM thread's stack, stored as a list of segments.
+ *
+ * The first segment holds VM_STACK_SEGMENT_SIZE values and each segment after
+ * it is twice the size of the one before, so a stack starts out small, grows
+ * without moving values already on it, and finds the segment for any slot with
+ * a shift and a bit scan. Newly allocated slots are zero.
+ */
+class vm_stack
+{
+  static_assert(
+    VM_STACK_SEGMENT_SIZE > 0 && (VM_STACK_SEGMENT_SIZE & (VM_STACK_SEGMENT_SIZE - 1)) == 0,
+    "VM_STACK_SEGMENT_SIZE must be a power of two"
+    );
+
+  using segment_t = std::unique_ptr<vm_value[]>;
+
+  /** The stack's segments. Segment N holds VM_STACK_SEGMENT_SIZE << N values. */
+  std::vector<segment_t> _segments;
+  /** Total number of slots across all segments. */
+  size_t _size = 0;
+
+  static size_t segment_size(size_t segment)
+  {
+    return static_cast<size_t>(VM_STACK_SEGMENT_SIZE) << segment;
+  }
+
+  static void locate(size_t index, size_t &segment, size_t &offset);
+
+  template <typename FN>
+  void for_each_run(size_t begin, size_t end, FN &&func);
+
+public:
+  vm_stack() = default;
+  explicit vm_stack(size_t size) { resize(size); }
+
+  vm_stack(vm_stack const &other);
+  vm_stack &operator = (vm_stack const &other);
+
+  vm_stack(vm_stack &&) = default;
+  vm_stack &operator = (vm_stack &&) = default;
+
+  /** Returns the number of slots allocated to the stack. */
+  size_t size() const { return _size; }
+
+  void resize(size_t size);
+  void clear(size_t begin, size_t end);
+  void copy(vm_stack const &source, size_t begin, size_t end, size_t dest);
+
+  vm_value &operator [] (size_t index);
+  vm_value const &operator [] (size_t index) const;
+};
+
+
+
+/**
+ * Finds the segment holding the slot at the given index and the slot's offset
+ * into it.
+ */
+inline void vm_stack::locate(size_t index, size_t &segment, size_t &offset)
+{
+  // Segment N starts at VM_STACK_SEGMENT_SIZE * (2^N - 1).
+  unsigned long long const scaled = index / VM_STACK_SEGMENT_SIZE + 1;
+  segment = static_cast<size_t>(63 - __builtin_clzll(scaled));
+  offset = index - VM_STACK_SEGMENT_SIZE * ((size_t(1) << segment) - 1);
+}
+
+
+
+/**
+ * Returns the slot at the given index. The index must be less than size().
+ */
+inline vm_value &vm_stack::operator [] (size_t index)
+{
+  size_t segment, offset;
+  locate(index, segment, offset);
+  return _segments[segment][offset];
+}
+
+
+
+/**
+ * Const form of operator [].
+ */
+inline vm_value const &vm_stack::operator [] (size_t index) const
+{
+  size_t segment, offset;
+  locate(index, segment, offset);
+  return _segments[segment][offset];
+}
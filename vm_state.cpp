@@ -6,6 +6,7 @@
  *          http://www.boost.org/LICENSE_1_0.txt)
  */
 
+#include <algorithm>
 #include <cfenv>
 #include <cmath>
 #include <cstring>
@@ -13,6 +14,8 @@
 #include <iomanip>
 
 #include "vm_exception.h"
+#include "vm_op.h"
+#include "vm_opcode.h"
 #include "vm_state.h"
 #include "vm_thread.h"
 #include "hash.h"
@@ -22,7 +25,15 @@
 vm_state::memblock const vm_state::NO_BLOCK {
   0,       // size
   0,       // flags
-  nullptr  // block
+  nullptr, // block
+  -1       // source_index
+};
+
+
+// Unbound callback. Returns undefined when invoked.
+vm_state::callback_info const vm_state::NO_CALLBACK {
+  nullptr, // callback
+  nullptr  // context
 };
 
 
@@ -56,7 +67,16 @@ vm_value vm_state::callback_info::invoke(vm_thread &thread, int argc, vm_value c
  */
 vm_state::~vm_state()
 {
+  if (_scheduler) {
+    _scheduler->help_until([this] {
+      return _deferred_count.load(std::memory_order_acquire) == 0;
+    });
+  }
+  destroy_all_threads();
   release_all_memblocks();
+  for (auto &chunk : _thread_chunks) {
+    delete[] chunk.load(std::memory_order_relaxed);
+  }
 }
 
 
@@ -96,7 +116,7 @@ void vm_state::set_unit(vm_unit &&unit)
  */
 void vm_state::reset_state()
 {
-  if (_threads.size() > 0) {
+  if (_thread_count.load() > 0) {
     throw new vm_logic_error("Attempt to reset state with loaded VM threads.");
   }
 
@@ -104,37 +124,393 @@ void vm_state::reset_state()
   _block_counter = 1;
 
   _source_size = 0;
-  _callbacks.resize(0);
+  _callbacks.reset();
+  _callback_count = 0;
+  _bound_callbacks.clear();
+
+  std::lock_guard<std::mutex> guard { _channel_lock };
+  _channels.clear();
+}
+
+
+
+/**
+ * Returns the state to how it was right after its unit was set, but keeps the
+ * unit, its static data, and bound callbacks. Threads are destroyed (and kept
+ * in the thread pool), memory blocks other than static ones are freed, and
+ * channels and async waits are dropped. Old thread IDs go stale.
+ *
+ * Meant for reusing a state for isolated runs of the same unit without paying
+ * for set_unit (see vm_state_pool). It is an error to recycle a state while any
+ * of its threads are running, other than deferred threads on a scheduler,
+ * which are waited on first.
+ */
+void vm_state::recycle()
+{
+  if (_scheduler) {
+    _scheduler->help_until([this] {
+      return _deferred_count.load(std::memory_order_acquire) == 0;
+    });
+  }
+
+  pool_all_threads();
+  release_user_memblocks();
+
+  {
+    std::lock_guard<std::mutex> guard { _async_lock };
+    _async_waits.clear();
+    _async_completed.clear();
+  }
+
+  std::lock_guard<std::mutex> guard { _channel_lock };
+  _channels.clear();
+}
+
+
+
+/**
+ * Takes a snapshot of the state's memory blocks, threads, and channels that
+ * can be restored into this or another state with the same unit. None of the
+ * state's threads may be running, suspended in a host call, or deferred to a
+ * scheduler without having been joined, and no threads may be created or
+ * destroyed while the snapshot is taken.
+ */
+vm_snapshot vm_state::snapshot()
+{
+  if (_deferred_count.load(std::memory_order_acquire) > 0) {
+    throw vm_thread_state_error("Attempt to snapshot a state with running deferred threads");
+  }
+
+  vm_snapshot result;
+  result._source_size = _source_size;
+  result._register_count = _register_count;
+
+  result._thread_slot_count = _thread_slot_count.load(std::memory_order_relaxed);
+  result._free_slots = free_thread_slots();
+  for (int64_t slot_index = 0; slot_index < result._thread_slot_count; ++slot_index) {
+    thread_slot_t const *const slot = thread_slot(slot_index);
+    result._slot_generations.push_back(slot ? slot->generation.load(std::memory_order_acquire) : 0);
+
+    vm_thread const *const thread = slot ? slot->thread.load(std::memory_order_acquire) : nullptr;
+    if (thread == nullptr) {
+      continue;
+    } else if (thread->_host_calls > 0 || thread->_suspended || thread->_task) {
+      throw vm_thread_state_error("Attempt to snapshot a thread that's in use");
+    }
+
+    vm_snapshot::thread_image image;
+    image.thread_id = thread->_thread_id;
+    image.sequence = thread->_sequence;
+    image.trap = thread->_trap;
+    image.fuel = thread->_fuel;
+    image.stack_size = static_cast<int64_t>(thread->_stack.size());
+    image.registers = thread->_registers;
+    image.stack.reserve(thread->_stack_touched);
+    for (size_t index = 0; index < thread->_stack_touched; ++index) {
+      image.stack.push_back(thread->_stack[index]);
+    }
+    image.frames = thread->_frames;
+    result._threads.push_back(std::move(image));
+  }
+
+  // Blocks are gathered shard by shard and then sorted so restores insert them
+  // in ID order.
+  for (block_shard const &shard : _block_shards) {
+    std::lock_guard<std::mutex> guard { shard.lock };
+    for (auto const &kvpair : shard.blocks) {
+      memblock const &block = kvpair.second;
+      vm_snapshot::block_image image { kvpair.first, block.size, block.flags, {} };
+      if (!(block.flags & VM_MEM_STATIC)) {
+        char const *const data = static_cast<char const *>(block.block);
+        image.data.assign(data, data + block.size);
+      }
+      result._blocks.push_back(std::move(image));
+    }
+  }
+  std::sort(result._blocks.begin(), result._blocks.end(),
+    [](vm_snapshot::block_image const &lhs, vm_snapshot::block_image const &rhs) {
+      return lhs.id < rhs.id;
+    });
+  result._block_counter = _block_counter.load(std::memory_order_relaxed);
+
+  // Channels are locked after the table lock is dropped, since try_recv and
+  // close_channel take the table lock while holding a channel's.
+  std::vector<std::pair<int64_t, channel_pointer_t>> channels;
+  {
+    std::lock_guard<std::mutex> guard { _channel_lock };
+    result._channel_counter = _channel_counter;
+    channels.assign(_channels.cbegin(), _channels.cend());
+  }
+
+  for (auto const &kvpair : channels) {
+    vm_channel &channel = *kvpair.second;
+    std::lock_guard<std::mutex> channel_guard { channel._lock };
+    result._channels.push_back(vm_snapshot::channel_image {
+      kvpair.first,
+      static_cast<int64_t>(channel._capacity),
+      channel._closed,
+      std::vector<vm_value>(channel._values.cbegin(), channel._values.cend())
+    });
+  }
+
+  return result;
+}
+
+
+
+/**
+ * Throws vm_bad_snapshot unless the state's unit matches the one the snapshot
+ * was taken with, going by its size, register count, and static data blocks,
+ * and the snapshot's thread table fits in the state's: every generation is a
+ * valid one and every slot is either free or holds a single thread.
+ */
+void vm_state::check_snapshot(vm_snapshot const &snapshot) const
+{
+  if (snapshot._source_size != _source_size ||
+      snapshot._register_count != _register_count) {
+    throw vm_bad_snapshot("Snapshot was taken of a state with a different unit");
+  } else if (snapshot._thread_slot_count < 0 ||
+             snapshot._thread_slot_count > THREAD_SLOT_LIMIT ||
+             static_cast<int64_t>(snapshot._slot_generations.size()) != snapshot._thread_slot_count) {
+    throw vm_bad_snapshot("Snapshot has a malformed thread table");
+  }
+
+  for (int64_t const generation : snapshot._slot_generations) {
+    if (generation < 0 || generation > THREAD_GENERATION_MASK) {
+      throw vm_bad_snapshot("Snapshot has a malformed thread table");
+    }
+  }
+
+  std::vector<bool> taken(snapshot._slot_generations.size(), false);
+  for (int64_t const slot_index : snapshot._free_slots) {
+    if (slot_index < 0 || slot_index >= snapshot._thread_slot_count ||
+        taken[static_cast<size_t>(slot_index)]) {
+      throw vm_bad_snapshot("Snapshot has a malformed thread table");
+    }
+    taken[static_cast<size_t>(slot_index)] = true;
+  }
+
+  for (vm_snapshot::thread_image const &image : snapshot._threads) {
+    int64_t const slot_index = image.thread_id & THREAD_SLOT_MASK;
+    if (image.thread_id < 0 ||
+        slot_index >= snapshot._thread_slot_count ||
+        taken[static_cast<size_t>(slot_index)] ||
+        snapshot._slot_generations[static_cast<size_t>(slot_index)] != (image.thread_id >> THREAD_SLOT_BITS)) {
+      throw vm_bad_snapshot("Snapshot has a malformed thread table");
+    }
+    taken[static_cast<size_t>(slot_index)] = true;
+  }
+
+  size_t static_count = 0;
+  for (vm_snapshot::block_image const &image : snapshot._blocks) {
+    if (!(image.flags & VM_MEM_STATIC)) {
+      continue;
+    }
+
+    found_memblock_t const found = find_block_info(image.id);
+    if (!found.ok || !(found.value.flags & VM_MEM_STATIC) || found.value.size != image.size) {
+      throw vm_bad_snapshot("Snapshot was taken of a state with a different unit");
+    }
+    ++static_count;
+  }
+
+  for (block_shard const &shard : _block_shards) {
+    std::lock_guard<std::mutex> guard { shard.lock };
+    for (auto const &kvpair : shard.blocks) {
+      if (kvpair.second.flags & VM_MEM_STATIC) {
+        if (static_count == 0) {
+          throw vm_bad_snapshot("Snapshot was taken of a state with a different unit");
+        }
+        --static_count;
+      }
+    }
+  }
+
+  if (static_count != 0) {
+    throw vm_bad_snapshot("Snapshot was taken of a state with a different unit");
+  }
+}
+
+
+
+/**
+ * Restores a snapshot taken by vm_state::snapshot. If the state doesn't have
+ * the same unit as the one the snapshot was taken of, or the snapshot is
+ * malformed, vm_bad_snapshot is thrown and the state is left as it was. Block
+ * contents are copied before anything is dropped, so running out of memory for
+ * them leaves the state as it was too, but running out partway through
+ * rebuilding threads or channels leaves the state recycled.
+ *
+ * The state is recycled first (see vm_state::recycle), so anything it held
+ * before is dropped. Restored threads, blocks, and channels keep their IDs from
+ * the snapshot, so IDs stored in registers and memory still refer to them.
+ * Bound callbacks and the scheduler are kept.
+ */
+void vm_state::restore(vm_snapshot const &snapshot)
+{
+  check_snapshot(snapshot);
+
+  std::vector<std::pair<int64_t, memblock>> blocks;
+  blocks.reserve(snapshot._blocks.size());
+  try {
+    for (vm_snapshot::block_image const &image : snapshot._blocks) {
+      if (image.flags & VM_MEM_STATIC) {
+        continue;
+      }
+
+      void *const data = std::malloc(static_cast<size_t>(image.size));
+      if (data == nullptr) {
+        throw vm_memory_access_error("Unable to allocate block");
+      }
+      std::memcpy(data, image.data.data(), static_cast<size_t>(image.size));
+      blocks.emplace_back(image.id, memblock { image.size, image.flags, data, -1 });
+    }
+  } catch (...) {
+    for (auto const &kvpair : blocks) {
+      std::free(kvpair.second.block);
+    }
+    throw;
+  }
+
+  recycle();
+
+  size_t inserted = 0;
+  try {
+    for (; inserted < blocks.size(); ++inserted) {
+      block_shard &shard = shard_for(blocks[inserted].first);
+      std::lock_guard<std::mutex> guard { shard.lock };
+      shard.blocks.emplace(blocks[inserted].first, blocks[inserted].second);
+    }
+  } catch (...) {
+    for (; inserted < blocks.size(); ++inserted) {
+      std::free(blocks[inserted].second.block);
+    }
+    throw;
+  }
+  _block_counter.store(snapshot._block_counter, std::memory_order_relaxed);
+
+  // Slots past the snapshot's stay free, behind its own free slots.
+  int64_t const slot_count = _thread_slot_count.load(std::memory_order_relaxed);
+  std::vector<int64_t> free_slots;
+  for (int64_t slot_index = slot_count - 1; slot_index >= snapshot._thread_slot_count; --slot_index) {
+    free_slots.push_back(slot_index);
+  }
+  free_slots.insert(free_slots.end(), snapshot._free_slots.cbegin(), snapshot._free_slots.cend());
+
+  for (int64_t slot_index = 0; slot_index < snapshot._thread_slot_count; ++slot_index) {
+    allocate_thread_chunk(slot_index);
+    thread_slot(slot_index)->generation.store(
+      snapshot._slot_generations[static_cast<size_t>(slot_index)],
+      std::memory_order_release
+      );
+  }
+  _thread_slot_count.store(std::max(slot_count, snapshot._thread_slot_count), std::memory_order_relaxed);
+  reset_free_thread_slots(free_slots);
+
+  for (vm_snapshot::thread_image const &image : snapshot._threads) {
+    int64_t const slot_index = image.thread_id & THREAD_SLOT_MASK;
+    vm_thread *thread = take_pooled_thread(slot_index);
+    if (thread == nullptr) {
+      thread = new vm_thread(*this, 0);
+    }
+
+    thread->recycle(static_cast<size_t>(image.stack_size));
+    thread->_thread_id = image.thread_id;
+    thread->_sequence = image.sequence;
+    thread->_trap = image.trap;
+    thread->_fuel = image.fuel;
+    thread->_registers = image.registers;
+    for (size_t index = 0; index < image.stack.size(); ++index) {
+      thread->_stack[index] = image.stack[index];
+    }
+    thread->_stack_touched = image.stack.size();
+    thread->_frames = image.frames;
+
+    thread_slot(slot_index)->thread.store(thread, std::memory_order_release);
+  }
+  _thread_count.store(static_cast<int64_t>(snapshot._threads.size()), std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> guard { _channel_lock };
+  _channel_counter = snapshot._channel_counter;
+  for (vm_snapshot::channel_image const &image : snapshot._channels) {
+    channel_pointer_t const channel { new vm_channel(static_cast<size_t>(image.capacity)) };
+    channel->_values.assign(image.values.cbegin(), image.values.cend());
+    channel->_closed = image.closed;
+    _channels.emplace(image.id, channel);
+  }
 }
 
 
 
 /**
- * Prepares the VM for its current unit by allocating static memory blocks and
+ * Prepares the VM for its current unit by registering static memory blocks and
  * resizing the callback vector to hold as many callbacks as are needed.
  */
 void vm_state::prepare_unit()
 {
   _source_size = _unit.instructions.size();
+  _register_count = VM_COMPACT_REGISTERS ? count_used_registers() : static_cast<int64_t>(vm_thread::REGISTER_COUNT);
 
-  _callbacks.resize(_unit.imports.size());
-  std::fill(_callbacks.begin(), _callbacks.end(), callback_info { nullptr, nullptr });
+  _callback_count = static_cast<int64_t>(_unit.imports.size());
+  _callbacks.reset(new callback_slot_t[_callback_count]);
+  for (int64_t index = 0; index < _callback_count; ++index) {
+    _callbacks[index].store(&NO_CALLBACK, std::memory_order_relaxed);
+  }
 
+  size_t const data_count = _unit.data_block_count();
   vm_unit::data_id_ary_t new_ids;
-  new_ids.resize(_unit._data_blocks.size(), 0);
+  new_ids.resize(data_count, 0);
+
+  // Static blocks are only registered here. Their data is copied out of the
+  // unit when first accessed (see materialize_block), so setting a unit costs
+  // the same however much static data it has.
+  for (size_t index = 0; index < data_count; ++index) {
+    new_ids[index] = insert_block(memblock {
+      _unit._data_blocks[index].size,
+      VM_MEM_SOURCE_DATA,
+      nullptr,
+      static_cast<int64_t>(index)
+    });
+  }
 
-  _unit.each_data([&](int64_t index, int64_t id, int64_t size, void const *ptr, bool &stop) {
-    int64_t new_id = realloc_block_with_flags(VM_NULL_BLOCK, size, VM_MEM_SOURCE_DATA);
-    auto found = get_block_info(new_id);
-    if (!found.ok) {
-      return;
+  _unit.relocate_static_data(new_ids);
+}
+
+
+
+/**
+ * Returns the number of registers threads need to run the current unit: one
+ * past the highest register any instruction operand refers to, and never fewer
+ * than the reserved, non-volatile, and argument registers.
+ */
+int64_t vm_state::count_used_registers() const
+{
+  int64_t count = vm_thread::R_LAST_ARGUMENT + 1;
+
+  for (int64_t ip = 0; ip < _source_size; ++ip) {
+    vm_op const op = _unit.fetch_op(ip);
+    vm_opcode const opcode = op.opcode();
+    if (opcode >= OP_COUNT) {
+      continue;
     }
 
-    std::memcpy(found.value.block, ptr, size);
-    new_ids[index] = new_id;
-  });
+    int64_t const argc = g_opcode_argc[opcode] - (opcode_has_litflag(opcode) ? 1 : 0);
+    uint64_t const litflag = op.litflag();
+    for (int64_t arg = 0; arg < argc; ++arg) {
+      if (litflag & (uint64_t(1) << arg)) {
+        continue;
+      }
+
+      // Operands that aren't registers may be counted too, which only costs
+      // space.
+      int64_t const reg = op[arg];
+      if (reg >= count && reg < vm_thread::REGISTER_COUNT) {
+        count = reg + 1;
+      }
+    }
+  }
 
-  _unit.relocate_static_data(new_ids);
+  return count;
 }
 
 
@@ -157,7 +533,15 @@ vm_bound_fn_t vm_state::bind_callback(const char *name, int length, vm_callback_
   auto imported = _unit.imports.find(name_key);
   if (imported != _unit.imports.cend()) {
     const int64_t idx = -(imported->second + 1);
-    _callbacks.at(idx) = callback_info { function, context };
+    if (idx < 0 || idx >= _callback_count) {
+      throw std::out_of_range("Import index out of range of callbacks");
+    }
+
+    // Infos are kept alive until the unit changes since threads may still be
+    // calling a callback as it's rebound.
+    std::lock_guard<std::mutex> guard { _bind_lock };
+    _bound_callbacks.emplace_back(new callback_info { function, context });
+    _callbacks[idx].store(_bound_callbacks.back().get(), std::memory_order_release);
     return vm_bound_fn_t { true, imported->second };
   }
 
@@ -185,37 +569,108 @@ vm_bound_fn_t vm_state::bind_callback(const char *name, vm_callback_t *function,
 
 
 /**
- * Releases all non-static memory allocated by the VM.
+ * Unbinds every callback, leaving all import slots unbound.
+ */
+void vm_state::unbind_callbacks()
+{
+  std::lock_guard<std::mutex> guard { _bind_lock };
+  for (int64_t index = 0; index < _callback_count; ++index) {
+    _callbacks[index].store(&NO_CALLBACK, std::memory_order_release);
+  }
+  _bound_callbacks.clear();
+}
+
+
+
+/**
+ * Returns the callback info currently bound to the given callback slot.
+ */
+auto vm_state::callback(int64_t callback_index) const -> callback_info const &
+{
+  return *_callbacks[callback_index].load(std::memory_order_acquire);
+}
+
+
+
+/**
+ * Releases all memory allocated by the VM, including materialized static
+ * blocks.
  */
 void vm_state::release_all_memblocks() noexcept
 {
-  for (auto kvpair : _blocks) {
-    if (!(kvpair.second.flags & VM_MEM_STATIC) && kvpair.second.block) {
+  for (block_shard &shard : _block_shards) {
+    std::lock_guard<std::mutex> guard { shard.lock };
+    for (auto kvpair : shard.blocks) {
       std::free(kvpair.second.block);
     }
+    shard.blocks.clear();
+  }
+}
+
+
+
+/**
+ * Frees all non-static memory blocks, keeping the unit's static data.
+ */
+void vm_state::release_user_memblocks() noexcept
+{
+  for (block_shard &shard : _block_shards) {
+    std::lock_guard<std::mutex> guard { shard.lock };
+    auto iter = shard.blocks.begin();
+    while (iter != shard.blocks.end()) {
+      if (iter->second.flags & VM_MEM_STATIC) {
+        ++iter;
+        continue;
+      }
+      std::free(iter->second.block);
+      iter = shard.blocks.erase(iter);
+    }
   }
-  _blocks.clear();
 }
 
 
 
 /**
- * Yields an unused block ID. Subsequent calls return the same value unless the
- * ID is consumed by the VM memory allocator.
+ * Returns the shard holding the given block ID.
+ */
+auto vm_state::shard_for(int64_t block_id) -> block_shard &
+{
+  return _block_shards[static_cast<uint64_t>(block_id) % VM_BLOCK_SHARDS];
+}
+
+
+
+/**
+ * Const form of shard_for.
+ */
+auto vm_state::shard_for(int64_t block_id) const -> block_shard const &
+{
+  return _block_shards[static_cast<uint64_t>(block_id) % VM_BLOCK_SHARDS];
+}
+
+
+
+/**
+ * Stores a block under a new, unused block ID and returns the ID.
  *
- * Returns zero (0) upon error.
+ * IDs are taken from an atomic counter, so concurrent allocations only contend
+ * when they land in the same shard. IDs still in use after the counter wraps
+ * around are skipped.
  */
-int64_t vm_state::unused_block_id()
+int64_t vm_state::insert_block(memblock const &block)
 {
-  auto end = _blocks.end();
-  auto const start_counter = _block_counter;
-  while (_blocks.find(_block_counter) != end || _block_counter == 0) {
-    ++_block_counter;
-    if (_block_counter == start_counter) {
-      return 0;
+  for (;;) {
+    int64_t const block_id = _block_counter.fetch_add(1, std::memory_order_relaxed);
+    if (block_id == VM_NULL_BLOCK) {
+      continue;
+    }
+
+    block_shard &shard = shard_for(block_id);
+    std::lock_guard<std::mutex> guard { shard.lock };
+    if (shard.blocks.emplace(block_id, block).second) {
+      return block_id;
     }
   }
-  return _block_counter;
 }
 
 
@@ -243,9 +698,11 @@ int64_t vm_state::realloc_block_with_flags(int64_t block_id, int64_t size, uint3
   }
 
   if (block_id != 0) {
-    memblock_map_t::iterator iter = _blocks.find(block_id);
+    block_shard &shard = shard_for(block_id);
+    std::lock_guard<std::mutex> guard { shard.lock };
+    memblock_map_t::iterator iter = shard.blocks.find(block_id);
 
-    if (iter == _blocks.cend()) {
+    if (iter == shard.blocks.cend()) {
       throw vm_memory_access_error("No block found for given block_id");
     }
 
@@ -254,22 +711,28 @@ int64_t vm_state::realloc_block_with_flags(int64_t block_id, int64_t size, uint3
     if (iter->second.flags & VM_MEM_STATIC) {
       throw vm_memory_permission_error("Attempt to reallocate static memory block.");
     }
-  } else {
-    block_id = unused_block_id();
+
+    void *const resized = std::realloc(src, static_cast<size_t>(size));
+    if (resized == nullptr) {
+      throw vm_memory_access_error("Unable to reallocate block");
+    }
+
+    iter->second = memblock { size, flags, resized, -1 };
+    return block_id;
   }
 
   memblock block {
     size,
     flags,
-    std::realloc(src, static_cast<size_t>(size))
+    std::malloc(static_cast<size_t>(size)),
+    -1
   };
 
   if (block.block == nullptr) {
     throw vm_memory_access_error("Unable to reallocate block");
   }
 
-  _blocks[block_id] = block;
-  return block_id;
+  return insert_block(block);
 }
 
 
@@ -295,17 +758,28 @@ int64_t vm_state::realloc_block(int64_t block_id, int64_t size)
  */
 int64_t vm_state::duplicate_block(int64_t block_id)
 {
-  memblock_map_t::const_iterator iter = _blocks.find(block_id);
-  if (iter != _blocks.cend()) {
-    const auto entry = iter->second;
-    if (entry.flags & VM_MEM_READABLE) {
-      int64_t new_block_id = realloc_block(VM_NULL_BLOCK, entry.size);
-      void *new_block = get_block(new_block_id, VM_MEM_WRITABLE);
-      std::memcpy(new_block, entry.block, entry.size);
-      return new_block_id;
+  memblock copy { 0, VM_MEM_READ_WRITE, nullptr, -1 };
+
+  {
+    // The copy is made under the source's lock, but it's inserted after
+    // releasing it since it may belong to the same shard.
+    block_shard const &shard = shard_for(block_id);
+    std::lock_guard<std::mutex> guard { shard.lock };
+    memblock_map_t::iterator iter = shard.blocks.find(block_id);
+    if (iter == shard.blocks.cend() || !(iter->second.flags & VM_MEM_READABLE)) {
+      return 0;
     }
+
+    materialize_block(iter->second);
+    copy.size = iter->second.size;
+    copy.block = std::malloc(static_cast<size_t>(copy.size));
+    if (copy.block == nullptr) {
+      throw vm_memory_access_error("Unable to reallocate block");
+    }
+    std::memcpy(copy.block, iter->second.block, copy.size);
   }
-  return 0;
+
+  return insert_block(copy);
 }
 
 
@@ -319,11 +793,7 @@ int64_t vm_state::block_size(int64_t block_id) const
     return 0;
   }
 
-  memblock_map_t::const_iterator iter = _blocks.find(block_id);
-  if (iter != _blocks.cend()) {
-    return iter->second.size;
-  }
-  return 0;
+  return find_block_info(block_id).value.size;
 }
 
 
@@ -335,25 +805,53 @@ int64_t vm_state::block_size(int64_t block_id) const
  */
 void vm_state::free_block(int64_t block_id)
 {
-  memblock_map_t::const_iterator iter = _blocks.find(block_id);
-  if (iter == _blocks.cend()) {
-    throw vm_memory_access_error("Attempt to free nonexistent block");
-  } else if (iter->second.flags & VM_MEM_STATIC) {
-    throw vm_memory_permission_error("Attempt to free static memory block");
+  void *memory = nullptr;
+
+  {
+    block_shard &shard = shard_for(block_id);
+    std::lock_guard<std::mutex> guard { shard.lock };
+    memblock_map_t::const_iterator iter = shard.blocks.find(block_id);
+    if (iter == shard.blocks.cend()) {
+      throw vm_memory_access_error("Attempt to free nonexistent block");
+    } else if (iter->second.flags & VM_MEM_STATIC) {
+      throw vm_memory_permission_error("Attempt to free static memory block");
+    }
+
+    memory = iter->second.block;
+    shard.blocks.erase(iter);
   }
 
-  std::free(iter->second.block);
-  _blocks.erase(iter);
+  std::free(memory);
 }
 
 
 
 /**
- * Attempts to get info for the given block ID.
+ * Attempts to get info for the given block ID. Static blocks are materialized
+ * if they haven't been yet.
  */
 auto vm_state::get_block_info(int64_t block_id) const -> found_memblock_t {
-  auto const block_iter = _blocks.find(block_id);
-  if (block_iter == _blocks.end()) {
+  block_shard const &shard = shard_for(block_id);
+  std::lock_guard<std::mutex> guard { shard.lock };
+  auto const block_iter = shard.blocks.find(block_id);
+  if (block_iter == shard.blocks.end()) {
+    return { false, NO_BLOCK };
+  }
+  materialize_block(block_iter->second);
+  return { true, block_iter->second };
+}
+
+
+
+/**
+ * Attempts to get info for the given block ID without materializing it. Only
+ * the block's size and flags are meaningful.
+ */
+auto vm_state::find_block_info(int64_t block_id) const -> found_memblock_t {
+  block_shard const &shard = shard_for(block_id);
+  std::lock_guard<std::mutex> guard { shard.lock };
+  auto const block_iter = shard.blocks.find(block_id);
+  if (block_iter == shard.blocks.end()) {
     return { false, NO_BLOCK };
   }
   return { true, block_iter->second };
@@ -361,6 +859,35 @@ auto vm_state::get_block_info(int64_t block_id) const -> found_memblock_t {
 
 
 
+/**
+ * Copies a static block's data out of the unit if it hasn't been yet. The
+ * block's shard must be locked. Throws vm_bad_unit if the unit's copy of the
+ * block is compressed and corrupt.
+ */
+void vm_state::materialize_block(memblock &block) const
+{
+  if (block.block != nullptr || block.source_index < 0) {
+    return;
+  }
+
+  // Empty blocks still get memory so they aren't mistaken for unmaterialized ones.
+  void *const data = std::malloc(static_cast<size_t>(std::max<int64_t>(block.size, 1)));
+  if (data == nullptr) {
+    throw vm_memory_access_error("Unable to allocate block");
+  }
+
+  try {
+    _unit.copy_data_block(static_cast<size_t>(block.source_index), data);
+  } catch (...) {
+    std::free(data);
+    throw;
+  }
+
+  block.block = data;
+}
+
+
+
 /**
  * Looks up a block by its ID, returning it if it's requested with adequate
  * permissions. It's an error to request a block without adequate permissions
@@ -429,6 +956,69 @@ vm_found_fn_t vm_state::find_function_pointer(const char *name) const
 
 
 
+/**
+ * Looks up a function by name and resolves a handle to it. The handle caches
+ * the function's entry point and callback slot, so calls through it need no
+ * further lookups.
+ *
+ * If arity is non-negative, calls through the handle must pass exactly that
+ * many arguments.
+ */
+vm_found_handle_t vm_state::find_function_handle(const char *name, int64_t arity) const
+{
+  auto const pointer = find_function_pointer(name);
+  if (!pointer.ok) {
+    return vm_found_handle_t { false, vm_function_handle {} };
+  }
+  return find_function_handle(pointer.value, arity);
+}
+
+
+
+/**
+ * Resolves a handle for the function at the given instruction pointer. Fails
+ * if the pointer is outside the unit's instructions or refers to an unbound
+ * callback slot.
+ */
+vm_found_handle_t vm_state::find_function_handle(int64_t pointer, int64_t arity) const
+{
+  if (pointer >= _source_size ||
+      (pointer < 0 && -(pointer + 1) >= _callback_count)) {
+    return vm_found_handle_t { false, vm_function_handle {} };
+  } else if (arity < -1) {
+    throw vm_invalid_argument_count("Declared arity may not be less than -1");
+  }
+  return vm_found_handle_t { true, vm_function_handle { *this, pointer, arity } };
+}
+
+
+
+/**
+ * Resolves a lane kernel for a function handle resolved by this state. The
+ * handle must have a declared arity. Fails if the function is a host callback
+ * or doesn't qualify for lane execution.
+ *
+ * @see vm_lane_kernel
+ */
+vm_found_lanes_t vm_state::find_lane_kernel(vm_function_handle const &fn) const
+{
+  if (fn._process != this) {
+    throw vm_wrong_process("Function handle was resolved by a different process");
+  } else if (fn.arity() < 0) {
+    throw vm_invalid_argument_count("Lane kernels require a declared arity");
+  } else if (fn.is_callback()) {
+    return vm_found_lanes_t { false, vm_lane_kernel {} };
+  }
+
+  vm_lane_kernel kernel { *this, fn.pointer(), fn.arity() };
+  if (!kernel.verify()) {
+    return vm_found_lanes_t { false, vm_lane_kernel {} };
+  }
+  return vm_found_lanes_t { true, std::move(kernel) };
+}
+
+
+
 /**
  * Checks whether an offset with a size are within a block's bounds. Always
  * returns true for a size and offset of zero.
@@ -449,78 +1039,842 @@ bool vm_state::check_block_bounds(int64_t block_id, int64_t offset, int64_t size
 
 
 /**
- * Given a thread, takes ownership of its resources and adds it to the VM. The
- * original thread object is invalidated.
+ * Finds the chunk holding the thread slot at the given index and the slot's
+ * offset into it.
  */
-void vm_state::load_thread(thread_pointer_t &&thread)
+void vm_state::locate_thread_slot(int64_t slot_index, int64_t &chunk, int64_t &offset)
 {
-  auto const end = _threads.end();
-  auto first_null = std::find(_threads.begin(), end, nullptr);
+  // Chunk N starts at THREAD_FIRST_CHUNK_SIZE * (2^N - 1).
+  unsigned long long const scaled = static_cast<unsigned long long>(slot_index / THREAD_FIRST_CHUNK_SIZE + 1);
+  chunk = 63 - __builtin_clzll(scaled);
+  offset = slot_index - THREAD_FIRST_CHUNK_SIZE * ((int64_t(1) << chunk) - 1);
+}
 
-  if (first_null == end) {
-    _threads.emplace_back(std::move(thread));
-  } else {
-    *first_null = std::move(thread);
+
+
+/**
+ * Returns the thread slot at the given slot index, or null if the slot hasn't
+ * been allocated.
+ */
+auto vm_state::thread_slot(int64_t slot_index) const -> thread_slot_t *
+{
+  if (slot_index < 0 || slot_index >= THREAD_SLOT_LIMIT) {
+    return nullptr;
   }
+
+  int64_t chunk_index, offset;
+  locate_thread_slot(slot_index, chunk_index, offset);
+  thread_slot_t *const chunk = _thread_chunks[chunk_index].load(std::memory_order_acquire);
+  if (chunk == nullptr) {
+    return nullptr;
+  }
+  return &chunk[offset];
 }
 
 
 
 /**
- * Destroys the thread at the given index.
+ * Allocates the chunk holding the given thread slot if it hasn't been yet.
+ * May be called by several host threads at once.
  */
-void vm_state::destroy_thread(int64_t index)
+void vm_state::allocate_thread_chunk(int64_t slot_index)
 {
-  _threads.at(index).reset(nullptr);
+  int64_t chunk_index, offset;
+  locate_thread_slot(slot_index, chunk_index, offset);
+
+  std::atomic<thread_slot_t *> &chunk_slot = _thread_chunks[chunk_index];
+  if (chunk_slot.load(std::memory_order_acquire) != nullptr) {
+    return;
+  }
+
+  thread_slot_t *expected = nullptr;
+  thread_slot_t *const fresh = new thread_slot_t[THREAD_FIRST_CHUNK_SIZE << chunk_index];
+  if (!chunk_slot.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+    // Another thread allocated the chunk first.
+    delete[] fresh;
+  }
 }
 
 
 
 /**
- * Gets a thread by its index.
+ * Returns the thread with the given ID, or null if there's no such thread or
+ * it's been destroyed.
  */
-vm_thread &vm_state::thread_by_index(int64_t thread_index)
+vm_thread *vm_state::find_thread(int64_t thread_id) const
 {
-  return *_threads[thread_index];
+  if (thread_id < 0) {
+    return nullptr;
+  }
+
+  int64_t const generation = thread_id >> THREAD_SLOT_BITS;
+  thread_slot_t const *const slot = thread_slot(thread_id & THREAD_SLOT_MASK);
+  if (slot == nullptr || slot->generation.load(std::memory_order_acquire) != generation) {
+    return nullptr;
+  }
+
+  vm_thread *const thread = slot->thread.load(std::memory_order_acquire);
+  // If the thread was destroyed and its slot reused between the two loads, the
+  // generation has moved on by now.
+  if (slot->generation.load(std::memory_order_acquire) != generation) {
+    return nullptr;
+  }
+  return thread;
 }
 
 
 
 /**
- * Const form of thread_by_index.
+ * Claims a thread slot for a new thread, reusing a slot freed by a destroyed
+ * thread if there is one. The slot must be passed to load_thread or handed
+ * back with push_free_thread_slot.
  */
-vm_thread const &vm_state::thread_by_index(int64_t thread_index) const
+int64_t vm_state::claim_thread_slot()
 {
-  return *_threads[thread_index];
+  int64_t slot_index = pop_free_thread_slot();
+  if (slot_index >= 0) {
+    return slot_index;
+  }
+
+  slot_index = _thread_slot_count.load(std::memory_order_relaxed);
+  do {
+    if (slot_index >= THREAD_SLOT_LIMIT) {
+      throw vm_runtime_error("Attempt to allocate more threads than the state can hold");
+    }
+  } while (!_thread_slot_count.compare_exchange_weak(slot_index, slot_index + 1, std::memory_order_relaxed));
+
+  allocate_thread_chunk(slot_index);
+  return slot_index;
 }
 
 
 
 /**
- * Allocates a new thread with a given initial stack size.
+ * Pops a slot off the free slot stack. Returns -1 if the stack is empty.
  */
-vm_thread &vm_state::make_thread(size_t stack_size)
+int64_t vm_state::pop_free_thread_slot()
 {
-  thread_pointer_t ptr { new vm_thread(*this, stack_size) };
-  vm_thread *raw = ptr.get();
-  load_thread(std::move(ptr));
-  return *raw;
+  uint64_t top = _free_thread_slots.load(std::memory_order_acquire);
+
+  for (;;) {
+    int64_t const slot_index = static_cast<int64_t>(top & THREAD_SLOT_MASK) - 1;
+    if (slot_index < 0) {
+      return -1;
+    }
+
+    // May be stale if the slot was popped by another thread after loading top,
+    // but then top has changed too and the exchange fails.
+    int64_t const next_index = thread_slot(slot_index)->next_free.load(std::memory_order_relaxed);
+    uint64_t const next =
+      ((top & ~uint64_t(THREAD_SLOT_MASK)) + (uint64_t(1) << THREAD_SLOT_BITS)) |
+      static_cast<uint64_t>(next_index + 1);
+    if (_free_thread_slots.compare_exchange_weak(top, next, std::memory_order_acquire)) {
+      return slot_index;
+    }
+  }
 }
 
 
 
 /**
- * Forks a given thread, returning a reference to the new thread. The returned
- * thread may be run to resume execution from where it left off.
+ * Pushes a slot onto the free slot stack. The slot must not hold a thread.
  */
-vm_thread &vm_state::fork_thread(vm_thread const &thread)
+void vm_state::push_free_thread_slot(int64_t slot_index)
 {
-  if (&thread._process != this) {
-    throw vm_wrong_process("Thread process doesn't match this process.");
+  thread_slot_t *const slot = thread_slot(slot_index);
+  uint64_t top = _free_thread_slots.load(std::memory_order_relaxed);
+  uint64_t next = 0;
+
+  do {
+    slot->next_free.store(static_cast<int64_t>(top & THREAD_SLOT_MASK) - 1, std::memory_order_relaxed);
+    next =
+      ((top & ~uint64_t(THREAD_SLOT_MASK)) + (uint64_t(1) << THREAD_SLOT_BITS)) |
+      static_cast<uint64_t>(slot_index + 1);
+  } while (!_free_thread_slots.compare_exchange_weak(top, next, std::memory_order_release, std::memory_order_relaxed));
+}
+
+
+
+/**
+ * Returns the free slots in the order they were pushed, so the last one is
+ * reused first. Threads may not be created or destroyed concurrently.
+ */
+std::vector<int64_t> vm_state::free_thread_slots() const
+{
+  std::vector<int64_t> slot_indices;
+  int64_t slot_index = static_cast<int64_t>(_free_thread_slots.load(std::memory_order_acquire) & THREAD_SLOT_MASK) - 1;
+  while (slot_index >= 0) {
+    slot_indices.push_back(slot_index);
+    slot_index = thread_slot(slot_index)->next_free.load(std::memory_order_relaxed);
+  }
+  std::reverse(slot_indices.begin(), slot_indices.end());
+  return slot_indices;
+}
+
+
+
+/**
+ * Replaces the free slot stack with the given slots, in the order
+ * free_thread_slots returns them. Threads may not be created or destroyed
+ * concurrently.
+ */
+void vm_state::reset_free_thread_slots(std::vector<int64_t> const &slot_indices)
+{
+  _free_thread_slots.store(0, std::memory_order_relaxed);
+  for (int64_t const slot_index : slot_indices) {
+    push_free_thread_slot(slot_index);
+  }
+}
+
+
+
+/**
+ * Takes the thread kept for reuse in a claimed slot, if any. The thread must
+ * be recycled or forked into before use.
+ */
+vm_thread *vm_state::take_pooled_thread(int64_t slot_index)
+{
+  thread_slot_t *const slot = thread_slot(slot_index);
+  vm_thread *const thread = slot->pooled;
+  if (thread != nullptr) {
+    slot->pooled = nullptr;
+    _pooled_thread_count.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return thread;
+}
+
+
+
+/**
+ * Keeps a destroyed thread in its now empty slot for reuse, or frees it if
+ * VM_THREAD_POOL_SIZE threads are already kept. Must be called before the
+ * slot is pushed onto the free slot stack.
+ */
+void vm_state::pool_thread(int64_t slot_index, vm_thread *thread)
+{
+  if (_pooled_thread_count.fetch_add(1, std::memory_order_relaxed) < VM_THREAD_POOL_SIZE) {
+    thread_slot(slot_index)->pooled = thread;
+  } else {
+    _pooled_thread_count.fetch_sub(1, std::memory_order_relaxed);
+    delete thread;
+  }
+}
+
+
+
+/**
+ * Takes ownership of the given thread, storing it in a slot claimed by
+ * claim_thread_slot, and assigns it an ID.
+ */
+int64_t vm_state::load_thread(int64_t slot_index, vm_thread *thread)
+{
+  thread_slot_t *const slot = thread_slot(slot_index);
+  thread->_thread_id =
+    (slot->generation.load(std::memory_order_relaxed) << THREAD_SLOT_BITS) | slot_index;
+  slot->thread.store(thread, std::memory_order_release);
+  _thread_count.fetch_add(1, std::memory_order_relaxed);
+  return thread->_thread_id;
+}
+
+
+
+/**
+ * Destroys the thread with the given ID. Its ID goes stale and its slot is
+ * freed for reuse. Up to VM_THREAD_POOL_SIZE destroyed threads are kept for
+ * reuse instead of being freed.
+ */
+void vm_state::destroy_thread(int64_t thread_id)
+{
+  vm_thread *const thread = find_thread(thread_id);
+  int64_t const slot_index = thread_id & THREAD_SLOT_MASK;
+  int64_t generation = thread_id >> THREAD_SLOT_BITS;
+
+  // Bumping the generation claims the thread, so only one of several
+  // concurrent destroys of it gets past this.
+  if (thread == nullptr ||
+      !thread_slot(slot_index)->generation.compare_exchange_strong(
+        generation,
+        (generation + 1) & THREAD_GENERATION_MASK,
+        std::memory_order_acq_rel
+        )) {
+    throw vm_bad_thread("Attempt to destroy a thread that doesn't exist");
+  }
+  thread_slot(slot_index)->thread.store(nullptr, std::memory_order_release);
+  _thread_count.fetch_sub(1, std::memory_order_relaxed);
+
+  if (thread->_async_token >= 0) {
+    // Drop the thread's async wait so completing it is a no-op.
+    std::lock_guard<std::mutex> async_guard { _async_lock };
+    _async_waits.erase(thread->_async_token);
+    thread->_async_token = -1;
+    _async_ready.notify_all();
+  }
+
+  pool_thread(slot_index, thread);
+  push_free_thread_slot(slot_index);
+}
+
+
+
+/**
+ * Destroys every thread owned by the state, including pooled threads. Only
+ * used when the state is destroyed.
+ */
+void vm_state::destroy_all_threads() noexcept
+{
+  for (int64_t chunk_index = 0; chunk_index < THREAD_CHUNK_COUNT; ++chunk_index) {
+    thread_slot_t *const chunk = _thread_chunks[chunk_index].load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+      continue;
+    }
+
+    for (int64_t offset = 0; offset < (THREAD_FIRST_CHUNK_SIZE << chunk_index); ++offset) {
+      thread_slot_t &slot = chunk[offset];
+      delete slot.thread.exchange(nullptr, std::memory_order_acq_rel);
+      delete slot.pooled;
+      slot.pooled = nullptr;
+    }
+  }
+  _thread_count = 0;
+  _pooled_thread_count = 0;
+}
+
+
+
+/**
+ * Destroys every loaded thread as destroy_thread would, keeping up to
+ * VM_THREAD_POOL_SIZE of them for reuse. Used by recycle, so threads may not
+ * be created or destroyed concurrently.
+ */
+void vm_state::pool_all_threads()
+{
+  int64_t const slot_count = _thread_slot_count.load(std::memory_order_relaxed);
+
+  for (int64_t slot_index = 0; slot_index < slot_count; ++slot_index) {
+    thread_slot_t *const slot = thread_slot(slot_index);
+    vm_thread *const thread = slot ? slot->thread.exchange(nullptr, std::memory_order_acq_rel) : nullptr;
+    if (thread == nullptr) {
+      continue;
+    }
+
+    slot->generation.store(
+      (slot->generation.load(std::memory_order_relaxed) + 1) & THREAD_GENERATION_MASK,
+      std::memory_order_release
+      );
+    pool_thread(slot_index, thread);
+    push_free_thread_slot(slot_index);
+  }
+
+  _thread_count.store(0, std::memory_order_relaxed);
+}
+
+
+
+/**
+ * Gets a thread by its ID. Throws vm_bad_thread if there's no such thread or
+ * it's been destroyed.
+ */
+vm_thread &vm_state::thread_by_index(int64_t thread_id)
+{
+  vm_thread *const thread = find_thread(thread_id);
+  if (thread == nullptr) {
+    throw vm_bad_thread("No thread with the given ID");
+  }
+  return *thread;
+}
+
+
+
+/**
+ * Const form of thread_by_index.
+ */
+vm_thread const &vm_state::thread_by_index(int64_t thread_id) const
+{
+  vm_thread const *const thread = find_thread(thread_id);
+  if (thread == nullptr) {
+    throw vm_bad_thread("No thread with the given ID");
+  }
+  return *thread;
+}
+
+
+
+/**
+ * Allocates a new thread with a given initial stack size, reusing a pooled
+ * thread if there is one.
+ */
+vm_thread &vm_state::make_thread(size_t stack_size)
+{
+  int64_t const slot_index = claim_thread_slot();
+  vm_thread *thread = take_pooled_thread(slot_index);
+
+  try {
+    if (thread != nullptr) {
+      thread->recycle(stack_size);
+    } else {
+      thread = new vm_thread(*this, stack_size);
+    }
+  } catch (...) {
+    delete thread;
+    push_free_thread_slot(slot_index);
+    throw;
+  }
+
+  load_thread(slot_index, thread);
+  return *thread;
+}
+
+
+
+/**
+ * Forks a given thread, returning a reference to the new thread. The returned
+ * thread may be run to resume execution from where it left off, but only until
+ * it returns from its current function (see vm_thread::fork_from).
+ */
+vm_thread &vm_state::fork_thread(vm_thread const &thread)
+{
+  if (&thread._process != this) {
+    throw vm_wrong_process("Thread process doesn't match this process.");
+  }
+
+  int64_t const slot_index = claim_thread_slot();
+  vm_thread *fork = take_pooled_thread(slot_index);
+
+  try {
+    if (fork == nullptr) {
+      fork = new vm_thread(*this, 0);
+    }
+    fork->fork_from(thread);
+  } catch (...) {
+    delete fork;
+    push_free_thread_slot(slot_index);
+    throw;
+  }
+
+  // The fork isn't running any host calls of its own.
+  fork->_host_calls = 0;
+  fork->_suspended = false;
+  fork->_yielded = false;
+  fork->_task.reset();
+  load_thread(slot_index, fork);
+  return *fork;
+}
+
+
+
+/**
+ * Sets the scheduler that threads created by DEFER are handed to. If null,
+ * deferred threads only run when joined. The scheduler must outlive the state
+ * or be unset before it's destroyed.
+ *
+ * It is an error to change schedulers while deferred threads are running.
+ */
+void vm_state::set_scheduler(vm_scheduler *scheduler)
+{
+  if (_deferred_count.load(std::memory_order_acquire) > 0) {
+    throw vm_logic_error("Attempt to change schedulers with running deferred threads.");
+  }
+
+  _scheduler = scheduler;
+}
+
+
+
+/**
+ * Parks a thread on an async host callback and returns a token to complete it
+ * with. Called from a callback that can't produce its result right away, such
+ * as one waiting on I/O: the thread stops once the callback returns, and the
+ * callback's own return value is discarded. When the token is completed (see
+ * complete_async), run_completed resumes the thread with the completed result
+ * as the callback's result.
+ *
+ * Only the outermost host call on a thread can be parked, since nested calls
+ * would leave host frames in the way.
+ */
+int64_t vm_state::park_thread(vm_thread &thread)
+{
+  return park(thread, true);
+}
+
+
+
+/**
+ * Parks the thread running the outermost host call and returns its async
+ * token. If assign_result is set, the result the token is completed with is
+ * assigned to the thread's RP when it's resumed.
+ */
+int64_t vm_state::park(vm_thread &thread, bool assign_result)
+{
+  if (&thread._process != this) {
+    throw vm_wrong_process("Thread process doesn't match this process.");
+  } else if (thread._host_calls != 1) {
+    throw vm_thread_state_error("Attempt to park a thread outside of an outermost host call");
+  } else if (thread._parked) {
+    throw vm_thread_state_error("Attempt to park a thread that is already parked");
+  }
+
+  int64_t token = 0;
+  {
+    std::lock_guard<std::mutex> guard { _async_lock };
+    token = ++_async_counter;
+    _async_waits.emplace(token, async_wait { &thread, false, vm_value::undefined(), assign_result });
+  }
+
+  thread._async_token = token;
+  thread._parked = true;
+  thread._suspended = true;
+  ++thread._trap;
+  return token;
+}
+
+
+
+/**
+ * Completes the async callback with the given token, queueing its thread to
+ * be resumed with the given result by run_completed. May be called from any
+ * host thread. Returns false if the token isn't waiting on a result, either
+ * because it was already completed or because its thread was destroyed.
+ */
+bool vm_state::complete_async(int64_t token, vm_value result)
+{
+  {
+    std::lock_guard<std::mutex> guard { _async_lock };
+    auto const wait = _async_waits.find(token);
+    if (wait == _async_waits.end() || wait->second.completed) {
+      return false;
+    }
+    wait->second.completed = true;
+    wait->second.result = result;
+    _async_completed.push_back(token);
+  }
+
+  _async_ready.notify_all();
+  return true;
+}
+
+
+
+/**
+ * Resumes every thread whose async callback has been completed, in the order
+ * they were completed, and returns the number of threads resumed. If given,
+ * on_resumed is called after each thread is resumed with the outcome of its
+ * host call, which may have parked again, followed by the thread's resume hook
+ * if it has one (see vm_thread::set_resume_hook).
+ *
+ * Should only be called from the host thread that runs the parked threads.
+ * Together with wait_completed, this is enough for one host thread to run
+ * many VM threads waiting on I/O:
+ *
+ *   while (vm.wait_completed()) {
+ *     vm.run_completed(on_resumed, context);
+ *   }
+ */
+int64_t vm_state::run_completed(vm_resumed_fn_t *on_resumed, void *context)
+{
+  int64_t resumed = 0;
+
+  while (vm_thread *const thread = take_completed()) {
+    vm_resume_result const outcome = thread->resume();
+    ++resumed;
+    if (on_resumed) {
+      on_resumed(*thread, outcome, context);
+    }
+
+    // Called last, since the hook may resume host code that destroys the
+    // thread.
+    vm_resumed_fn_t *const hook = thread->_resume_hook;
+    if (hook) {
+      void *const hook_context = thread->_resume_hook_context;
+      thread->set_resume_hook(nullptr);
+      hook(*thread, outcome, hook_context);
+    }
+  }
+
+  return resumed;
+}
+
+
+
+/**
+ * Takes the next thread whose async wait has been completed and unparks it,
+ * leaving its host call suspended but ready to resume. Returns null if there
+ * are no completed waits.
+ */
+vm_thread *vm_state::take_completed()
+{
+  vm_thread *thread = nullptr;
+  vm_value result;
+  bool assign_result = false;
+
+  {
+    std::lock_guard<std::mutex> guard { _async_lock };
+    while (thread == nullptr) {
+      if (_async_completed.empty()) {
+        return nullptr;
+      }
+
+      auto const wait = _async_waits.find(_async_completed.front());
+      _async_completed.pop_front();
+      if (wait == _async_waits.end()) {
+        // The thread was destroyed after the wait was completed.
+        continue;
+      }
+
+      thread = wait->second.thread;
+      result = wait->second.result;
+      assign_result = wait->second.assign_result;
+      _async_waits.erase(wait);
+    }
+  }
+
+  thread->_parked = false;
+  thread->_async_token = -1;
+  if (assign_result) {
+    thread->rp() = result;
+  }
+  return thread;
+}
+
+
+
+/**
+ * Blocks until an async callback has been completed and its thread can be
+ * resumed by run_completed. Returns false without blocking if no threads are
+ * parked, since nothing would ever be completed.
+ */
+bool vm_state::wait_completed()
+{
+  std::unique_lock<std::mutex> lock { _async_lock };
+  _async_ready.wait(lock, [this] {
+    return !_async_completed.empty() || _async_waits.empty();
+  });
+  return !_async_completed.empty();
+}
+
+
+
+/**
+ * Same as wait_completed, but gives up at the given deadline. Returns whether
+ * any async callbacks have been completed.
+ */
+bool vm_state::wait_completed(std::chrono::steady_clock::time_point deadline)
+{
+  std::unique_lock<std::mutex> lock { _async_lock };
+  _async_ready.wait_until(lock, deadline, [this] {
+    return !_async_completed.empty() || _async_waits.empty();
+  });
+  return !_async_completed.empty();
+}
+
+
+
+/**
+ * Returns the number of threads parked on async callbacks, including ones
+ * completed but not yet resumed.
+ */
+int64_t vm_state::parked_count()
+{
+  std::lock_guard<std::mutex> guard { _async_lock };
+  return static_cast<int64_t>(_async_waits.size());
+}
+
+
+
+/**
+ * Creates a channel that holds up to capacity values and returns its ID.
+ */
+int64_t vm_state::make_channel(int64_t capacity)
+{
+  if (capacity < 1) {
+    throw vm_bad_channel("Attempt to create a channel with a capacity less than 1");
+  }
+
+  channel_pointer_t const channel { new vm_channel(static_cast<size_t>(capacity)) };
+  std::lock_guard<std::mutex> guard { _channel_lock };
+  int64_t const channel_id = ++_channel_counter;
+  _channels.emplace(channel_id, channel);
+  return channel_id;
+}
+
+
+
+/**
+ * Returns the channel with the given ID, or null if it was closed and has been
+ * drained since. Throws if no channel was ever created with the ID.
+ */
+auto vm_state::find_channel(int64_t channel_id) -> channel_pointer_t
+{
+  std::lock_guard<std::mutex> guard { _channel_lock };
+  auto const iter = _channels.find(channel_id);
+  if (iter != _channels.end()) {
+    return iter->second;
+  } else if (channel_id <= 0 || channel_id > _channel_counter) {
+    throw vm_bad_channel("Attempt to use a channel that doesn't exist");
+  }
+  return nullptr;
+}
+
+
+
+/**
+ * Drops a closed and drained channel from the channel table. Anything still
+ * holding the channel keeps it alive. Takes _channel_lock, so it mustn't be
+ * called while holding a channel's lock.
+ */
+void vm_state::release_channel(int64_t channel_id)
+{
+  std::lock_guard<std::mutex> guard { _channel_lock };
+  _channels.erase(channel_id);
+}
+
+
+
+/**
+ * Completes the async waits of threads parked on a channel so they retry their
+ * sends or receives. Wakes only the first parked thread that still exists
+ * unless wake_all is set. Scheduled threads waiting on a channel are always
+ * woken to check theirs again. Requires the channel's lock.
+ */
+void vm_state::wake_parked(std::deque<int64_t> &tokens, bool wake_all)
+{
+  if (_scheduler) {
+    _scheduler->signal_progress();
+  }
+
+  while (!tokens.empty()) {
+    int64_t const token = tokens.front();
+    tokens.pop_front();
+    if (complete_async(token, vm_value::undefined()) && !wake_all) {
+      return;
+    }
+  }
+}
+
+
+
+/**
+ * Sends a value to a channel without blocking. Returns VM_CHANNEL_BLOCKED if
+ * the channel is full or VM_CHANNEL_CLOSED if it's closed.
+ */
+vm_channel_status vm_state::try_send(int64_t channel_id, vm_value value)
+{
+  channel_pointer_t const channel = find_channel(channel_id);
+  if (!channel) {
+    return VM_CHANNEL_CLOSED;
+  }
+
+  std::lock_guard<std::mutex> guard { channel->_lock };
+  if (channel->_closed) {
+    return VM_CHANNEL_CLOSED;
+  } else if (channel->_values.size() >= channel->_capacity) {
+    return VM_CHANNEL_BLOCKED;
+  }
+
+  channel->_values.push_back(value);
+  wake_parked(channel->_parked_receivers, false);
+  return VM_CHANNEL_OK;
+}
+
+
+
+/**
+ * Receives the oldest value sent to a channel without blocking. Returns
+ * VM_CHANNEL_BLOCKED if the channel is empty or VM_CHANNEL_CLOSED if it's
+ * closed and empty. value is only assigned if a value was received.
+ */
+vm_channel_status vm_state::try_recv(int64_t channel_id, vm_value &value)
+{
+  channel_pointer_t const channel = find_channel(channel_id);
+  if (!channel) {
+    return VM_CHANNEL_CLOSED;
+  }
+
+  bool drained = false;
+  {
+    std::lock_guard<std::mutex> guard { channel->_lock };
+    if (channel->_values.empty()) {
+      return channel->_closed ? VM_CHANNEL_CLOSED : VM_CHANNEL_BLOCKED;
+    }
+
+    value = channel->_values.front();
+    channel->_values.pop_front();
+
+    if (!channel->_closed) {
+      wake_parked(channel->_parked_senders, false);
+    } else {
+      drained = channel->_values.empty();
+    }
+  }
+
+  if (drained) {
+    release_channel(channel_id);
+  }
+  return VM_CHANNEL_OK;
+}
+
+
+
+/**
+ * Closes a channel. Values already sent can still be received, but further
+ * sends are an error. Threads waiting on the channel are woken. Closing a
+ * closed channel does nothing.
+ */
+void vm_state::close_channel(int64_t channel_id)
+{
+  channel_pointer_t const channel = find_channel(channel_id);
+  if (!channel) {
+    return;
+  }
+
+  bool drained = false;
+  {
+    std::lock_guard<std::mutex> guard { channel->_lock };
+    channel->_closed = true;
+    wake_parked(channel->_parked_receivers, true);
+    wake_parked(channel->_parked_senders, true);
+    drained = channel->_values.empty();
+  }
+
+  if (drained) {
+    release_channel(channel_id);
+  }
+}
+
+
+
+/**
+ * Parks a thread on a channel until a send (or receive) might not block.
+ * Returns false without parking if it already wouldn't.
+ */
+bool vm_state::park_on_channel(vm_thread &thread, int64_t channel_id, bool sending)
+{
+  channel_pointer_t const channel = find_channel(channel_id);
+  if (!channel) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard { channel->_lock };
+  if (channel->ready(sending)) {
+    return false;
+  }
+
+  int64_t const token = park(thread, false);
+  (sending ? channel->_parked_senders : channel->_parked_receivers).push_back(token);
+  return true;
+}
+
+
+
+/**
+ * Returns whether a send to (or receive from) a channel might not block.
+ */
+bool vm_state::channel_ready(int64_t channel_id, bool sending)
+{
+  channel_pointer_t const channel = find_channel(channel_id);
+  if (!channel) {
+    return true;
   }
 
-  thread_pointer_t ptr { new vm_thread(thread) };
-  vm_thread *raw = ptr.get();
-  load_thread(std::move(ptr));
-  return *raw;
+  std::lock_guard<std::mutex> guard { channel->_lock };
+  return channel->ready(sending);
 }
@@ -8,14 +8,24 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 #include "_types.h"
+#include "vm_channel.h"
 #include "vm_unit.h"
-
-
-class vm_thread;
+#include "vm_function.h"
+#include "vm_lanes.h"
+#include "vm_scheduler.h"
+#include "vm_snapshot.h"
+#include "vm_thread.h"
 
 
 enum vm_memblock_flags : uint32_t
@@ -32,6 +42,27 @@ enum vm_memblock_flags : uint32_t
 constexpr int64_t VM_NULL_BLOCK = 0;
 
 
+#ifndef VM_BLOCK_SHARDS
+#define VM_BLOCK_SHARDS 16
+#endif
+
+/**
+ * Maximum number of destroyed threads a state keeps around for reuse by
+ * make_thread and fork_thread. Set to 0 to free threads as they're destroyed.
+ */
+#ifndef VM_THREAD_POOL_SIZE
+#define VM_THREAD_POOL_SIZE 64
+#endif
+
+/**
+ * Whether threads' register files are sized to the registers the state's unit
+ * uses. If 0, threads always get vm_thread::REGISTER_COUNT registers.
+ */
+#ifndef VM_COMPACT_REGISTERS
+#define VM_COMPACT_REGISTERS 1
+#endif
+
+
 /**
  * The all-encompassing state object for a Rusalka VM instance. Multiple of
  * these may exist at any given time, and within them they may contain multiple
@@ -41,6 +72,13 @@ constexpr int64_t VM_NULL_BLOCK = 0;
  * and callback loading (if used). Beyond that, vm_thread covers actual Rusalka
  * execution. A vm_thread is always owned by a vm_state, as a vm_thread cannot
  * exist without a vm_unit and a means of allocating memory.
+ *
+ * Different host threads may run different vm_threads of the same state at
+ * the same time. Memory blocks are split across VM_BLOCK_SHARDS independently
+ * locked shards, threads live in a lock-free slot table, and callbacks are
+ * swapped atomically. Changing the state's unit still requires that no
+ * threads exist. Pointers returned by get_block are not protected -- freeing
+ * or reallocating a block that another thread is using is still an error.
  */
 class vm_state
 {
@@ -63,8 +101,15 @@ class vm_state
      *
      * Memory may not actually be writable, but must be when stored in the
      * memblock to quell the heart of C++.
+     *
+     * Null for static blocks that haven't been materialized yet.
      */
     void *block;
+    /**
+     * For static blocks, the index of the unit data block they're copied
+     * from on first access. -1 for other blocks.
+     */
+    int64_t source_index;
   };
 
   /**
@@ -94,35 +139,162 @@ class vm_state
   using found_memblock_t = vm_find_result<memblock>;
   /** A map of memblock names (integers) to their memblock info. */
   using memblock_map_t   = std::map<int64_t, memblock>;
-  /** Collection used for storing callback info. */
-  using callbacks_t      = std::vector<callback_info>;
-  /** A pointer to a thread allocated for a state. */
-  using thread_pointer_t = std::unique_ptr<vm_thread>;
-  /** A collection of thread pointers allocated for a state. */
-  using thread_stores_t  = std::vector<thread_pointer_t>;
+  /** A callback slot. Points to the callback info currently bound to it. */
+  using callback_slot_t  = std::atomic<callback_info const *>;
+
+  /** A lockable subset of the state's memory blocks. */
+  struct block_shard
+  {
+    mutable std::mutex lock;
+    /** Mutable since static blocks are materialized on access. */
+    mutable memblock_map_t blocks;
+  };
+
+  /** Thread table sizes and thread ID layout. */
+  enum : int64_t
+  {
+    /**
+     * Number of slots in the first thread slot chunk. Each chunk after it is
+     * twice the size of the one before, so the table grows as needed without
+     * moving slots.
+     */
+    THREAD_FIRST_CHUNK_SIZE = 64,
+    /** Thread IDs hold the slot index in their low bits. */
+    THREAD_SLOT_BITS = 32,
+    THREAD_SLOT_MASK = (int64_t(1) << THREAD_SLOT_BITS) - 1,
+    /**
+     * Maximum number of thread slots. One short of what the slot bits hold,
+     * since the free slot stack stores slot indices plus one.
+     */
+    THREAD_SLOT_LIMIT = THREAD_SLOT_MASK,
+    /** Number of chunks it takes to hold THREAD_SLOT_LIMIT slots. */
+    THREAD_CHUNK_COUNT = 27,
+    /** Generations wrap before they'd make a thread ID negative. */
+    THREAD_GENERATION_MASK = 0x7FFFFFFF,
+  };
+
+  /**
+   * A thread slot. Owns the thread it points to, if any. The slot's generation
+   * is bumped whenever its thread is destroyed, so IDs of destroyed threads go
+   * stale instead of naming whatever thread reuses the slot.
+   *
+   * Free slots are kept on a lock-free stack (see _free_thread_slots) and may
+   * hold on to the thread last destroyed in them for reuse.
+   */
+  struct thread_slot_t
+  {
+    std::atomic<vm_thread *> thread { nullptr };
+    std::atomic<int64_t> generation { 0 };
+    /** While the slot is free, the index of the free slot below it, or -1. */
+    std::atomic<int64_t> next_free { -1 };
+    /**
+     * A destroyed thread kept for reuse. Only touched by whoever holds the
+     * slot, so it isn't atomic.
+     */
+    vm_thread *pooled = nullptr;
+  };
+
+  /** A thread parked on an async callback. @see park_thread */
+  struct async_wait
+  {
+    vm_thread *thread;
+    /** Whether complete_async has been called for the wait. */
+    bool completed;
+    /** The result passed to complete_async. */
+    vm_value result;
+    /**
+     * Whether the result is assigned to the thread's RP when it's resumed.
+     * Not set for threads parked on channels, which retry their instruction.
+     */
+    bool assign_result;
+  };
+
+  using channel_pointer_t = std::shared_ptr<vm_channel>;
 
   /** The zero or null block constant. Has a null pointer and zero size. */
   static memblock const NO_BLOCK;
+  /** Callback info for import slots that haven't been bound. */
+  static callback_info const NO_CALLBACK;
 
-  /** All threads allocated to the state. */
-  thread_stores_t _threads {};
-  /** All callbacks allocated to the state. */
-  callbacks_t _callbacks {};
-  /** All memory blocks allocated to the state. */
-  memblock_map_t _blocks {};
+  /**
+   * Thread slot chunks, allocated as needed. Chunk N holds
+   * THREAD_FIRST_CHUNK_SIZE * 2^N slots and is never moved once allocated.
+   */
+  std::atomic<thread_slot_t *> _thread_chunks[THREAD_CHUNK_COUNT] {};
+  /** Number of threads currently allocated to the state. */
+  std::atomic<int64_t> _thread_count { 0 };
+  /** Number of thread slots handed out so far. */
+  std::atomic<int64_t> _thread_slot_count { 0 };
+  /**
+   * Top of the stack of slots freed by destroyed threads, which are reused
+   * before new slots are handed out. The low THREAD_SLOT_BITS hold the top
+   * slot's index plus one, or zero if the stack is empty. The bits above count
+   * changes to the stack so a pop can't succeed against a top that was popped
+   * and pushed again in the meantime.
+   */
+  std::atomic<uint64_t> _free_thread_slots { 0 };
+  /** Number of destroyed threads kept in free slots for reuse. */
+  std::atomic<int64_t> _pooled_thread_count { 0 };
+  /** Callback slots for the unit's imports. */
+  std::unique_ptr<callback_slot_t[]> _callbacks {};
+  /** The number of callback slots. */
+  int64_t _callback_count = 0;
+  /** Every callback info bound since the unit was set. Guarded by _bind_lock. */
+  std::vector<std::unique_ptr<callback_info>> _bound_callbacks {};
+  /** Serializes callback binding. Not taken when calling callbacks. */
+  std::mutex _bind_lock;
+  /** All memory blocks allocated to the state, sharded by block ID. */
+  block_shard _block_shards[VM_BLOCK_SHARDS];
   /** Internal block name counter used for allocations. */
-  int64_t _block_counter = 1;
+  std::atomic<int64_t> _block_counter { 1 };
+  /** Scheduler that deferred threads are handed to. May be null. */
+  vm_scheduler *_scheduler = nullptr;
+  /** Number of deferred threads handed to the scheduler that haven't exited. */
+  std::atomic<int64_t> _deferred_count { 0 };
+  /** Threads parked on async callbacks by token. Guarded by _async_lock. */
+  std::unordered_map<int64_t, async_wait> _async_waits {};
+  /** Tokens of completed waits in completion order. Guarded by _async_lock. */
+  std::deque<int64_t> _async_completed {};
+  /** Async token counter. Guarded by _async_lock. */
+  int64_t _async_counter = 0;
+  /** Guards async waits. Not taken while running threads. */
+  std::mutex _async_lock;
+  /** Signalled when an async wait completes or is dropped. */
+  std::condition_variable _async_ready;
+  /**
+   * Open channels and closed channels with values left, by ID. Guarded by
+   * _channel_lock.
+   */
+  std::unordered_map<int64_t, channel_pointer_t> _channels {};
+  /** Channel ID counter. IDs aren't reused. Guarded by _channel_lock. */
+  int64_t _channel_counter = 0;
+  /**
+   * Guards the channel table. Channels have their own locks, and a channel's
+   * lock is never taken while holding this one or the other way around.
+   */
+  std::mutex _channel_lock;
 
-  int64_t unused_block_id();
+  block_shard &shard_for(int64_t block_id);
+  block_shard const &shard_for(int64_t block_id) const;
+  int64_t insert_block(memblock const &block);
   void release_all_memblocks() noexcept;
+  void release_user_memblocks() noexcept;
 
   vm_unit _unit;
   int64_t _source_size;
+  /** Number of registers allocated to each thread. */
+  int64_t _register_count = vm_thread::REGISTER_COUNT;
+
+  int64_t count_used_registers() const;
 
   void reset_state();
   void prepare_unit();
 
   friend class vm_thread;
+  friend class vm_lane_kernel;
+  friend class vm_scheduler;
+  friend class vm_round_robin;
+  friend class vm_state_pool;
 
 public:
   vm_state() = default;
@@ -130,15 +302,46 @@ public:
 
   void set_unit(vm_unit const &unit);
   void set_unit(vm_unit &&unit);
+  void recycle();
+
+  vm_snapshot snapshot();
+  void restore(vm_snapshot const &snapshot);
 
 private:
   bool check_block_bounds(int64_t block_id, int64_t offset, int64_t size) const;
-  void load_thread(thread_pointer_t &&thread);
-  void destroy_thread(int64_t thread_index);
+  static void locate_thread_slot(int64_t slot_index, int64_t &chunk, int64_t &offset);
+  thread_slot_t *thread_slot(int64_t slot_index) const;
+  void allocate_thread_chunk(int64_t slot_index);
+  vm_thread *find_thread(int64_t thread_id) const;
+  int64_t claim_thread_slot();
+  int64_t pop_free_thread_slot();
+  void push_free_thread_slot(int64_t slot_index);
+  std::vector<int64_t> free_thread_slots() const;
+  void reset_free_thread_slots(std::vector<int64_t> const &slot_indices);
+  vm_thread *take_pooled_thread(int64_t slot_index);
+  void pool_thread(int64_t slot_index, vm_thread *thread);
+  int64_t load_thread(int64_t slot_index, vm_thread *thread);
+  void destroy_thread(int64_t thread_id);
+  void destroy_all_threads() noexcept;
+  void pool_all_threads();
+  callback_info const &callback(int64_t callback_index) const;
+  void unbind_callbacks();
+  void check_snapshot(vm_snapshot const &snapshot) const;
+  int64_t park(vm_thread &thread, bool assign_result);
+  vm_thread *take_completed();
+  channel_pointer_t find_channel(int64_t channel_id);
+  void release_channel(int64_t channel_id);
+  void wake_parked(std::deque<int64_t> &tokens, bool wake_all);
+  bool park_on_channel(vm_thread &thread, int64_t channel_id, bool sending);
+  bool channel_ready(int64_t channel_id, bool sending);
 
   int64_t realloc_block_with_flags(int64_t block_id, int64_t size, uint32_t flags);
   // Returns the block for the given ID -- does not do flag checking of any kind.
   found_memblock_t get_block_info(int64_t block_id) const;
+  // Same as get_block_info but doesn't materialize static blocks, so the
+  // block's pointer may be null.
+  found_memblock_t find_block_info(int64_t block_id) const;
+  void materialize_block(memblock &block) const;
 
 public:
   int64_t realloc_block(int64_t block, int64_t size);
@@ -150,14 +353,32 @@ public:
   const void *get_block(int64_t block_id, uint32_t permissions) const;
 
   vm_found_fn_t find_function_pointer(const char *name) const;
+  vm_found_handle_t find_function_handle(const char *name, int64_t arity = -1) const;
+  vm_found_handle_t find_function_handle(int64_t pointer, int64_t arity = -1) const;
+  vm_found_lanes_t find_lane_kernel(vm_function_handle const &fn) const;
 
   vm_bound_fn_t bind_callback(const char *name, int length, vm_callback_t *function, void *context = nullptr);
   vm_bound_fn_t bind_callback(const char *name, vm_callback_t *function, void *context = nullptr);
 
-  vm_thread &thread_by_index(int64_t thread_index);
-  vm_thread const &thread_by_index(int64_t thread_index) const;
+  vm_thread &thread_by_index(int64_t thread_id);
+  vm_thread const &thread_by_index(int64_t thread_id) const;
 
-  vm_thread &make_thread(size_t stack_size = 8192);
+  vm_thread &make_thread(size_t stack_size = VM_STACK_SEGMENT_SIZE);
   vm_thread &fork_thread(vm_thread const &thread);
 
+  void set_scheduler(vm_scheduler *scheduler);
+  vm_scheduler *scheduler() const { return _scheduler; }
+
+  int64_t park_thread(vm_thread &thread);
+  bool complete_async(int64_t token, vm_value result);
+  int64_t run_completed(vm_resumed_fn_t *on_resumed = nullptr, void *context = nullptr);
+  bool wait_completed();
+  bool wait_completed(std::chrono::steady_clock::time_point deadline);
+  int64_t parked_count();
+
+  int64_t make_channel(int64_t capacity);
+  vm_channel_status try_send(int64_t channel_id, vm_value value);
+  vm_channel_status try_recv(int64_t channel_id, vm_value &value);
+  void close_channel(int64_t channel_id);
+
 };
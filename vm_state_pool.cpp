@@ -0,0 +1,168 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "hash.h"
+#include "vm_exception.h"
+#include "vm_state_pool.h"
+
+
+/**
+ * Creates an empty pool of states running a copy of the given unit. States
+ * are created as they're needed, or ahead of time with reserve.
+ */
+vm_state_pool::vm_state_pool(vm_unit const &unit, size_t max_idle)
+: _unit(unit)
+, _max_idle(max_idle)
+{
+  /* nop */
+}
+
+
+
+/**
+ * Creates a new state with the pool's unit and callbacks. Requires _lock.
+ */
+auto vm_state_pool::make_state() -> state_pointer_t
+{
+  state_pointer_t state { new vm_state };
+  state->set_unit(_unit);
+  bind_all(*state);
+  return state;
+}
+
+
+
+/**
+ * Binds all of the pool's callbacks on the given state. Requires _lock.
+ */
+void vm_state_pool::bind_all(vm_state &state) const
+{
+  for (binding const &bound : _bindings) {
+    state.bind_callback(bound.name.c_str(), bound.function, bound.context);
+  }
+}
+
+
+
+/**
+ * Binds a callback on every state in the pool, including ones created later
+ * and ones currently acquired. Returns false if the pool's unit doesn't import
+ * the name, in which case nothing is bound.
+ */
+bool vm_state_pool::bind_callback(const char *name, vm_callback_t *function, void *context)
+{
+  uint64_t const name_key = hash64(name, std::strlen(name));
+  if (_unit.imports.find(name_key) == _unit.imports.cend()) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard { _lock };
+  _bindings.push_back(binding { name, function, context });
+
+  for (state_pointer_t const &state : _idle) {
+    state->bind_callback(name, function, context);
+  }
+  for (auto const &acquired : _acquired) {
+    acquired.second->bind_callback(name, function, context);
+  }
+  return true;
+}
+
+
+
+/**
+ * Creates idle states until at least count states are idle, up to the pool's
+ * maximum.
+ */
+void vm_state_pool::reserve(size_t count)
+{
+  std::lock_guard<std::mutex> guard { _lock };
+  count = std::min(count, _max_idle);
+  while (_idle.size() < count) {
+    _idle.push_back(make_state());
+  }
+}
+
+
+
+/**
+ * Returns an idle state, creating a new one if there are none. The state is
+ * the same as a newly created one with the pool's unit and callbacks until
+ * it's released.
+ */
+vm_state &vm_state_pool::acquire()
+{
+  std::lock_guard<std::mutex> guard { _lock };
+
+  state_pointer_t state;
+  if (_idle.empty()) {
+    state = make_state();
+  } else {
+    state = std::move(_idle.back());
+    _idle.pop_back();
+  }
+
+  vm_state &acquired = *state;
+  _acquired.emplace(&acquired, std::move(state));
+  return acquired;
+}
+
+
+
+/**
+ * Recycles an acquired state and returns it to the pool, or destroys it if the
+ * pool already has as many idle states as it may keep. None of the state's
+ * threads may be running.
+ *
+ * Callbacks bound on the state since it was acquired are unbound, and its
+ * scheduler is unset.
+ */
+void vm_state_pool::release(vm_state &state)
+{
+  state_pointer_t released;
+
+  {
+    std::lock_guard<std::mutex> guard { _lock };
+    auto const iter = _acquired.find(&state);
+    if (iter == _acquired.end()) {
+      throw vm_logic_error("Attempt to release a state that wasn't acquired from the pool");
+    }
+    released = std::move(iter->second);
+    _acquired.erase(iter);
+  }
+
+  // Recycled outside the lock, since it may wait on deferred threads.
+  released->recycle();
+  released->set_scheduler(nullptr);
+
+  std::lock_guard<std::mutex> guard { _lock };
+  // Each of the pool's bindings adds one callback info, so any more means the
+  // state was bound to something else while it was acquired.
+  if (released->_bound_callbacks.size() != _bindings.size()) {
+    released->unbind_callbacks();
+    bind_all(*released);
+  }
+
+  if (_idle.size() < _max_idle) {
+    _idle.push_back(std::move(released));
+  }
+}
+
+
+
+/**
+ * Returns the number of idle states.
+ */
+size_t vm_state_pool::idle_count()
+{
+  std::lock_guard<std::mutex> guard { _lock };
+  return _idle.size();
+}
@@ -0,0 +1,82 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "_types.h"
+#include "vm_state.h"
+#include "vm_unit.h"
+
+
+/**
+ * Maximum number of idle states kept by a state pool.
+ */
+#ifndef VM_STATE_POOL_SIZE
+#define VM_STATE_POOL_SIZE 16
+#endif
+
+
+/**
+ * A pool of VM states that all run the same unit with the same callbacks.
+ *
+ * Setting up a state (set_unit, then binding callbacks) copies the unit,
+ * registers its static data, and sizes its callback table. A pool does that
+ * once per state and keeps released states warm: releasing a state only
+ * recycles it (see vm_state::recycle), so each acquire gets an isolated state
+ * without paying for setup again.
+ *
+ * Acquiring and releasing are thread-safe. States must be released to the
+ * pool they came from, and must all be released before the pool is destroyed.
+ */
+class vm_state_pool
+{
+  /** A callback bound on every state in the pool. */
+  struct binding
+  {
+    std::string name;
+    vm_callback_t *function;
+    void *context;
+  };
+
+  using state_pointer_t = std::unique_ptr<vm_state>;
+
+  /** The unit every state in the pool runs. */
+  vm_unit const _unit;
+  /** Maximum number of idle states kept. */
+  size_t const _max_idle;
+  std::mutex _lock;
+  /** Callbacks bound on every state, all imported by the unit. Guarded by _lock. */
+  std::vector<binding> _bindings;
+  /** States ready to be acquired. Guarded by _lock. */
+  std::vector<state_pointer_t> _idle;
+  /** States currently acquired. Guarded by _lock. */
+  std::unordered_map<vm_state const *, state_pointer_t> _acquired;
+
+  state_pointer_t make_state();
+  void bind_all(vm_state &state) const;
+
+public:
+  explicit vm_state_pool(vm_unit const &unit, size_t max_idle = VM_STATE_POOL_SIZE);
+
+  vm_state_pool(vm_state_pool const &) = delete;
+  vm_state_pool &operator = (vm_state_pool const &) = delete;
+
+  bool bind_callback(const char *name, vm_callback_t *function, void *context = nullptr);
+  void reserve(size_t count);
+
+  vm_state &acquire();
+  void release(vm_state &state);
+
+  size_t idle_count();
+};
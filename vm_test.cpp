@@ -6,10 +6,28 @@
  *          http://www.boost.org/LICENSE_1_0.txt)
  */
 
+#include "vm_exception.h"
+#include "vm_lz.h"
+#include "vm_opcode.h"
+#include "vm_round_robin.h"
+#include "vm_scheduler.h"
+#include "vm_snapshot.h"
+#include "vm_stack.h"
 #include "vm_state.h"
+#include "vm_state_pool.h"
 #include "vm_thread.h"
 #include "vm_unit.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fstream>
+#include <iterator>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 
 vm_value printfn(vm_thread &vm, int32_t argc, const vm_value *argv, void*)
@@ -47,17 +65,1042 @@ auto with(T &&obj, FN fn) -> decltype(fn(obj))
 }
 
 
+static int failures = 0;
+
+/** Logs a named check, counting it if it failed. */
+void check(char const *name, bool passed)
+{
+  std::cerr << (passed ? "PASS: " : "FAIL: ") << name << std::endl;
+  if (!passed) {
+    ++failures;
+  }
+}
+
+
+/** An instruction for a unit built by build_unit. */
+struct test_op
+{
+  vm_opcode opcode;
+  uint16_t litflag;
+  std::vector<vm_value> args;
+};
+
+/** A label or relocation table entry for a unit built by build_unit. */
+struct test_label { int32_t address; std::string name; };
+struct test_relocation { int32_t pointer; uint32_t mask; };
+
+/**
+ * A data block for a unit built by build_unit. In a ZDAT chunk, stored
+ * contents of a different size than the block are LZ-compressed.
+ */
+struct test_block { int32_t size; std::string stored; };
+
+/** The tables of a unit built by build_unit. Tables left empty are written empty. */
+struct test_tables
+{
+  std::vector<test_op> instructions;
+  std::vector<test_label> imports;
+  std::vector<test_label> exports;
+  std::vector<test_relocation> label_relocations;
+  std::vector<std::string> externs;
+  std::vector<test_relocation> extern_relocations;
+  /** Written to a ZDAT chunk if compressed is set, a DATA chunk otherwise. */
+  std::vector<test_block> data;
+  bool compressed = false;
+  std::vector<test_relocation> data_relocations;
+};
+
+/** Appends bytecode chunks in the layout vm_unit::read expects. */
+struct chunk_writer
+{
+  std::string buffer;
+
+  template <typename T>
+  void write(T value)
+  {
+    buffer.append(reinterpret_cast<char const *>(&value), sizeof value);
+  }
+
+  void write_string(std::string const &str)
+  {
+    write<int32_t>(static_cast<int32_t>(str.size()));
+    buffer += str;
+  }
+
+  /**
+   * Writes a version 10 varint operand: the tag's high four bits hold the
+   * value's low four, then seven bits per byte follow while any are left.
+   */
+  void write_varint(uint8_t encoding, uint64_t bits)
+  {
+    uint8_t const tag = static_cast<uint8_t>(encoding | ((bits & 0xF) << 4));
+    bits >>= 4;
+    write<uint8_t>(bits ? (tag | 0x8) : tag);
+    while (bits) {
+      uint8_t const byte = bits & 0x7F;
+      bits >>= 7;
+      write<uint8_t>(bits ? (byte | 0x80) : byte);
+    }
+  }
+
+  /** Writes an operand the way a unit of the given version stores it. */
+  void write_operand(int32_t version, vm_value value)
+  {
+    // Zigzag encoding, as version 10 stores signed integers.
+    auto zigzag = [](int64_t signed_value) {
+      return (static_cast<uint64_t>(signed_value) << 1) ^ static_cast<uint64_t>(signed_value >> 63);
+    };
+
+    if (version == 8) {
+      write<double>(value.f64());
+    } else if (version == 9) {
+      write<int32_t>(value.type);
+      write<uint64_t>(value.u64_);
+    } else if (value.type == vm_value::UNSIGNED) {
+      write_varint(1, value.u64_);
+    } else if (value.type == vm_value::SIGNED) {
+      write_varint(2, zigzag(value.i64()));
+    } else if (value.type == vm_value::DATA) {
+      write_varint(4, value.u64_);
+    } else if (value.type == vm_value::FLOAT && value.f64() == static_cast<double>(value.i64())) {
+      write_varint(5, zigzag(value.i64()));
+    } else if (value.type == vm_value::FLOAT) {
+      write<uint8_t>(3);
+      write<double>(value.f64());
+    } else {
+      write<uint8_t>(7);
+      write<int32_t>(value.type);
+      write<uint64_t>(value.u64_);
+    }
+  }
+
+  size_t begin(vm_chunk_id id, int32_t count)
+  {
+    size_t const offset = buffer.size();
+    write<int32_t>(id);
+    write<int32_t>(0);
+    write<int32_t>(count);
+    return offset;
+  }
+
+  /** Fills in the byte size of the chunk begun at offset. */
+  void end(size_t offset)
+  {
+    int32_t const size = static_cast<int32_t>(buffer.size() - offset);
+    std::memcpy(&buffer[offset + sizeof(int32_t)], &size, sizeof size);
+  }
+};
+
+
+/** Builds a version 8, 9, or 10 unit with the given tables and no data. */
+/** Builds a version 8, 9, or 10 unit with the given tables. */
+std::string build_unit(int32_t version, test_tables const &tables)
+{
+  std::vector<std::pair<vm_chunk_id, std::string>> chunks;
+
+  auto add_labels = [&](vm_chunk_id id, std::vector<test_label> const &labels) {
+    chunk_writer chunk;
+    size_t const start = chunk.begin(id, static_cast<int32_t>(labels.size()));
+    for (test_label const &label : labels) {
+      chunk.write<int32_t>(label.address);
+      chunk.write_string(label.name);
+    }
+    chunk.end(start);
+    chunks.emplace_back(id, chunk.buffer);
+  };
+
+  auto add_relocations = [&](vm_chunk_id id, std::vector<test_relocation> const &relocations) {
+    chunk_writer chunk;
+    size_t const start = chunk.begin(id, static_cast<int32_t>(relocations.size()));
+    for (test_relocation const &relocation : relocations) {
+      chunk.write<int32_t>(relocation.pointer);
+      chunk.write<uint32_t>(relocation.mask);
+    }
+    chunk.end(start);
+    chunks.emplace_back(id, chunk.buffer);
+  };
+
+  {
+    chunk_writer chunk;
+    size_t const start = chunk.begin(CHUNK_INST, static_cast<int32_t>(tables.instructions.size()));
+    for (test_op const &op : tables.instructions) {
+      chunk.write<uint16_t>(op.opcode);
+      chunk.write<uint16_t>(op.litflag);
+      for (vm_value const &arg : op.args) {
+        chunk.write_operand(version, arg);
+      }
+    }
+    chunk.end(start);
+    chunks.emplace_back(CHUNK_INST, chunk.buffer);
+  }
+
+  add_labels(CHUNK_IMPT, tables.imports);
+  add_labels(CHUNK_EXPT, tables.exports);
+  add_relocations(CHUNK_LREL, tables.label_relocations);
+
+  {
+    chunk_writer chunk;
+    size_t const start = chunk.begin(CHUNK_EXTS, static_cast<int32_t>(tables.externs.size()));
+    for (std::string const &name : tables.externs) {
+      chunk.write_string(name);
+    }
+    chunk.end(start);
+    chunks.emplace_back(CHUNK_EXTS, chunk.buffer);
+  }
+
+  add_relocations(CHUNK_EREL, tables.extern_relocations);
+
+  {
+    vm_chunk_id const id = tables.compressed ? CHUNK_ZDAT : CHUNK_DATA;
+    chunk_writer chunk;
+    size_t const start = chunk.begin(id, static_cast<int32_t>(tables.data.size()));
+    for (test_block const &block : tables.data) {
+      chunk.write<int32_t>(block.size);
+      if (tables.compressed) {
+        chunk.write<int32_t>(static_cast<int32_t>(block.stored.size()));
+      }
+      chunk.buffer += block.stored;
+    }
+    chunk.end(start);
+    chunks.emplace_back(id, chunk.buffer);
+  }
+
+  add_relocations(CHUNK_DREL, tables.data_relocations);
+
+  chunk_writer unit;
+  unit.write<int32_t>(CHUNK_VERS);
+  unit.write<int32_t>(12);
+  unit.write<int32_t>(version);
+
+  // The offsets table lists the version and offsets chunks too.
+  int32_t offset = 12 + 12 + 8 * static_cast<int32_t>(chunks.size() + 2);
+  size_t const offsets = unit.begin(CHUNK_OFFS, static_cast<int32_t>(chunks.size() + 2));
+  unit.write<int32_t>(CHUNK_VERS);
+  unit.write<int32_t>(0);
+  unit.write<int32_t>(CHUNK_OFFS);
+  unit.write<int32_t>(12);
+  for (auto const &chunk : chunks) {
+    unit.write<int32_t>(chunk.first);
+    unit.write<int32_t>(offset);
+    offset += static_cast<int32_t>(chunk.second.size());
+  }
+  unit.end(offsets);
+
+  for (auto const &chunk : chunks) {
+    unit.buffer += chunk.second;
+  }
+  return unit.buffer;
+}
+
+
+vm_value nopfn(vm_thread &vm, int32_t argc, const vm_value *argv, void*)
+{
+  return vm_value { 0 };
+}
+
+
+/** Returns whether fn throws an E. */
+template <typename E, typename FN>
+bool throws(FN &&fn)
+{
+  try {
+    fn();
+  } catch (E const &) {
+    return true;
+  } catch (...) {
+    return false;
+  }
+  return false;
+}
+
+
+/** The thread that last called the note callback, and its ID at the time. */
+struct noted_thread
+{
+  vm_thread *thread;
+  int64_t id;
+};
+
+vm_value notefn(vm_thread &vm, int32_t argc, const vm_value *argv, void *context)
+{
+  *static_cast<noted_thread *>(context) = noted_thread { &vm, vm.thread_index() };
+  return vm_value { 0 };
+}
+
+
+/** Async tokens and arguments of the fetch callbacks parked so far. */
+using fetch_list_t = std::vector<std::pair<int64_t, vm_value>>;
+
+/** Parks the calling thread until the host completes its token. */
+vm_value fetchfn(vm_thread &vm, int32_t argc, const vm_value *argv, void *context)
+{
+  fetch_list_t &fetches = *static_cast<fetch_list_t *>(context);
+  fetches.emplace_back(vm.process().park_thread(vm), argv[0]);
+  return vm_value { 0 };
+}
+
+
+/** Records the value of every call that completes. */
+void record_result(vm_thread &thread, vm_resume_result result, void *context)
+{
+  if (result.status == VM_CALL_COMPLETE) {
+    static_cast<std::vector<double> *>(context)->push_back(result.value.f64());
+  }
+}
+
+
+/** Records the order in which threads complete. */
+void record_thread(vm_thread &thread, vm_resume_result result, void *context)
+{
+  if (result.status == VM_CALL_COMPLETE) {
+    static_cast<std::vector<int64_t> *>(context)->push_back(thread.thread_index());
+  }
+}
+
+
+/** A stream buffer over a string that can't seek, like a pipe's. */
+struct pipe_buffer : std::streambuf
+{
+  explicit pipe_buffer(std::string &data)
+  {
+    setg(&data[0], &data[0], &data[0] + data.size());
+  }
+};
+
+
+/** Returns a unit's instruction listing. */
+std::string listing(vm_unit const &unit)
+{
+  std::ostringstream output;
+  unit.debug_write_instructions(output);
+  return output.str();
+}
+
+
+/** Checks that a register call leaves the caller's registers intact. */
+void test_rcall(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  check("rcall: result survives a register call",
+    vm.make_thread().function("__rcall_sum__")(5.0).f64() == 23.0);
+}
+
+
+/** Checks calls through function handles and their arity. */
+void test_handles(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_thread &thread = vm.make_thread();
+
+  vm_found_handle_t const rcall_sum = vm.find_function_handle("__rcall_sum__");
+  check("handles: call through a handle",
+    rcall_sum.ok && thread.call_function(rcall_sum.value, 5.0).f64() == 23.0);
+
+  vm_found_handle_t const sum3 = vm.find_function_handle("__sum3__", 3);
+  check("handles: arity is kept", sum3.ok && sum3.value.arity() == 3);
+  check("handles: wrong argument count is refused", sum3.ok &&
+    throws<vm_invalid_argument_count>([&] { thread.call_function(sum3.value, 1.0, 2.0); }));
+}
+
+
+/** Checks that a batch stops at a trapped row. */
+void test_batches(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_thread &thread = vm.make_thread();
+  vm_found_handle_t const square = vm.find_function_handle("__square__", 1);
+
+  vm_value args[16];
+  for (int row = 0; row < 16; ++row) {
+    args[row] = vm_value { row == 3 ? -4.0 : row + 1.0 };
+  }
+  vm_value results[16] {};
+  vm_call_status status[16] {};
+
+  int64_t const completed = thread.call_batch(square.value, 16, args, 1, results, status);
+  check("batch: rows before a trap complete", completed == 3 &&
+    results[0].f64() == 1.0 && results[1].f64() == 4.0 && results[2].f64() == 9.0);
+  check("batch: trapped row and rest are reported",
+    status[3] == VM_CALL_TRAPPED && status[4] == VM_CALL_SKIPPED && status[15] == VM_CALL_SKIPPED);
+}
+
+
+/** Checks lane batches against trapped rows and unwritten registers. */
+void test_lanes(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_found_handle_t const square = vm.find_function_handle("__square__", 1);
+  vm_found_lanes_t kernel = vm.find_lane_kernel(square.value);
+  check("lanes: square is a lane kernel", kernel.ok);
+  if (!kernel.ok) {
+    return;
+  }
+
+  // Lanes run in groups of 8, so the second group is skipped outright.
+  vm_value args[16];
+  for (int row = 0; row < 16; ++row) {
+    args[row] = vm_value { row == 3 ? -4.0 : row + 1.0 };
+  }
+  vm_value results[16] {};
+  vm_call_status status[16] {};
+
+  int64_t const completed = kernel.value.call_batch(16, args, 1, results, status);
+  check("lanes: rows before a trap complete", completed == 3 &&
+    results[0].f64() == 1.0 && results[1].f64() == 4.0 && results[2].f64() == 9.0);
+  check("lanes: rest of the trapped group finishes",
+    status[3] == VM_CALL_TRAPPED && status[7] == VM_CALL_COMPLETE && results[7].f64() == 64.0);
+  check("lanes: later groups are skipped",
+    status[8] == VM_CALL_SKIPPED && status[15] == VM_CALL_SKIPPED);
+
+  vm_found_handle_t const bump = vm.find_function_handle("__bump__", 1);
+  vm_found_lanes_t bump_kernel = vm.find_lane_kernel(bump.value);
+  vm_value const bump_args[] = { vm_value { 3.0 }, vm_value { 4.0 } };
+  vm_value bump_results[2] {};
+  vm_call_status bump_status[2] {};
+  check("lanes: unwritten registers read as on a new thread", bump_kernel.ok &&
+    bump_kernel.value.call_batch(2, bump_args, 1, bump_results, bump_status) == 2 &&
+    bump_results[0].f64() == vm.make_thread().call_function(bump.value, 3.0).f64() &&
+    bump_results[1].f64() == 4.0);
+}
+
+
+/** Checks that a call out of fuel suspends and resumes to completion. */
+void test_fuel(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_thread &thread = vm.make_thread();
+
+  vm_found_handle_t const count = vm.find_function_handle("__count__", 1);
+  thread.set_fuel(100);
+  thread.call_function(count.value, 1000.0);
+  bool const suspended = thread.call_status() == VM_CALL_SUSPENDED;
+  vm_resume_result result { VM_CALL_SUSPENDED, vm_value { 0 } };
+  int resumes = 0;
+  while (result.status == VM_CALL_SUSPENDED && resumes < 1000) {
+    thread.set_fuel(100);
+    result = thread.resume();
+    ++resumes;
+  }
+  thread.set_fuel(VM_UNLIMITED_FUEL);
+  check("fuel: call suspends when out of fuel", suspended && resumes > 1);
+  check("fuel: resumed call completes",
+    result.status == VM_CALL_COMPLETE && result.value.f64() == 1000.0);
+}
+
+
+/** Checks that host threads can share a state, each with its own VM thread. */
+void test_shared_state(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+
+  std::atomic<int> mismatches { 0 };
+  std::vector<std::thread> workers;
+  for (int worker = 0; worker < 4; ++worker) {
+    workers.emplace_back([&vm, &mismatches, worker] {
+      vm_thread &thread = vm.make_thread();
+      for (int call = 0; call < 200; ++call) {
+        double const x = worker * 1000.0 + call;
+        int64_t const block = vm.alloc_block(16);
+        if (thread.function("__rcall_sum__")(x).f64() != 4.0 * x + 3.0 || vm.block_size(block) != 16) {
+          ++mismatches;
+        }
+        vm.free_block(block);
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
+  check("shared state: host threads run calls side by side", mismatches == 0);
+}
+
+
+/** Checks deferred calls joined inline and on a scheduler. */
+void test_deferred(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_thread &thread = vm.make_thread();
+
+  vm_found_handle_t const fib = vm.find_function_handle("__fib__", 1);
+  check("defer: join runs the deferred call inline",
+    thread.call_function(fib.value, 15.0).f64() == 610.0);
+
+  {
+    vm_scheduler scheduler(2);
+    vm.set_scheduler(&scheduler);
+    check("defer: scheduled joins complete",
+      vm.make_thread().call_function(fib.value, 15.0).f64() == 610.0);
+    vm.set_scheduler(nullptr);
+  }
+}
+
+
+/** Checks that a destroyed thread's ID no longer finds a thread. */
+void test_thread_ids(vm_unit const &unit)
+{
+  noted_thread noted { nullptr, -1 };
+  vm_state vm;
+  vm.set_unit(unit);
+  vm.bind_callback("note", notefn, &noted);
+  vm_thread &thread = vm.make_thread();
+
+  check("thread IDs: live thread is found by its ID",
+    &vm.thread_by_index(thread.thread_index()) == &thread);
+
+  int64_t const joined = thread.function("__joined_id__")().i64();
+  check("thread IDs: deferred thread keeps its ID", noted.thread && noted.id == joined);
+  check("thread IDs: joined thread's ID is stale",
+    throws<vm_bad_thread>([&] { vm.thread_by_index(joined); }));
+
+  vm_thread &next = vm.make_thread();
+  check("thread IDs: new thread doesn't revive a stale ID", next.thread_index() != joined &&
+    throws<vm_bad_thread>([&] { vm.thread_by_index(joined); }));
+}
+
+
+/** Checks that a destroyed thread is reused under a new ID. */
+void test_thread_pool(vm_unit const &unit)
+{
+  noted_thread noted { nullptr, -1 };
+  vm_state vm;
+  vm.set_unit(unit);
+  vm.bind_callback("note", notefn, &noted);
+
+  int64_t const joined = vm.make_thread().function("__joined_id__")().i64();
+  vm_thread &reused = vm.make_thread();
+  check("thread pool: joined thread is reused", &reused == noted.thread);
+  check("thread pool: reused thread gets a new ID", reused.thread_index() != joined);
+  check("thread pool: reused thread runs calls",
+    reused.function("__rcall_sum__")(1.0).f64() == 7.0);
+}
+
+
+/** Checks that a deferred thread's stack holds only its function's frame. */
+void test_fork_window(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  check("fork: deferred thread gets only the current frame",
+    vm.make_thread().function("__fork_window__")(20.0).f64() == 208.0);
+}
+
+
+/** Checks that stacks keep their values as they grow across segments. */
+void test_stacks(vm_unit const &unit)
+{
+  size_t const segment = VM_STACK_SEGMENT_SIZE;
+  vm_stack stack(segment);
+  for (size_t index = 0; index < segment; ++index) {
+    stack[index] = vm_value { static_cast<double>(index) };
+  }
+
+  // Segments double in size, so this needs a third segment.
+  stack.resize(segment * 3 + 1);
+  bool kept = stack.size() >= segment * 3 + 1;
+  for (size_t index = 0; index < segment; ++index) {
+    kept = kept && stack[index].f64() == static_cast<double>(index);
+  }
+  check("stack: growing keeps values", kept);
+  check("stack: new slots are zeroed", stack[segment].u64_ == 0 && stack[segment * 3].u64_ == 0);
+
+  stack[segment * 3 - 1] = vm_value { 1.0 };
+  stack[segment * 3] = vm_value { 2.0 };
+  check("stack: slots either side of a segment boundary are distinct",
+    stack[segment * 3 - 1].f64() == 1.0 && stack[segment * 3].f64() == 2.0);
+
+  vm_stack copy(segment * 4);
+  copy.copy(stack, segment - 2, segment + 2, segment * 3 - 2);
+  check("stack: copies cross segment boundaries",
+    copy[segment * 3 - 2].f64() == segment - 2.0 && copy[segment * 3 - 1].f64() == segment - 1.0 &&
+    copy[segment * 3].u64_ == 0 && copy[segment * 3 + 1].u64_ == 0);
+
+  vm_state vm;
+  vm.set_unit(unit);
+  check("stack: deep recursion grows a thread's stack",
+    vm.make_thread().function("__deep__")(1000.0).f64() == 500500.0);
+}
+
+
+/** Returns how many registers a thread has. */
+int64_t register_count(vm_thread const &thread)
+{
+  // dump_registers logs one line per register.
+  std::ostringstream output;
+  std::streambuf *const log = std::clog.rdbuf(output.rdbuf());
+  thread.dump_registers();
+  std::clog.rdbuf(log);
+  std::string const dump = output.str();
+  return std::count(dump.cbegin(), dump.cend(), '\n');
+}
+
+
+/** Checks that register files are sized to the registers the unit uses. */
+void test_register_count(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_thread &thread = vm.make_thread();
+  check("registers: highest used register is allocated",
+    thread.function("__high_register__")().f64() == 9.0 && register_count(thread) > 200);
+
+  vm_state empty;
+  empty.set_unit(vm_unit());
+  int64_t const fewest = register_count(empty.make_thread());
+  check("registers: unit using fewer registers gets a smaller file",
+    VM_COMPACT_REGISTERS ? fewest < register_count(thread) : fewest == register_count(thread));
+}
+
+
+/** Checks that yields hand back each value and the call then completes. */
+void test_yield(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_thread &thread = vm.make_thread();
+
+  vm_found_handle_t const squares = vm.find_function_handle("__squares__", 1);
+  std::vector<double> yielded { thread.call_function(squares.value, 4.0).f64() };
+  vm_resume_result result = thread.resume();
+  for (; result.status == VM_CALL_YIELDED; result = thread.resume()) {
+    yielded.push_back(result.value.f64());
+  }
+  check("yield: every value is yielded in order",
+    yielded == std::vector<double> { 0.0, 1.0, 4.0, 9.0 });
+  check("yield: call completes after its yields",
+    result.status == VM_CALL_COMPLETE && result.value.f64() == -1.0);
+}
+
+
+/** Checks that parked host calls resume once their results complete. */
+void test_park(vm_unit const &unit)
+{
+  fetch_list_t fetches;
+  vm_state vm;
+  vm.set_unit(unit);
+  vm.bind_callback("fetch", fetchfn, &fetches);
+  vm_thread &thread = vm.make_thread();
+
+  vm_found_handle_t const fetch_pair = vm.find_function_handle("__fetch_pair__", 1);
+  thread.call_function(fetch_pair.value, 3.0);
+  check("park: callback parks the call", thread.call_status() == VM_CALL_PARKED);
+  check("park: parked call can't be resumed directly",
+    throws<vm_thread_state_error>([&] { thread.resume(); }));
+
+  std::vector<double> completed;
+  for (int rounds = 0; completed.empty() && rounds < 4; ++rounds) {
+    fetch_list_t pending;
+    pending.swap(fetches);
+    for (auto const &fetch : pending) {
+      vm.complete_async(fetch.first, vm_value { fetch.second.f64() * 10.0 });
+    }
+    vm.run_completed(record_result, &completed);
+  }
+  check("park: completed results resume the call",
+    completed == std::vector<double> { 70.0 } && vm.parked_count() == 0);
+}
+
+
+/** Checks channels from VM threads and the host, with and without a scheduler. */
+void test_channels(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_thread &thread = vm.make_thread();
+
+  check("channel: inline join sees an earlier send",
+    thread.function("__relay_early__")().f64() == 5.0);
+  check("channel: inline join can't wait on a later send",
+    throws<vm_thread_state_error>([&] { thread.function("__relay_late__")(); }));
+
+  int64_t const channel = vm.make_channel(2);
+  vm_value received;
+  bool const sent = vm.try_send(channel, vm_value { 1.0 }) == VM_CHANNEL_OK &&
+    vm.try_send(channel, vm_value { 2.0 }) == VM_CHANNEL_OK;
+  check("channel: host send blocks when full",
+    sent && vm.try_send(channel, vm_value { 3.0 }) == VM_CHANNEL_BLOCKED);
+  check("channel: host receives in order",
+    vm.try_recv(channel, received) == VM_CHANNEL_OK && received.f64() == 1.0);
+  vm.close_channel(channel);
+  check("channel: closed channel drains before reporting closed",
+    vm.try_recv(channel, received) == VM_CHANNEL_OK && received.f64() == 2.0 &&
+    vm.try_recv(channel, received) == VM_CHANNEL_CLOSED);
+
+  {
+    vm_scheduler scheduler(2);
+    vm.set_scheduler(&scheduler);
+    vm_thread &scheduled = vm.make_thread();
+
+    // The consumer runs on the host call, so it parks while the channel is
+    // empty until the producer wakes it.
+    std::vector<double> piped;
+    vm_value const first = scheduled.function("__pipe__")(100.0);
+    if (scheduled.call_status() == VM_CALL_COMPLETE) {
+      piped.push_back(first.f64());
+    }
+    for (int waits = 0; scheduled.call_status() == VM_CALL_PARKED && waits < 1000; ++waits) {
+      vm.wait_completed();
+      vm.run_completed(record_result, &piped);
+    }
+    check("channel: scheduled producer feeds its parked consumer",
+      piped == std::vector<double> { 4950.0 });
+    vm.set_scheduler(nullptr);
+  }
+}
+
+
+/** Checks that round-robin turns don't let long threads starve short ones. */
+void test_round_robin(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_found_handle_t const count = vm.find_function_handle("__count__", 1);
+
+  vm_thread &slow = vm.make_thread();
+  vm_thread &quick = vm.make_thread();
+  std::vector<int64_t> order;
+  {
+    vm_round_robin scheduler(vm, 1000);
+    scheduler.set_result_callback(record_thread, &order);
+    vm_value const slow_args[] = { vm_value { 100000.0 } };
+    vm_value const quick_args[] = { vm_value { 100.0 } };
+    scheduler.start(slow, count.value, 1, slow_args);
+    scheduler.start(quick, count.value, 1, quick_args);
+    scheduler.run();
+  }
+  check("round robin: short thread started later finishes first",
+    order == std::vector<int64_t> { quick.thread_index(), slow.thread_index() });
+  check("round robin: long thread completes", slow.return_value().f64() == 100000.0);
+
+  order.clear();
+  {
+    vm_round_robin scheduler(vm, 1000);
+    scheduler.set_result_callback(record_thread, &order);
+    vm_value const args[] = { vm_value { 50000.0 } };
+    scheduler.start(slow, count.value, 1, args, 1);
+    scheduler.start(quick, count.value, 1, args, 4);
+    scheduler.run();
+  }
+  check("round robin: higher priority thread finishes first",
+    order == std::vector<int64_t> { quick.thread_index(), slow.thread_index() });
+}
+
+
+/** Checks that a released state is recycled before it's reused. */
+void test_pool(vm_unit const &unit)
+{
+  vm_state_pool pool(unit, 1);
+  vm_state &first = pool.acquire();
+  int64_t const thread_id = first.make_thread().thread_index();
+  int64_t const block = first.alloc_block(16);
+  pool.release(first);
+  check("pool: released state is kept idle", pool.idle_count() == 1);
+
+  vm_state &second = pool.acquire();
+  check("pool: idle state is reused", &second == &first);
+  check("pool: old threads are gone",
+    throws<vm_bad_thread>([&] { second.thread_by_index(thread_id); }));
+  check("pool: old blocks are gone", second.block_size(block) == 0);
+  check("pool: reused state runs calls",
+    second.make_thread().function("__rcall_sum__")(1.0).f64() == 7.0);
+  pool.release(second);
+}
+
+
+/** Restores a snapshot from a stream, returning false if it's refused. */
+bool read_snapshot(std::string const &data, vm_snapshot &snapshot)
+{
+  std::istringstream input { data };
+  return !throws<vm_bad_snapshot>([&] { snapshot.read(input); });
+}
+
+
+/** Checks that snapshots round-trip through a stream and bad ones are refused. */
+void test_snapshots(vm_unit const &unit)
+{
+  vm_state vm;
+  vm.set_unit(unit);
+  vm_thread &thread = vm.make_thread();
+  vm_value const table = thread.function("__make_table__")(10.0);
+
+  std::ostringstream output;
+  vm.snapshot().write(output);
+  std::string const data = output.str();
+
+  vm_snapshot snapshot;
+  check("snapshot: written snapshot reads back", read_snapshot(data, snapshot));
+
+  vm_state restored;
+  restored.set_unit(unit);
+  restored.restore(snapshot);
+  vm_thread &restored_thread = restored.thread_by_index(thread.thread_index());
+  check("snapshot: restored state keeps its blocks",
+    restored_thread.function("__table_at__")(table, 3.0).f64() == 9.0);
+
+  auto with_field = [&](size_t offset, int64_t value) {
+    std::string corrupt = data;
+    std::memcpy(&corrupt[offset], &value, sizeof value);
+    return corrupt;
+  };
+  vm_snapshot rejected;
+  check("snapshot: truncated snapshot is refused",
+    !read_snapshot(data.substr(0, data.size() / 2), rejected));
+  check("snapshot: bad register count is refused", !read_snapshot(with_field(16, 1), rejected));
+  check("snapshot: block past the counter is refused", !read_snapshot(with_field(24, 0), rejected));
+
+  vm_state stranger;
+  stranger.set_unit(vm_unit());
+  check("snapshot: restoring with another unit is refused",
+    throws<vm_bad_snapshot>([&] { stranger.restore(snapshot); }));
+}
+
+
+/** Checks that unit images load back and corrupt ones are refused. */
+void test_images(vm_unit const &unit)
+{
+  std::ostringstream output;
+  unit.write_image(output);
+  std::string const image = output.str();
+
+  vm_unit loaded;
+  std::istringstream input { image };
+  loaded.read_image(input);
+  check("image: loaded image has the same instructions", listing(loaded) == listing(unit));
+
+  vm_state vm;
+  vm.set_unit(loaded);
+  check("image: loaded image runs calls",
+    vm.make_thread().function("__rcall_sum__")(5.0).f64() == 23.0);
+
+  std::string corrupt = image;
+  corrupt[corrupt.size() / 2] ^= 0x40;
+  check("image: corrupt image is refused",
+    throws<vm_bad_unit>([&] { vm_unit().read_image(corrupt.data(), corrupt.size()); }));
+}
+
+
+/**
+ * Links two version 8 units, whose operands are all read as FLOAT, and checks
+ * that the second unit's import and extern operands were relocated.
+ */
+void test_v8_link()
+{
+  test_tables first;
+  first.instructions = {
+    { CALL, 0x3, { vm_value { -1.0 }, vm_value { 0.0 } } },
+    { RETURN, 0, {} },
+    { LOAD, 0x2, { vm_value { 0.0 }, vm_value { 1.0 } } },
+    { RETURN, 0, {} },
+  };
+  first.imports = { { -1, "first_import" } };
+  first.exports = { { 0, "first_call" }, { 2, "first_one" } };
+
+  test_tables second;
+  second.instructions = {
+    { CALL, 0x3, { vm_value { 1.0 }, vm_value { 0.0 } } },
+    { RETURN, 0, {} },
+    { CALL, 0x3, { vm_value { -1.0 }, vm_value { 0.0 } } },
+    { RETURN, 0, {} },
+  };
+  second.imports = { { -1, "second_import" } };
+  second.exports = { { 0, "second_extern" }, { 2, "second_import" } };
+  second.label_relocations = { { 2, 0x1 } };
+  second.externs = { "first_one", "first_call" };
+  second.extern_relocations = { { 0, 0x1 } };
+
+  std::istringstream first_input { build_unit(8, first) };
+  std::istringstream second_input { build_unit(8, second) };
+  vm_unit unit;
+  unit.read(first_input);
+  unit.read(second_input);
+
+  int64_t const extern_operand = unit.fetch_op(4)[0].i64();
+  int64_t const import_operand = unit.fetch_op(6)[0].i64();
+
+  vm_state vm;
+  vm.set_unit(std::move(unit));
+  vm_bound_fn_t const second_import = vm.bind_callback("second_import", nopfn);
+  vm_found_handle_t const first_call = vm.find_function_handle("first_call");
+  vm_found_handle_t const second_extern = vm.find_function_handle("second_extern");
+
+  check("v8 link: second unit's import is bound", second_import.ok && second_import.value == -2);
+  check("v8 link: second unit's export is relocated",
+    second_extern.ok && second_extern.value.pointer() == 4);
+  check("v8 link: extern operand is relocated",
+    first_call.ok && extern_operand == first_call.value.pointer());
+  check("v8 link: import operand is relocated", import_operand == -2);
+}
+
+
+/** Checks that a table count its chunk can't hold is refused. */
+void test_table_counts()
+{
+  test_tables tables;
+  tables.instructions = { { RETURN, 0, {} } };
+  tables.exports = { { 0, "only" } };
+  std::string bytecode = build_unit(9, tables);
+
+  // The offsets table names each chunk first, so the last match is the
+  // export chunk's own header, whose count follows its ID and size.
+  int32_t const id = CHUNK_EXPT;
+  size_t const at = bytecode.rfind(std::string(reinterpret_cast<char const *>(&id), sizeof id));
+  int32_t const count = INT32_MAX;
+  std::memcpy(&bytecode[at + 2 * sizeof(int32_t)], &count, sizeof count);
+
+  std::istringstream input { bytecode };
+  check("tables: count past the end of its chunk is refused",
+    throws<vm_bad_unit>([&] { vm_unit().read(input); }));
+}
+
+
+/** Checks that a unit read from a non-seekable stream matches the file's. */
+void test_read_stream(vm_unit const &unit, std::string bytecode)
+{
+  pipe_buffer buffer { bytecode };
+  std::istream pipe { &buffer };
+  vm_unit streamed;
+  streamed.read_stream(pipe);
+  check("read_stream: pipe reads the same unit", listing(streamed) == listing(unit));
+}
+
+
+/** Builds and runs a unit that loads -300, then adds 2.5 and 1000. */
+void test_operands(int32_t version)
+{
+  test_tables tables;
+  tables.instructions = {
+    { LOAD, 0x2, { vm_value { int64_t(3) }, vm_value { int64_t(-300) } } },
+    { ADD, 0x4, { vm_value { int64_t(3) }, vm_value { int64_t(3) }, vm_value { 2.5 } } },
+    { ADD, 0x4, { vm_value { int64_t(3) }, vm_value { int64_t(3) }, vm_value { 1000.0 } } },
+    { RETURN, 0, {} },
+  };
+  tables.exports = { { 0, "decode" } };
+
+  vm_unit unit;
+  std::istringstream input { build_unit(version, tables) };
+  unit.read(input);
+  vm_state vm;
+  vm.set_unit(std::move(unit));
+
+  std::string const name = "operands: version " + std::to_string(version) + " decodes";
+  check(name.c_str(), vm.make_thread().function("decode")().f64() == 702.5);
+}
+
+
+/** Checks that operands decode in every supported unit version. */
+void test_operand_versions()
+{
+  test_operands(8);
+  test_operands(9);
+  test_operands(10);
+
+  // Tag 6 isn't an encoding, so replace the FLOAT tag before 1234.5678.
+  test_tables tables;
+  tables.instructions = {
+    { LOAD, 0x2, { vm_value { int64_t(3) }, vm_value { 1234.5678 } } },
+    { RETURN, 0, {} },
+  };
+  std::string bytecode = build_unit(10, tables);
+  double const marker = 1234.5678;
+  size_t const at = bytecode.find(std::string(reinterpret_cast<char const *>(&marker), sizeof marker));
+  bytecode[at - 1] = 6;
+  std::istringstream input { bytecode };
+  check("operands: unknown version 10 tag is refused",
+    throws<vm_bad_unit>([&] { vm_unit().read(input); }));
+}
+
+
+/** Checks that corrupt LZ input is refused rather than overrunning. */
+void test_lz()
+{
+  auto decodes = [](std::string const &input, size_t size, std::string *output) {
+    std::string decoded(size, '\0');
+    bool const ok = vm_lz_decompress(input.data(), input.size(), &decoded[0], size);
+    if (output) {
+      *output = decoded;
+    }
+    return ok;
+  };
+
+  std::string decoded;
+  std::string const valid { "\x42" "abcd" "\x04\x00" "\x10" "!", 9 };
+  check("lz: valid input decodes", decodes(valid, 11, &decoded) && decoded == "abcdabcdab!");
+  check("lz: zero offset is refused", !decodes({ "\x42" "abcd" "\x00\x00" "\x10" "!", 9 }, 11, nullptr));
+  check("lz: offset before the output is refused",
+    !decodes({ "\x42" "abcd" "\x05\x00" "\x10" "!", 9 }, 11, nullptr));
+  check("lz: literals past the input are refused", !decodes({ "\xF0" "\x20" "ab", 4 }, 47, nullptr));
+  check("lz: wrong output size is refused", !decodes(valid, 12, nullptr));
+}
+
+
+/** Builds a unit whose only function returns its one compressed data block. */
+std::string data_unit(std::string const &stored)
+{
+  test_tables tables;
+  tables.instructions = {
+    { LOAD, 0x2, { vm_value { int64_t(3) }, vm_value { vm_value::DATA, uint64_t(1) } } },
+    { RETURN, 0, {} },
+  };
+  tables.exports = { { 0, "data" } };
+  tables.data = { { 11, stored } };
+  tables.compressed = true;
+  tables.data_relocations = { { 0, 0x2 } };
+  return build_unit(10, tables);
+}
+
+
+/** Checks that a compressed static block decodes to its contents. */
+void test_compressed_data()
+{
+  vm_unit unit;
+  std::istringstream input { data_unit({ "\x42" "abcd" "\x04\x00" "\x10" "!", 9 }) };
+  unit.read(input);
+  vm_state vm;
+  vm.set_unit(std::move(unit));
+  int64_t const block = vm.make_thread().function("data")().i64();
+  char const *contents = static_cast<char const *>(vm.get_block(block, VM_MEM_READABLE));
+  check("compressed data: block decodes",
+    vm.block_size(block) == 11 && contents && std::string(contents, 11) == "abcdabcdab!");
+}
+
+
+/** Checks that static blocks are only decoded when first used. */
+void test_static_blocks()
+{
+  vm_unit corrupt;
+  std::istringstream input { data_unit({ "\x42" "abcd" "\x00\x00" "\x10" "!", 9 }) };
+  corrupt.read(input);
+  vm_state vm;
+  vm.set_unit(std::move(corrupt));
+  int64_t const block = vm.make_thread().function("data")().i64();
+  check("static blocks: size is known before decoding", vm.block_size(block) == 11);
+  check("static blocks: corrupt block is refused when used",
+    throws<vm_bad_unit>([&] { vm.get_block(block, VM_MEM_READABLE); }));
+}
+
+
 int main(int argc, char const *argv[])
 {
   vm_unit unit;
+  std::string bytecode;
 
   std::cerr << "Unit is valid: " << unit.is_valid() << std::endl;
 
   {
     std::cerr << "Opening stream (test.asm.bc x1)." << std::endl;
-    std::fstream stream ("test.asm.bc", std::ios_base::in);
+    std::fstream stream ("test.asm.bc", std::ios_base::in | std::ios_base::binary);
     std::cerr << "Reading bytecode." << std::endl;
     unit.read(stream);
+    stream.clear();
+    stream.seekg(0);
+    bytecode.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
   }
 
   unit.debug_write_instructions(std::cerr);
@@ -65,7 +1108,7 @@ int main(int argc, char const *argv[])
   std::cerr << "Unit is valid: " << unit.is_valid() << std::endl;
 
   vm_state vm;
-  vm.set_unit(std::move(unit));
+  vm.set_unit(unit);
   vm.bind_callback("print", printfn);
   vm.bind_callback("prints", printsfn);
   vm_thread &thread = vm.make_thread();
@@ -77,5 +1120,32 @@ int main(int argc, char const *argv[])
   thread.dump_stack();
   #endif
 
-  return 0;
+  test_rcall(unit);
+  test_handles(unit);
+  test_batches(unit);
+  test_lanes(unit);
+  test_fuel(unit);
+  test_shared_state(unit);
+  test_deferred(unit);
+  test_thread_ids(unit);
+  test_thread_pool(unit);
+  test_fork_window(unit);
+  test_stacks(unit);
+  test_register_count(unit);
+  test_yield(unit);
+  test_park(unit);
+  test_channels(unit);
+  test_round_robin(unit);
+  test_pool(unit);
+  test_snapshots(unit);
+  test_images(unit);
+  test_v8_link();
+  test_table_counts();
+  test_read_stream(unit, bytecode);
+  test_operand_versions();
+  test_lz();
+  test_compressed_data();
+  test_static_blocks();
+
+  return failures == 0 ? 0 : 1;
 }
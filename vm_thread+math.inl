@@ -0,0 +1,264 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+/*
+  Value semantics of the arithmetic, bitwise, rounding, and comparison
+  instructions, shared by vm_thread::exec and vm_lane_kernel. Operand decoding
+  is left to the caller.
+*/
+
+#include <cfenv>
+#include <cmath>
+
+#include "vm_opcode.h"
+#include "vm_value.h"
+
+
+namespace {
+
+
+
+/**
+  Sets the rounding mode and then calls func; the previous rounding mode is
+  restored after the call completes.
+*/
+template <typename FN>
+void with_rounding(int const round_mode, FN &&func) noexcept
+{
+  int const previous = std::fegetround();
+  std::fesetround(round_mode);
+  func();
+  std::fesetround(previous);
+}
+
+
+
+/**
+ * Convenience function for performing a bitwise shift against a numeric value.
+ */
+template <typename T>
+constexpr T vm_shift(T num, int64_t shift)
+{
+  return
+    shift == 0
+    ? num
+    : ((shift > 0) ? (num << shift) : (num >> (-shift)));
+}
+
+
+
+/**
+ * Computes OUT = LHS <op> RHS for a binary arithmetic or bitwise opcode.
+ */
+template <vm_opcode OPCODE>
+void vm_binary_op(vm_value &out, vm_value lhs, vm_value rhs);
+
+
+
+/**
+ * Computes OUT = <op> IN for a unary arithmetic, bitwise, or rounding opcode.
+ */
+template <vm_opcode OPCODE>
+void vm_unary_op(vm_value &out, vm_value in);
+
+
+
+/**
+ * Returns the result of a comparison opcode's test, before it's checked
+ * against the instruction's expected RESULT operand.
+ */
+template <vm_opcode OPCODE>
+bool vm_compare_op(vm_value lhs, vm_value rhs);
+
+
+
+// Addition (fp64).
+template <>
+inline void vm_binary_op<ADD>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = lhs.f64() + rhs.f64();
+}
+
+// Subtraction (fp64).
+template <>
+inline void vm_binary_op<SUB>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = lhs.f64() - rhs.f64();
+}
+
+// Floating point division.
+template <>
+inline void vm_binary_op<DIV>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = lhs.f64() / rhs.f64();
+}
+
+// Integer division (64-bit signed -- rationale: 64-bit is used as the result
+// will never be out of range of a 64-bit float).
+template <>
+inline void vm_binary_op<IDIV>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = lhs.i64() / rhs.i64();
+}
+
+// Multiplication (fp64).
+template <>
+inline void vm_binary_op<MUL>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = lhs.f64() * rhs.f64();
+}
+
+// Power (fp64).
+template <>
+inline void vm_binary_op<POW>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = std::pow(lhs.f64(), rhs.f64());
+}
+
+// Floating point modulo.
+template <>
+inline void vm_binary_op<MOD>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = std::fmod(lhs.f64(), rhs.f64());
+}
+
+// Signed integer modulo (32-bit).
+template <>
+inline void vm_binary_op<IMOD>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = lhs.i64() % rhs.i64();
+}
+
+// Bitwise or (unsigned).
+template <>
+inline void vm_binary_op<OR>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = lhs | rhs;
+}
+
+// Bitwise and (unsigned).
+template <>
+inline void vm_binary_op<AND>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = lhs & rhs;
+}
+
+// Bitwise xor (unsigned).
+template <>
+inline void vm_binary_op<XOR>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  out = lhs ^ rhs;
+}
+
+// Arithmetic shift. Signed.
+template <>
+inline void vm_binary_op<ARITHSHIFT>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  const int64_t input = lhs;
+  const int64_t shift = rhs;
+  out = vm_shift(input, shift);
+}
+
+// Bitwise shift. Signed 32-bit.
+template <>
+inline void vm_binary_op<BITSHIFT>(vm_value &out, vm_value lhs, vm_value rhs)
+{
+  const uint64_t input = lhs;
+  const int64_t shift = rhs;
+  out = vm_shift(input, shift);
+}
+
+
+
+// Negation.
+template <>
+inline void vm_unary_op<NEG>(vm_value &out, vm_value in)
+{
+  out = -in;
+}
+
+// Bitwise not (unsigned).
+template <>
+inline void vm_unary_op<NOT>(vm_value &out, vm_value in)
+{
+  out = ~in;
+}
+
+// Nearest integral value <= IN.
+template <>
+inline void vm_unary_op<FLOOR>(vm_value &out, vm_value in)
+{
+  if (in.type != vm_value::FLOAT) {
+    out = in.as(vm_value::FLOAT);
+  } else {
+    out = std::floor(in.f64());
+  }
+}
+
+// Nearest integral value >= IN.
+template <>
+inline void vm_unary_op<CEIL>(vm_value &out, vm_value in)
+{
+  if (in.type != vm_value::FLOAT) {
+    out = in.as(vm_value::FLOAT);
+  } else {
+    out = std::ceil(in.f64());
+  }
+}
+
+// Nearest integral value using FE_TONEAREST.
+template <>
+inline void vm_unary_op<ROUND>(vm_value &out, vm_value in)
+{
+  if (in.type != vm_value::FLOAT) {
+    out = in.as(vm_value::FLOAT);
+  } else {
+    with_rounding(FE_TONEAREST, [&] {
+      out = std::nearbyint(in.f64());
+    });
+  }
+}
+
+// Nearest integral value using FE_TOWARDZERO.
+template <>
+inline void vm_unary_op<RINT>(vm_value &out, vm_value in)
+{
+  if (in.type != vm_value::FLOAT) {
+    out = in.as(vm_value::FLOAT);
+  } else {
+    with_rounding(FE_TOWARDZERO, [&] {
+      out = std::nearbyint(in.f64());
+    });
+  }
+}
+
+
+
+template <>
+inline bool vm_compare_op<EQ>(vm_value lhs, vm_value rhs)
+{
+  return lhs == rhs;
+}
+
+template <>
+inline bool vm_compare_op<LT>(vm_value lhs, vm_value rhs)
+{
+  return lhs < rhs;
+}
+
+template <>
+inline bool vm_compare_op<LE>(vm_value lhs, vm_value rhs)
+{
+  return lhs <= rhs;
+}
+
+
+
+} // namespace
@@ -18,6 +18,7 @@
 #include "vm_op.h"
 #include "vm_opcode.h"
 #include "vm_exception.h"
+#include "vm_thread+math.inl"
 
 
 #ifndef VM_MAX_JOIN_LOOPS
@@ -33,14 +34,10 @@
   Could be done by throwing an object that the VM can catch and use to unwind.
   Maybe a counter that's decremented and re-thrown to handle each nesting.
 
-  Not sure if it would be possible to then continue execution normally. I
-  haven't decided yet if trap should be the equivalent of yielding to the host
-  or if it should be for signalling that the VM cannot continue to run due to
-  some error. In the latter case, it might be a good idea to completely reset
-  the stack and all registers and then return the trapped value.
-
-  Don't know -- for now, the TRAP instruction is iffy and kind of just grinds
-  the VM to a halt and makes it hard to recover.
+  TRAP is for signalling that the VM cannot continue to run due to some error.
+  Handing control back to the host without giving up the call is done by YIELD
+  (see vm_thread::resume), which suspends at an instruction boundary and can
+  only be used by the outermost host call, so no host frames are in the way.
 */
 
 
@@ -73,31 +70,106 @@ static int32_t const MEMOP_SIZE[MEMOP_MAX] {
 
 
 /**
-  Sets the rounding mode and then calls func; the previous rounding mode is
-  restored after the call completes.
-*/
-template <typename FN>
-static void with_rounding(int const round_mode, FN &&func) noexcept
+ * Constructs a new thread for the given process with the stack size provided.
+ */
+vm_thread::vm_thread(vm_state &process, size_t stack_size)
+: _process(process)
+, _registers(static_cast<size_t>(process._register_count), vm_value { 0.0 })
 {
-  int const previous = std::fegetround();
-  std::fesetround(round_mode);
-  func();
-  std::fesetround(previous);
+  _stack.resize(stack_size);
 }
 
 
 
 /**
- * Constructs a new thread for the given process with the stack size provided.
+ * Resets a destroyed thread so it can be reused as if newly constructed with
+ * the given stack size. Storage is kept, and only the part of the stack that
+ * was written to is cleared.
  */
-vm_thread::vm_thread(vm_state &process, size_t stack_size)
-: _process(process)
+void vm_thread::recycle(size_t stack_size)
 {
-  for (int index = 0; index < REGISTER_COUNT; ++index) {
-    _registers[index] = 0.0;
+  _sequence = 0;
+  _trap = 0;
+  _fuel = VM_UNLIMITED_FUEL;
+  _host_calls = 0;
+  _host_sequence = 0;
+  _suspended = false;
+  _yielded = false;
+  _parked = false;
+  _async_token = -1;
+  _resume_hook = nullptr;
+  _resume_hook_context = nullptr;
+  _thread_id = -1;
+  _task.reset();
+  _frames.clear();
+
+  _registers.assign(static_cast<size_t>(_process._register_count), vm_value { 0.0 });
+
+  _stack.clear(0, _stack_touched);
+  _stack_touched = 0;
+  if (_stack.size() < stack_size) {
+    _stack.resize(stack_size);
   }
+}
 
-  _stack.resize(stack_size);
+
+
+/**
+ * Makes the receiving thread, which may be new or taken from the thread pool,
+ * a fork of the given thread. Used by fork_thread.
+ *
+ * Only the current call frame and its stack window (EBP to ESP) are copied,
+ * rebased to the bottom of the fork's stack, since the fork exits once it
+ * returns from that frame. If the thread has no frames, its whole stack is
+ * copied.
+ */
+void vm_thread::fork_from(vm_thread const &thread)
+{
+  _sequence = thread._sequence;
+  _trap = thread._trap;
+  _fuel = thread._fuel;
+  _host_calls = thread._host_calls;
+  _host_sequence = thread._host_sequence;
+  _suspended = thread._suspended;
+  _yielded = thread._yielded;
+  _parked = thread._parked;
+  _async_token = thread._async_token;
+  _resume_hook = nullptr;
+  _resume_hook_context = nullptr;
+  _thread_id = thread._thread_id;
+  _task = thread._task;
+  _registers = thread._registers;
+  _frames.clear();
+
+  if (thread._frames.empty()) {
+    _stack = thread._stack;
+    _stack_touched = thread._stack_touched;
+    return;
+  }
+
+  int64_t const stack_size = static_cast<int64_t>(thread._stack.size());
+  int64_t const window_top = std::min(thread.esp().i64(), stack_size);
+  int64_t const window_base = std::min(thread.ebp().i64(), window_top);
+  size_t const window_size = static_cast<size_t>(window_top - window_base);
+
+  if (_stack.size() < window_size) {
+    _stack.resize(window_size);
+  } else if (_stack_touched > window_size) {
+    // Clear whatever a previous use of the thread left past the window.
+    _stack.clear(window_size, _stack_touched);
+  }
+  _stack.copy(thread._stack, window_base, window_top, 0);
+  _stack_touched = window_size;
+
+  // The caller's stack isn't copied, so returning from the frame leaves the
+  // fork with an empty stack.
+  call_frame frame = thread._frames.back();
+  frame.ebp = 0;
+  frame.esp = 0;
+  _frames.push_back(frame);
+
+  ebp() = 0;
+  esp() = static_cast<int64_t>(window_size);
 }
 
 
@@ -108,9 +180,8 @@ vm_thread::vm_thread(vm_state &process, size_t stack_size)
  */
 vm_function vm_thread::function(const char *name)
 {
-  const auto pointer = find_function_pointer(name);
-  // if (!pointer.ok) throw std::runtime_error("no such function");
-  return vm_function { *this, pointer.value };
+  // If not found, the handle is unresolved and calling it throws.
+  return vm_function { *this, _process.find_function_handle(name).value };
 }
 
 
@@ -122,7 +193,18 @@ vm_function vm_thread::function(const char *name)
  */
 vm_function vm_thread::function(int64_t pointer)
 {
-  return vm_function { *this, pointer };
+  return vm_function { *this, vm_function_handle { _process, pointer, -1 } };
+}
+
+
+
+/**
+ * Returns a vm_function object bound to the current thread for a function
+ * handle resolved by this thread's process.
+ */
+vm_function vm_thread::function(vm_function_handle const &fn)
+{
+  return vm_function { *this, fn };
 }
 
 
@@ -168,6 +250,7 @@ bool vm_thread::run()
   const int64_t term_sequence = _sequence++;
   while (!_trap && term_sequence < _sequence) {
     int64_t const opidx = fetch();
+    --_fuel;
     exec(_process._unit.fetch_op(opidx));
   }
   bool const good = _trap == 0;
@@ -178,26 +261,170 @@ bool vm_thread::run()
 
 
 /**
- * Dereferences an input value as either a constant or register, depending on
- * the provided flags and mask.
+ * Runs a call made by the host until it returns to call_sequence (the thread's
+ * sequence before the call descended its frame). Traps in the call are
+ * resumed unless stop_on_trap is set. Returns true if the call returned, or
+ * false if it trapped or the thread was suspended.
+ *
+ * Only the outermost host call on a thread can be suspended, since nested
+ * calls (made by host callbacks) would leave host frames in the way.
  */
-vm_value vm_thread::deref(vm_value input, uint64_t flag, uint64_t mask) const
+bool vm_thread::run_host_call(int64_t call_sequence, bool stop_on_trap)
 {
-  return (flag & mask) ? input : reg(input);
+  struct host_call_scope
+  {
+    int64_t &depth;
+    ~host_call_scope() { --depth; }
+  };
+
+  if (_host_calls == 0) {
+    _host_sequence = call_sequence;
+  }
+  host_call_scope const scope { ++_host_calls };
+
+  while (_sequence > call_sequence) {
+    if (!run() && (_suspended || stop_on_trap)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+
+/**
+ * Runs a thread created by DEFER until it exits. A trap only drops out of the
+ * current frame, so the thread is resumed up to VM_MAX_JOIN_LOOPS times before
+ * it's left as-is.
+ */
+void vm_thread::run_deferred()
+{
+  int loops = VM_MAX_JOIN_LOOPS;
+  while (loops > 0 && !run()) {
+    --loops;
+  }
 }
 
 
 
 /**
- * Convenience function for performing a bitwise shift against a numeric value.
+ * Suspends the thread at the next instruction boundary if it's out of fuel.
+ *
+ * Fuel is spent on every instruction but only checked on calls and backward
+ * jumps, which every unbounded loop has to pass through.
  */
-template <typename T>
-constexpr T vm_shift(T num, int64_t shift)
+void vm_thread::check_fuel()
 {
-  return
-    shift == 0
-    ? num
-    : ((shift > 0) ? (num << shift) : (num >> (-shift)));
+  if (_fuel <= 0 && _host_calls == 1) {
+    _suspended = true;
+    ++_trap;
+  }
+}
+
+
+
+/**
+ * Waits until a send to (or receive from) a channel might not block. Returns
+ * false if the thread was parked instead, in which case the instruction is
+ * retried once the thread is resumed.
+ *
+ * The outermost host call on a thread parks (see vm_state::run_completed), and
+ * a thread deferred to a scheduler helps run other deferred threads until the
+ * channel is ready. Anything else, such as a deferred thread run inline by
+ * JOIN or a nested host call, can't wait without blocking the host thread,
+ * which may be the only thing that would ever make the channel ready. Those
+ * throw vm_thread_state_error instead.
+ */
+bool vm_thread::wait_for_channel(int64_t channel_id, bool sending)
+{
+  if (_host_calls == 1) {
+    if (!_process.park_on_channel(*this, channel_id, sending)) {
+      return true;
+    }
+    // Point back at the instruction so it's retried on resume.
+    ip() = ip() - 1;
+    return false;
+  } else if (_task) {
+    _process._scheduler->help_until([this, channel_id, sending] {
+      return _process.channel_ready(channel_id, sending);
+    });
+  } else if (!_process.channel_ready(channel_id, sending)) {
+    throw vm_thread_state_error("Attempt to wait on a channel with no host call to park or scheduler to help");
+  }
+  return true;
+}
+
+
+
+/**
+ * Returns the outcome of the thread's last host call: VM_CALL_COMPLETE unless
+ * the call is suspended, in which case it's the reason it's suspended.
+ */
+vm_call_status vm_thread::call_status() const
+{
+  if (!_suspended) {
+    return VM_CALL_COMPLETE;
+  } else if (_yielded) {
+    return VM_CALL_YIELDED;
+  } else if (_parked) {
+    return VM_CALL_PARKED;
+  }
+  return VM_CALL_SUSPENDED;
+}
+
+
+
+/**
+ * Resumes a host call that was suspended, either by a YIELD or for running out
+ * of fuel, and returns its result or the next value it yields. Fuel isn't
+ * replenished, so call set_fuel first if the call ran out. The call may be
+ * suspended again, in which case suspended() is still true afterward.
+ *
+ * Parked calls can't be resumed directly. They're resumed by
+ * vm_state::run_completed once their async result is completed.
+ */
+vm_resume_result vm_thread::resume()
+{
+  if (!_suspended) {
+    throw vm_thread_state_error("Attempt to resume a thread that isn't suspended");
+  } else if (_parked) {
+    throw vm_thread_state_error("Attempt to resume a thread parked on an async callback");
+  } else if (_host_calls != 0) {
+    throw vm_thread_state_error("Attempt to resume a thread from inside a host call");
+  }
+
+  _suspended = false;
+  _yielded = false;
+  run_host_call(_host_sequence, false);
+
+  vm_call_status const status = call_status();
+  bool const has_value = status == VM_CALL_COMPLETE || status == VM_CALL_YIELDED;
+  return { status, has_value ? rp() : vm_value::undefined() };
+}
+
+
+
+/**
+ * Sets a function for vm_state::run_completed to call the next time it
+ * resumes the thread's parked host call, after its own on_resumed callback.
+ * The hook is cleared before it's called, so it only runs once unless it sets
+ * itself again. Pass null to clear it.
+ */
+void vm_thread::set_resume_hook(vm_resumed_fn_t *hook, void *context)
+{
+  _resume_hook = hook;
+  _resume_hook_context = context;
+}
+
+
+
+/**
+ * Dereferences an input value as either a constant or register, depending on
+ * the provided flags and mask.
+ */
+vm_value vm_thread::deref(vm_value input, uint64_t flag, uint64_t mask) const
+{
+  return (flag & mask) ? input : reg(input);
 }
 
 
@@ -223,83 +450,80 @@ void vm_thread::exec(const vm_op &op)
   // ADD OUT, LHS, RHS, LITFLAG
   // Addition (fp64).
   case ADD: {
-    reg(op[0]) = deref(op[1], litflag, 0x2).f64() + deref(op[2], litflag, 0x4).f64();
+    vm_binary_op<ADD>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // SUB OUT, LHS, RHS, LITFLAG
   // Subtraction (fp64).
   case SUB: {
-    reg(op[0]) = deref(op[1], litflag, 0x2).f64() - deref(op[2], litflag, 0x4).f64();
+    vm_binary_op<SUB>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // DIV OUT, LHS, RHS, LITFLAG
   // Floating point division.
   case DIV: {
-    reg(op[0]) = deref(op[1], litflag, 0x2).f64() / deref(op[2], litflag, 0x4).f64();
+    vm_binary_op<DIV>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // IDIV OUT, LHS, RHS, LITFLAG
   // Integer division (64-bit signed -- rationale: 64-bit is used as the result
   // will never be out of range of a 64-bit float).
   case IDIV: {
-    reg(op[0]) = deref(op[1], litflag, 0x2).i64() / deref(op[2], litflag, 0x4).i64();
+    vm_binary_op<IDIV>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // MUL OUT, LHS, RHS, LITFLAG
   // Multiplication (fp64).
   case MUL: {
-    reg(op[0]) = deref(op[1], litflag, 0x2).f64() * deref(op[2], litflag, 0x4).f64();
+    vm_binary_op<MUL>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // POW OUT, LHS, RHS, LITFLAG
   // Power (fp64).
   case POW: {
-    reg(op[0]) = std::pow(deref(op[1], litflag, 0x2).f64(), deref(op[2], litflag, 0x4).f64());
+    vm_binary_op<POW>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // MOD OUT, LHS, RHS, LITFLAG
   // Floating point modulo.
   case MOD: {
-    reg(op[0]) = std::fmod(
-        deref(op[1], litflag, 0x2).f64(),
-        deref(op[2], litflag, 0x4).f64()
-      );
+    vm_binary_op<MOD>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // IMOD OUT, LHS, RHS, LITFLAG
   // Signed integer modulo (32-bit).
   case IMOD: {
-    reg(op[0]) = deref(op[1], litflag, 0x2).i64() % deref(op[2], litflag, 0x4).i64();
+    vm_binary_op<IMOD>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // NEG OUT, IN
   // Negation.
   case NEG: {
-    reg(op[0]) = -reg(op[1]);
+    vm_unary_op<NEG>(reg(op[0]), reg(op[1]));
   } break;
 
   // NOT OUT, IN
   // Bitwise not (unsigned).
   case NOT: {
-    reg(op[0]) = ~(reg(op[1]));
+    vm_unary_op<NOT>(reg(op[0]), reg(op[1]));
   } break;
 
   // OR OUT, LHS, RHS, LITFLAG
   // Bitwise or (unsigned).
   case OR: {
-    reg(op[0]) = deref(op[1], litflag, 0x2) | deref(op[2], litflag, 0x4);
+    vm_binary_op<OR>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // AND OUT, LHS, RHS, LITFLAG
   // Bitwise and (unsigned).
   case AND: {
-    reg(op[0]) = deref(op[1], litflag, 0x2) & deref(op[2], litflag, 0x4);
+    vm_binary_op<AND>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // XOR OUT, LHS, RHS, LITFLAG
   // Bitwise xor (unsigned).
   case XOR: {
-    reg(op[0]) = deref(op[1], litflag, 0x2) ^ deref(op[2], litflag, 0x4);
+    vm_binary_op<XOR>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // ARITHSHIFT OUT, LHS (signed), RHS (unsigned), LITFLAG
@@ -308,9 +532,7 @@ void vm_thread::exec(const vm_op &op)
   // RHS < 0  -> Right shift.
   // RHS == 0 -> Cast to signed int.
   case ARITHSHIFT: {
-    const int64_t input = deref(op[1], litflag, 0x2);
-    const int64_t shift = deref(op[2], litflag, 0x4);
-    reg(op[0]) = vm_shift(input, shift);
+    vm_binary_op<ARITHSHIFT>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // BITSHIFT OUT, LHS (unsigned), RHS (signed), LITFLAG
@@ -319,57 +541,31 @@ void vm_thread::exec(const vm_op &op)
   // RHS < 0  -> Right shift.
   // RHS == 0 -> Cast to unsigned 32-bit int.
   case BITSHIFT: {
-    const uint64_t input = deref(op[1], litflag, 0x2);
-    const int64_t shift = deref(op[2], litflag, 0x4);
-    reg(op[0]) = vm_shift(input, shift);
+    vm_binary_op<BITSHIFT>(reg(op[0]), deref(op[1], litflag, 0x2), deref(op[2], litflag, 0x4));
   } break;
 
   // FLOOR OUT, IN
   // Nearest integral value <= IN.
   case FLOOR: {
-    vm_value const in = reg(op[1]);
-    if (in.type != vm_value::FLOAT) {
-      reg(op[0]) = in.as(vm_value::FLOAT);
-    } else {
-      reg(op[0]) = std::floor(in.f64());
-    }
+    vm_unary_op<FLOOR>(reg(op[0]), reg(op[1]));
   } break;
 
   // CEIL OUT, IN
   // Nearest integral value >= IN.
   case CEIL: {
-    vm_value const in = reg(op[1]);
-    if (in.type != vm_value::FLOAT) {
-      reg(op[0]) = in.as(vm_value::FLOAT);
-    } else {
-      reg(op[0]) = std::ceil(in.f64());
-    }
+    vm_unary_op<CEIL>(reg(op[0]), reg(op[1]));
   } break;
 
   // ROUND OUT, IN
   // Nearest integral value using FE_TONEAREST.
   case ROUND: {
-    vm_value const in = reg(op[1]);
-    if (in.type != vm_value::FLOAT) {
-      reg(op[0]) = in.as(vm_value::FLOAT);
-    } else {
-      with_rounding(FE_TONEAREST, [&] {
-        reg(op[0]) = std::nearbyint(in.f64());
-      });
-    }
+    vm_unary_op<ROUND>(reg(op[0]), reg(op[1]));
   } break;
 
   // RINT OUT, IN
   // Nearest integral value using FE_TOWARDZERO.
   case RINT: {
-    vm_value const in = reg(op[1]);
-    if (in.type != vm_value::FLOAT) {
-      reg(op[0]) = in.as(vm_value::FLOAT);
-    } else {
-      with_rounding(FE_TOWARDZERO, [&] {
-        reg(op[0]) = std::nearbyint(in.f64());
-      });
-    }
+    vm_unary_op<RINT>(reg(op[0]), reg(op[1]));
   } break;
 
   // EQ|LE|LT LHS, RHS, RESULT, LITFLAG
@@ -385,19 +581,19 @@ void vm_thread::exec(const vm_op &op)
   // 0x1 - LHS is a literal
   // 0x2 - RHS is a literal
   case EQ: {
-    if ((deref(op[0], litflag, 0x1) == deref(op[1], litflag, 0x2)) != (op[2] != 0)) {
+    if (vm_compare_op<EQ>(deref(op[0], litflag, 0x1), deref(op[1], litflag, 0x2)) != (op[2] != 0)) {
       ip() = ip() + 1;
     }
   } break;
 
   case LT: {
-    if ((deref(op[0], litflag, 0x1) < deref(op[1], litflag, 0x2)) != (op[2] != 0)) {
+    if (vm_compare_op<LT>(deref(op[0], litflag, 0x1), deref(op[1], litflag, 0x2)) != (op[2] != 0)) {
       ip() = ip() + 1;
     }
   } break;
 
   case LE: {
-    if ((deref(op[0], litflag, 0x1) <= deref(op[1], litflag, 0x2)) != (op[2] != 0)) {
+    if (vm_compare_op<LE>(deref(op[0], litflag, 0x1), deref(op[1], litflag, 0x2)) != (op[2] != 0)) {
       ip() = ip() + 1;
     }
   } break;
@@ -412,6 +608,9 @@ void vm_thread::exec(const vm_op &op)
       throw vm_invalid_instruction_pointer("Attempt to jump to non-integral instruction pointer");
     }
     ip() = new_ip;
+    if (new_ip.i64() <= op.ip) {
+      check_fuel();
+    }
   } break;
 
   // PUSH REG
@@ -450,6 +649,26 @@ void vm_thread::exec(const vm_op &op)
       throw vm_invalid_argument_count("Attempt to call instruction pointer with non-integral argument count");
     }
     exec_call(new_ip, argc);
+    check_fuel();
+  } break;
+
+  // RCALL POINTER, ARGC, LITFLAG
+  // Register-window call. Same as CALL, except that the ARGC arguments are
+  // passed in the argument registers (R_FIRST_ARGUMENT onward, first argument
+  // first) instead of on the stack, so the callee doesn't need to POP them.
+  // Litflags:
+  // 0x1 - POINTER is a literal address.
+  // 0x2 - ARGC is a literal integer.
+  case RCALL: {
+    vm_value const new_ip = deref(op[0], litflag, 0x1).as(vm_value::SIGNED);
+    vm_value const argc = deref(op[1], litflag, 0x2).as(vm_value::SIGNED);
+    if (new_ip.is_undefined() || new_ip.is_error()) {
+      throw vm_invalid_instruction_pointer("Attempt to call non-integral instruction pointer");
+    } else if (argc.is_undefined() || argc.is_error()) {
+      throw vm_invalid_argument_count("Attempt to call instruction pointer with non-integral argument count");
+    }
+    exec_call(new_ip, argc, true);
+    check_fuel();
   } break;
 
   // RETURN -- exits the current frame/sequence
@@ -624,37 +843,136 @@ void vm_thread::exec(const vm_op &op)
     _trap = 1;
   } break;
 
+  // YIELD VALUE, LITFLAG
+  // Suspends the thread after this instruction and hands VALUE to the host as
+  // the result of the call it's running. The host continues the call with
+  // vm_thread::resume. VALUE is also assigned to RP. Only the outermost host
+  // call on a thread can yield, since nested calls would leave host frames in
+  // the way.
+  // Litflags:
+  // 0x1 - value
+  case YIELD: {
+    if (_host_calls != 1) {
+      throw vm_thread_state_error("Attempt to yield outside of an outermost host call");
+    }
+    rp() = deref(op[0], litflag, 0x1);
+    _suspended = true;
+    _yielded = true;
+    ++_trap;
+  } break;
+
   // DEFER OUT
-  // Copies the current thread to a new thread and returns an index to it. This
-  // thread is not currently running and must be started using JOIN.
+  // Copies the current thread to a new thread and returns its ID. If
+  // the process has a scheduler, the new thread is handed to it and may start
+  // running right away on another host thread. Otherwise, the thread is not
+  // currently running and must be started using JOIN.
   //
-  // The output register of the calling thread is set to the new thread's index
-  // to be passed to JOIN while the new thread's output register is set to -1.
+  // The output register of the calling thread is set to the new thread's ID to
+  // be passed to JOIN while the new thread's output register is set to -1.
   // The output register should be checked to determine if the thread is the
   // caller or callee of the instruction.
   //
   // The resulting deferred thread's call stack is only valid for the function
   // it's currently in (i.e., if the call to defer happens in baz in a call
-  // stack of foo -> bar -> baz, foo -> bar is lost). Upon return, the thread
-  // exits.
+  // stack of foo -> bar -> baz, foo -> bar is lost). Only that function's
+  // stack window is copied, and it starts at the bottom of the new thread's
+  // stack, so EBP and ESP differ between the two threads. Upon return, the
+  // thread exits.
   case DEFER: {
     reg(op[0]) = -1;
     vm_thread &thread = _process.fork_thread(*this);
     reg(op[0]) = thread.thread_index();
+    if (_process._scheduler) {
+      _process._scheduler->defer(thread);
+    }
   } break;
 
   // JOIN OUT, THREAD
-  // Runs any given thread index and assigns that thread's resulting RP to OUT.
-  // Upon completion, THREAD is destroyed.
+  // Runs the thread with the given ID and assigns that thread's resulting RP to
+  // OUT. If the thread was handed to a scheduler, this instead waits for it to
+  // finish, running other deferred threads in the meantime. Upon completion,
+  // THREAD is destroyed.
   case JOIN: {
-    int64_t const thread_index = reg(op[0]);
-    vm_thread &thread = _process.thread_by_index(thread_index);
-    int loops = VM_MAX_JOIN_LOOPS;
-    while (loops > 0 && !thread.run()) {
-      --loops;
+    int64_t const thread_id = reg(op[0]);
+    vm_thread &thread = _process.thread_by_index(thread_id);
+    try {
+      if (thread._task) {
+        _process._scheduler->join(thread);
+      } else {
+        thread.run_deferred();
+      }
+    } catch (...) {
+      // The thread is done either way, so don't leak it when its error is
+      // passed on.
+      _process.destroy_thread(thread_id);
+      throw;
     }
     reg(op[1]) = thread.return_value();
-    _process.destroy_thread(thread_index);
+    _process.destroy_thread(thread_id);
+  } break;
+
+  // CHANNEL OUT, CAPACITY, LITFLAG
+  // Creates a channel that holds up to CAPACITY values and writes its ID to
+  // OUT. CAPACITY must be at least 1.
+  // Litflags:
+  // 0x2 - capacity
+  case CHANNEL: {
+    reg(op[0]) = _process.make_channel(deref(op[1], litflag, 0x2));
+  } break;
+
+  // SEND CHANNEL, VALUE, LITFLAG
+  // Sends VALUE to the channel with the ID CHANNEL. If the channel is full, the
+  // thread waits until it isn't (see wait_for_channel). Sending to a closed
+  // channel is an error.
+  // Litflags:
+  // 0x1 - channel
+  // 0x2 - value
+  case SEND: {
+    int64_t const channel_id = deref(op[0], litflag, 0x1);
+    vm_value const value = deref(op[1], litflag, 0x2);
+    for (;;) {
+      vm_channel_status const status = _process.try_send(channel_id, value);
+      if (status == VM_CHANNEL_CLOSED) {
+        throw vm_bad_channel("Attempt to send to a closed channel");
+      } else if (status == VM_CHANNEL_OK || !wait_for_channel(channel_id, true)) {
+        break;
+      }
+    }
+  } break;
+
+  // RECV OUT, OK, CHANNEL, LITFLAG
+  // Receives the oldest value sent to the channel with the ID CHANNEL, writes
+  // it to OUT, and sets OK to 1. If the channel is closed and has no values
+  // left, OUT is left as-is and OK is set to 0. If the channel is empty, the
+  // thread waits until it isn't (see wait_for_channel).
+  // Litflags:
+  // 0x4 - channel
+  case RECV: {
+    int64_t const channel_id = deref(op[2], litflag, 0x4);
+    for (;;) {
+      vm_value value;
+      vm_channel_status const status = _process.try_recv(channel_id, value);
+      if (status == VM_CHANNEL_BLOCKED) {
+        if (wait_for_channel(channel_id, false)) {
+          continue;
+        }
+      } else if (status == VM_CHANNEL_OK) {
+        reg(op[0]) = value;
+        reg(op[1]) = 1;
+      } else {
+        reg(op[1]) = 0;
+      }
+      break;
+    }
+  } break;
+
+  // CLOSE CHANNEL, LITFLAG
+  // Closes the channel with the ID CHANNEL, waking any threads waiting on it.
+  // Values already sent can still be received.
+  // Litflags:
+  // 0x1 - channel
+  case CLOSE: {
+    _process.close_channel(deref(op[0], litflag, 0x1));
   } break;
 
   case OP_COUNT: ;
@@ -721,20 +1039,204 @@ vm_value vm_thread::call_function_nt(int64_t pointer, int64_t argc, const vm_val
  * may not be less than zero.
  *
  * The given instruction pointer may be a bound callback.
+ *
+ * If the thread runs out of fuel, the call is suspended and its result has to
+ * be retrieved with resume(). If the call yields, the yielded value is
+ * returned instead and the call is continued with resume(). If it parks on an
+ * async callback, the call is continued by vm_state::run_completed.
+ * call_status() tells which of these happened.
  */
 vm_value vm_thread::call_function_nt(int64_t pointer, int64_t num_args)
 {
+  if (_suspended) {
+    throw vm_thread_state_error("Attempt to call a function on a suspended thread");
+  }
+
+  int64_t const call_sequence = _sequence;
   exec_call(pointer, num_args);
   if (pointer >= 0) {
-    while (!run()) {
-      /* nop */
-    }
+    run_host_call(call_sequence, false);
+  }
+  return rp();
+}
+
+
+
+/**
+ * Calls a resolved function handle with the given argument count and argument
+ * array and returns the result.
+ */
+vm_value vm_thread::call_function_nt(vm_function_handle const &fn, int64_t argc, const vm_value *argv)
+{
+  check_function_handle(fn, argc);
+  for (int64_t arg_index = 0; arg_index < argc; ++arg_index) {
+    push(argv[arg_index]);
+  }
+  return call_function_nt(fn, argc);
+}
+
+
+
+/**
+ * Calls a resolved function handle with the given number of arguments to be
+ * popped from the stack and returns the result.
+ *
+ * Unlike calls by instruction pointer, the handle's entry point and callback
+ * slot were validated when it was resolved, so only its process and arity are
+ * checked here.
+ */
+vm_value vm_thread::call_function_nt(vm_function_handle const &fn, int64_t num_args)
+{
+  check_function_handle(fn, num_args);
+  if (num_args > esp()) {
+    throw vm_invalid_argument_count("Encountered argument count greater than ESP");
+  }
+
+  int64_t const call_sequence = _sequence;
+  down_frame(num_args);
+  if (fn.is_callback()) {
+    exec_callback(fn._callback, num_args, false);
+  } else {
+    ip() = fn._pointer;
+    run_host_call(call_sequence, false);
   }
   return rp();
 }
 
 
 
+/**
+ * Sets up a call to a resolved function handle with the given arguments
+ * without running it. The call is left suspended before its first instruction
+ * and is run by resume(), so it can be run in slices by setting the thread's
+ * fuel (see vm_round_robin). Host callbacks can't be started this way, and
+ * neither can a call on a thread whose last call is still suspended, since
+ * that call's frames would be orphaned.
+ */
+void vm_thread::start_call(vm_function_handle const &fn, int64_t argc, const vm_value *argv)
+{
+  if (_suspended) {
+    throw vm_thread_state_error("Attempt to start a call on a thread with a suspended call");
+  }
+
+  check_function_handle(fn, argc);
+  if (fn.is_callback()) {
+    throw vm_invalid_instruction_pointer("Attempt to start a call to a host callback");
+  } else if (_host_calls != 0) {
+    throw vm_thread_state_error("Attempt to start a call from inside a host call");
+  }
+
+  for (int64_t arg_index = 0; arg_index < argc; ++arg_index) {
+    push(argv[arg_index]);
+  }
+
+  _host_sequence = _sequence;
+  down_frame(argc);
+  ip() = fn._pointer;
+  _suspended = true;
+}
+
+
+
+/**
+ * Calls a resolved function handle once for each of `rows` argument tuples and
+ * returns the number of calls that completed.
+ *
+ * Row i's arguments start at args[i * stride]. The number of arguments passed
+ * per row is the handle's declared arity, or stride if it has none. Each row's
+ * result is written to results[i]. If status is non-null, status[i] receives
+ * the row's vm_call_status.
+ *
+ * The handle and argument layout are validated once for the whole batch. If a
+ * row traps, its call is unwound and the remaining rows are skipped, so the
+ * returned count is also the index of the trapped row. If the thread runs out
+ * of fuel or the row's call yields or parks, the call is left suspended
+ * instead and the batch can be continued from the next row after resuming it.
+ * A yielded value is written to the row's result.
+ */
+int64_t vm_thread::call_batch(
+  vm_function_handle const &fn,
+  int64_t rows,
+  const vm_value *args,
+  int64_t stride,
+  vm_value *results,
+  vm_call_status *status
+  )
+{
+  int64_t const argc = fn._arity >= 0 ? fn._arity : stride;
+
+  if (rows < 0) {
+    throw vm_invalid_argument_count("Attempt to call a batch with fewer than 0 rows");
+  } else if (argc > stride) {
+    throw vm_invalid_argument_count("Batch stride is smaller than the function's declared arity");
+  }
+  check_function_handle(fn, argc);
+
+  size_t const base_depth = _frames.size();
+  int64_t row = 0;
+
+  for (; row < rows; ++row) {
+    vm_value const *const row_args = args + row * stride;
+    for (int64_t arg_index = 0; arg_index < argc; ++arg_index) {
+      push(row_args[arg_index]);
+    }
+
+    int64_t const call_sequence = _sequence;
+    down_frame(argc);
+    if (fn.is_callback()) {
+      exec_callback(fn._callback, argc, false);
+    } else {
+      ip() = fn._pointer;
+      if (!run_host_call(call_sequence, true)) {
+        if (_yielded) {
+          results[row] = rp();
+        } else if (!_suspended) {
+          // Unwind whatever the trapped call left behind, including its own frame.
+          while (_frames.size() > base_depth) {
+            up_frame(0);
+          }
+        }
+        break;
+      }
+    }
+
+    results[row] = rp();
+    if (status) {
+      status[row] = VM_CALL_COMPLETE;
+    }
+  }
+
+  if (status && row < rows) {
+    status[row] = _suspended ? call_status() : VM_CALL_TRAPPED;
+    std::fill(status + row + 1, status + rows, VM_CALL_SKIPPED);
+  }
+
+  return row;
+}
+
+
+
+/**
+ * Throws if a function handle can't be called from this thread with the given
+ * number of arguments.
+ */
+void vm_thread::check_function_handle(vm_function_handle const &fn, int64_t argc) const
+{
+  if (!fn.is_valid()) {
+    throw vm_invalid_instruction_pointer("Attempt to call an unresolved function handle");
+  } else if (fn._process != &_process) {
+    throw vm_wrong_process("Function handle was resolved by a different process");
+  } else if (_suspended) {
+    throw vm_thread_state_error("Attempt to call a function on a suspended thread");
+  } else if (argc < 0) {
+    throw vm_invalid_argument_count("Encountered argument count less than 0");
+  } else if (fn._arity >= 0 && argc != fn._arity) {
+    throw vm_invalid_argument_count("Argument count does not match the function's declared arity");
+  }
+}
+
+
+
 /**
  * Returns a copy of a value on the stack at the given location.
  *
@@ -766,6 +1268,9 @@ vm_value &vm_thread::stack(int64_t loc)
     _stack.resize(loc + 1);
   }
 
+  if (static_cast<size_t>(loc) >= _stack_touched) {
+    _stack_touched = loc + 1;
+  }
   return _stack[loc];
 }
 
@@ -811,9 +1316,12 @@ void vm_thread::up_frame(int64_t value_count)
     throw vm_stack_underflow("Attempt to ascend frame when no frames are recorded.");
   }
 
-  vm_value const *const copied_end = &stack(esp());
-  vm_value const *const copied_begin = copied_end - value_count;
-  stack_t const copied_stack { copied_begin, copied_end };
+  int64_t const copied_end = esp();
+  std::vector<vm_value> copied_stack;
+  copied_stack.reserve(value_count);
+  for (int64_t index = copied_end - value_count; index < copied_end; ++index) {
+    copied_stack.push_back(stack(index));
+  }
 
   call_frame const &frame = _frames.back();
 
@@ -821,6 +1329,13 @@ void vm_thread::up_frame(int64_t value_count)
   ebp() = frame.ebp;
   esp() = frame.esp;
 
+  // Non-volatile registers are callee-saved, so hand the caller's back.
+  if (R_NONVOLATILE_REGISTERS > 0) {
+    auto const restore_register_begin = std::begin(frame.registers);
+    auto const restore_register_end = std::end(frame.registers);
+    std::copy(restore_register_begin, restore_register_end, std::begin(_registers) + R_FIRST_NONVOLATILE);
+  }
+
   for (vm_value const value : copied_stack) {
     push(value);
   }
@@ -853,40 +1368,60 @@ void vm_thread::drop_frame()
  * Executes a function call. All function calls descend a frame, popping argc
  * values off the stack to be used as arguments for the function call.
  *
- * Optimized calls that don't leave the VM may optionally pass arguments via
- * registers. Stack-passed arguments are required for bound callbacks.
+ * If register_args is true, the call uses the register-window convention
+ * instead: the arguments are already in the argument registers and nothing is
+ * popped off the stack. Bound callbacks receive either kind of argument the
+ * same way, as an argv array.
  *
  * The result of a bound callback always overwrites the RP register, whereas
  * VM functions are not required to modify RP.
  */
-void vm_thread::exec_call(int64_t pointer, int64_t argc)
+void vm_thread::exec_call(int64_t pointer, int64_t argc, bool register_args)
 {
   if (argc < 0) {
     throw vm_invalid_argument_count("Encountered argument count less than 0");
-  } else if (argc > esp()) {
+  } else if (register_args && argc > R_ARGUMENT_REGISTERS) {
+    throw vm_invalid_argument_count("Encountered argument count greater than the argument registers");
+  } else if (!register_args && argc > esp()) {
     throw vm_invalid_argument_count("Encountered argument count greater than ESP");
   }
 
-  down_frame(argc);
+  down_frame(register_args ? 0 : argc);
 
   if (pointer < 0) {
-    auto callback = _process._callbacks[-(pointer + 1)];
+    exec_callback(-(pointer + 1), argc, register_args);
+  } else {
+    ip() = pointer;
+  }
+}
 
-    if (argc <= 0) {
-      rp() = callback.invoke(*this, 0, nullptr);
-    } else {
-      stack_t argv;
-      argv.reserve(argc);
-      for (int64_t argi = 0; argi < argc; ++argi) {
-        argv.push_back(pop());
-      }
-      rp() = callback.invoke(*this, argc, &argv[0]);
-    }
 
-    up_frame(0);
+
+/**
+ * Invokes the host callback at callback_index in the frame just entered by a
+ * call, storing its result in RP, and ascends the frame.
+ */
+void vm_thread::exec_callback(int64_t callback_index, int64_t argc, bool register_args)
+{
+  auto const &callback = _process.callback(callback_index);
+
+  if (argc <= 0) {
+    rp() = callback.invoke(*this, 0, nullptr);
+  } else if (register_args) {
+    // Copied since the callback may re-enter the VM and clobber registers.
+    vm_value const *const args_begin = &_registers[R_FIRST_ARGUMENT];
+    std::vector<vm_value> const argv { args_begin, args_begin + argc };
+    rp() = callback.invoke(*this, argc, &argv[0]);
   } else {
-    ip() = pointer;
+    std::vector<vm_value> argv;
+    argv.reserve(argc);
+    for (int64_t argi = 0; argi < argc; ++argi) {
+      argv.push_back(pop());
+    }
+    rp() = callback.invoke(*this, argc, &argv[0]);
   }
+
+  up_frame(0);
 }
 
 
@@ -931,7 +1466,7 @@ vm_value vm_thread::pop(bool copy_only)
 void vm_thread::dump_registers(size_t count) const
 {
   size_t index = 0;
-  for (; index < count && index < REGISTER_COUNT; ++index) {
+  for (; index < count && index < _registers.size(); ++index) {
     const vm_value &regval = _registers[index];
     std::clog << std::setw(2) << index << " -> " << regval << std::endl;
   }
@@ -963,7 +1498,7 @@ void vm_thread::dump_stack(size_t until) const
 vm_value vm_thread::reg(int64_t off) const
 {
   if (off >= 0) {
-    if (off >= REGISTER_COUNT) {
+    if (static_cast<size_t>(off) >= _registers.size()) {
       throw vm_bad_register("Invalid register offset.");
     }
     return _registers[off];
@@ -972,7 +1507,7 @@ vm_value vm_thread::reg(int64_t off) const
     if (off < 0) {
       throw vm_bad_register("Invalid relative stack offset.");
     }
-    return _stack[off];
+    return stack(off);
   }
 }
 
@@ -985,7 +1520,7 @@ vm_value vm_thread::reg(int64_t off) const
 vm_value &vm_thread::reg(int64_t off)
 {
   if (off >= 0) {
-    if (off >= REGISTER_COUNT) {
+    if (static_cast<size_t>(off) >= _registers.size()) {
       throw vm_bad_register("Invalid register offset.");
     }
     return _registers[off];
@@ -994,28 +1529,6 @@ vm_value &vm_thread::reg(int64_t off)
     if (off < 0) {
       throw vm_bad_register("Invalid relative stack offset.");
     }
-    return _stack[off];
-  }
-}
-
-
-
-/**
- * Looks up this thread's index in the VM process. Thread indices are not
- * guaranteed to be constant, so this value should not be relied upon as
- * unchanging.
- *
- * @todo Add a unique identifier for thread lookup.
- */
-int64_t vm_thread::thread_index() const
-{
-  auto const start = _process._threads.cbegin();
-  auto const end = _process._threads.cend();
-  auto const pointer = std::find_if(start, end, [this](vm_state::thread_pointer_t const &p) {
-    return p.get() == this;
-  });
-  if (pointer == end) {
-    return -1;
+    return stack(off);
   }
-  return static_cast<int64_t>(std::distance(start, pointer));
 }
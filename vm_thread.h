@@ -14,10 +14,71 @@
 #include "_types.h"
 #include "vm_value.h"
 #include "vm_function.h"
+#include "vm_scheduler.h"
+#include "vm_stack.h"
 
 
 class vm_op;
 class vm_state;
+class vm_thread;
+
+
+/** Fuel value for threads that never run out. @see vm_thread::set_fuel */
+constexpr int64_t VM_UNLIMITED_FUEL = INT64_MAX;
+
+
+/** Per-row outcome of a batched call. @see vm_thread::call_batch */
+enum vm_call_status : uint8_t
+{
+  /** The call returned and its result was stored. */
+  VM_CALL_COMPLETE,
+  /** The call trapped and was unwound. Its result is not stored. */
+  VM_CALL_TRAPPED,
+  /** The call was not made because an earlier row trapped. */
+  VM_CALL_SKIPPED,
+  /**
+   * The thread ran out of fuel during the call. The call is still in progress
+   * and its result is returned by vm_thread::resume.
+   */
+  VM_CALL_SUSPENDED,
+  /**
+   * The call executed a YIELD. The call is still in progress, its result is
+   * the yielded value, and it continues from the YIELD on vm_thread::resume.
+   */
+  VM_CALL_YIELDED,
+  /**
+   * A host callback made by the call parked the thread on an async result.
+   * The call continues once the result is completed.
+   * @see vm_state::park_thread
+   */
+  VM_CALL_PARKED,
+};
+
+
+/**
+ * Result of resuming a suspended host call. @see vm_thread::resume
+ */
+struct vm_resume_result
+{
+  /**
+   * VM_CALL_COMPLETE if the call returned, VM_CALL_YIELDED if it yielded
+   * again, VM_CALL_PARKED if it parked, or VM_CALL_SUSPENDED if it ran out of
+   * fuel again.
+   */
+  vm_call_status status;
+  /**
+   * The returned or yielded value. Undefined if the call parked or ran out of
+   * fuel.
+   */
+  vm_value value;
+};
+
+
+/**
+ * Called by vm_state::run_completed for each thread it resumes, with the
+ * outcome of the thread's host call.
+ */
+using vm_resumed_fn_t = void (vm_thread &thread, vm_resume_result result, void *context);
 
 
 /**
@@ -32,6 +93,9 @@ class vm_thread
 {
 
   friend class vm_state;
+  friend class vm_lane_kernel;
+  friend class vm_scheduler;
+  friend class vm_snapshot;
 
   /** Register declarations / info. */
   enum
@@ -72,6 +136,16 @@ class vm_thread
 
     /** The total number of volatile registers. */
     R_VOLATILE_REGISTERS = REGISTER_COUNT - R_FIRST_VOLATILE,
+
+    /**
+     * The number of volatile registers used to pass arguments to RCALL
+     * (register-window) calls.
+     */
+    R_ARGUMENT_REGISTERS = 16,
+    /** The index of the first register-window argument register. */
+    R_FIRST_ARGUMENT = R_FIRST_VOLATILE,
+    /** The index of the last register-window argument register. */
+    R_LAST_ARGUMENT = R_FIRST_ARGUMENT + (R_ARGUMENT_REGISTERS - 1),
   };
 
   /**
@@ -98,7 +172,7 @@ class vm_thread
 
 
   /** The VM thread stack collection type. */
-  using stack_t     = std::vector<vm_value>;
+  using stack_t     = vm_stack;
   /** The VM thread's call frame collection type. */
   using call_frames = std::vector<call_frame>;
 
@@ -108,12 +182,44 @@ class vm_thread
   int64_t _sequence = 0;
   /** Trap counter. Used to drop out of a frame or VM run. */
   int64_t _trap = 0;
+  /** Instructions left to run before the thread suspends. */
+  int64_t _fuel = VM_UNLIMITED_FUEL;
+  /** Number of host calls currently running on the thread. */
+  int64_t _host_calls = 0;
+  /** The sequence the outermost host call returns to. */
+  int64_t _host_sequence = 0;
+  /**
+   * Whether the outermost host call was suspended, either for running out of
+   * fuel or by a YIELD.
+   */
+  bool _suspended = false;
+  /** Whether the suspended host call was suspended by a YIELD. */
+  bool _yielded = false;
+  /** Whether the suspended host call is parked on an async callback. */
+  bool _parked = false;
+  /** Token of the async callback the thread is parked on, or -1. */
+  int64_t _async_token = -1;
+  /** Called the next time run_completed resumes the thread. @see set_resume_hook */
+  vm_resumed_fn_t *_resume_hook = nullptr;
+  void *_resume_hook_context = nullptr;
+  /** The thread's ID in its process. Assigned when the process loads it. */
+  int64_t _thread_id = -1;
+  /** The scheduler task running the thread, if it was deferred to one. */
+  std::shared_ptr<vm_scheduler::task> _task;
   /** The thread's stack. */
   stack_t _stack;
+  /**
+   * Number of leading stack slots that may have been written since the stack
+   * was last cleared. Every slot past it is zero.
+   */
+  size_t _stack_touched = 0;
   /** The thread's call frames. */
   call_frames _frames;
-  /** The thread's registers. */
-  vm_value _registers[REGISTER_COUNT] {};
+  /**
+   * The thread's registers. Sized to the process's register count, which is at
+   * most REGISTER_COUNT.
+   */
+  std::vector<vm_value> _registers;
 
   template <class T, class... ARGS>
   int64_t load_registers(int64_t index, T &&first, ARGS&&... args);
@@ -133,6 +239,10 @@ class vm_thread
   void exec(const vm_op &op);
   bool run(int64_t from_ip);
   bool run();
+  bool run_host_call(int64_t call_sequence, bool stop_on_trap);
+  void run_deferred();
+  void check_fuel();
+  bool wait_for_channel(int64_t channel_id, bool sending);
 
   int64_t fetch();
 
@@ -157,10 +267,15 @@ class vm_thread
   void push(vm_value value);
   vm_value pop(bool copy_only = false);
 
-  void exec_call(int64_t instr, int64_t argc);
+  void exec_call(int64_t instr, int64_t argc, bool register_args = false);
+  void exec_callback(int64_t callback_index, int64_t argc, bool register_args);
+  void check_function_handle(vm_function_handle const &fn, int64_t argc) const;
 
   vm_thread(vm_state &state, size_t stack_size);
 
+  void recycle(size_t stack_size);
+  void fork_from(vm_thread const &thread);
+
   vm_thread(vm_thread const &) = default;
   vm_thread &operator = (vm_thread const &) = default;
 
@@ -172,7 +287,7 @@ public:
   ~vm_thread() = default;
 
   // Debugging functions
-  void dump_registers(size_t count = REGISTER_COUNT) const;
+  void dump_registers(size_t count = SIZE_MAX) const;
   void dump_stack(size_t until = SIZE_MAX) const;
 
 
@@ -185,6 +300,9 @@ public:
   template <class... ARGS>
   vm_value call_function(int64_t pointer, ARGS&&... args);
 
+  template <class... ARGS>
+  vm_value call_function(vm_function_handle const &fn, ARGS&&... args);
+
   vm_value call_function(const char *name);
 
   vm_value call_function_nt(int64_t pointer) { return call_function_nt(pointer, 0); }
@@ -193,15 +311,52 @@ public:
   vm_value call_function_nt(int64_t pointer, int64_t argc, const vm_value *argv);
   vm_value call_function_nt(int64_t pointer, int64_t argc);
 
+  vm_value call_function_nt(vm_function_handle const &fn, int64_t argc, const vm_value *argv);
+  vm_value call_function_nt(vm_function_handle const &fn, int64_t argc);
+  void start_call(vm_function_handle const &fn, int64_t argc, const vm_value *argv);
+
+  int64_t call_batch(
+    vm_function_handle const &fn,
+    int64_t rows,
+    const vm_value *args,
+    int64_t stride,
+    vm_value *results,
+    vm_call_status *status = nullptr
+    );
+
   vm_function function(const char *name);
   vm_function function(int64_t pointer);
+  vm_function function(vm_function_handle const &fn);
+
+  /** Returns the number of instructions left before the thread suspends. */
+  int64_t fuel() const { return _fuel; }
+  /**
+   * Sets the number of instructions the thread may run before it suspends.
+   * Pass VM_UNLIMITED_FUEL to never suspend.
+   */
+  void set_fuel(int64_t fuel) { _fuel = fuel; }
+  /** Returns whether a host call on the thread is suspended. */
+  bool suspended() const { return _suspended; }
+  /** Returns whether a host call on the thread is suspended by a YIELD. */
+  bool yielded() const { return _yielded; }
+  /** Returns whether a host call on the thread is parked on an async callback. */
+  bool parked() const { return _parked; }
+  vm_call_status call_status() const;
+  vm_resume_result resume();
+  void set_resume_hook(vm_resumed_fn_t *hook, void *context = nullptr);
 
   vm_value deref(vm_value input, uint64_t flag, uint64_t mask = ~0ull) const;
 
   vm_state &process() { return _process; }
   vm_state const &process() const { return _process; }
 
-  int64_t thread_index() const;
+  /**
+   * Returns the thread's ID in its process. IDs don't change for the life of
+   * the thread. Once the thread is destroyed its ID goes stale, and it only
+   * names a thread again after its slot has been reused 2^31 times, when the
+   * slot's generation wraps around.
+   */
+  int64_t thread_index() const { return _thread_id; }
 
   vm_value return_value() const { return rp(); }
 };
@@ -227,6 +382,17 @@ vm_value vm_thread::call_function(int64_t pointer, ARGS&&... args)
 
 
 
+template <class... ARGS>
+vm_value vm_thread::call_function(vm_function_handle const &fn, ARGS&&... args)
+{
+  // Checked up front so a bad call doesn't leave its arguments on the stack.
+  check_function_handle(fn, sizeof...(ARGS));
+  const int64_t argc = load_registers(4, std::forward<ARGS>(args)...) - 4;
+  return call_function_nt(fn, argc);
+}
+
+
+
 template <class T, class... ARGS>
 int64_t vm_thread::load_registers(int64_t index, T &&first, ARGS&&... args)
 {
@@ -248,7 +414,7 @@ int64_t vm_thread::load_registers(int64_t index, T &&first)
 /**
  * @internal
  * Invokes a VM function on the given thread with a variable number of
- * arguments. The function to be invoked is located at `pointer`, which may
+ * arguments. The function to be invoked is given by `fn`, whose pointer may
  * or may not be an actual function starting point -- this is irrelevant
  * provided there is a return instruction executed at some point to end the
  * call frame of this invocation.
@@ -258,7 +424,7 @@ int64_t vm_thread::load_registers(int64_t index, T &&first)
  * @see vm_thread::call_function
  */
 template <class... ARGS>
-vm_value vm_invoke_function(vm_thread &thread, int64_t pointer, ARGS &&... args)
+vm_value vm_invoke_function(vm_thread &thread, vm_function_handle const &fn, ARGS &&... args)
 {
-  return thread.call_function(pointer, std::forward<ARGS>(args)...);
+  return thread.call_function(fn, std::forward<ARGS>(args)...);
 }
@@ -31,7 +31,7 @@ struct vm_chunk_offsets
   };
 
 
-  vm_table_header                header;
+  vm_table_header                header {};
   std::vector<chunk_offset>   offsets;
 
 
@@ -41,11 +41,16 @@ struct vm_chunk_offsets
    */
   explicit vm_chunk_offsets(std::istream &input)
   {
-    read_table(input, CHUNK_OFFS, header, [&](int32_t index) {
+    vm_chunk_buffer chunk;
+    if (!chunk.read(input)) {
+      return;
+    }
+
+    read_table(chunk, CHUNK_OFFS, header, sizeof(vm_chunk_id) + sizeof(int32_t), [&](int32_t index) {
       offsets.emplace_back(
         chunk_offset {
-          read_primitive<vm_chunk_id>(input),
-          read_primitive<int32_t>(input)
+          read_primitive<vm_chunk_id>(chunk),
+          read_primitive<int32_t>(chunk)
         });
     });
   }
@@ -0,0 +1,154 @@
+/*
+ *          Copyright Noel Cower 2014.
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include "hash.h"
+#include "vm_exception.h"
+
+
+/** Magic number at the start of a linked unit image ('RUIM'). */
+constexpr uint32_t VM_UNIT_IMAGE_MAGIC = 0x4D495552u;
+/** Version of the linked unit image format. */
+constexpr int32_t VM_UNIT_IMAGE_VERSION = 2;
+
+
+/**
+ * Header of a linked unit image. Followed by payload_size bytes of payload
+ * whose vm_unit_image_hash is payload_hash.
+ */
+struct vm_unit_image_header
+{
+  uint32_t magic;
+  int32_t  version;
+  uint64_t payload_size;
+  uint64_t payload_hash;
+};
+
+
+
+/**
+ * Hashes an image payload to catch corrupt or truncated images. Mixes eight
+ * bytes at a time, since hash64 works a byte at a time and would cost more
+ * than decoding the image. Not meant to resist deliberate tampering.
+ */
+inline uint64_t vm_unit_image_hash(char const *data, size_t size)
+{
+  uint64_t const multiplier = 0x9E3779B97F4A7C15ULL;
+  uint64_t hash = DEFAULT_HASH_SEED_64 ^ (size * multiplier);
+  char const *const words_end = data + (size & ~size_t(7));
+
+  for (; data < words_end; data += 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof word);
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 31;
+  }
+
+  uint64_t tail = 0;
+  std::memcpy(&tail, data, size & 7);
+  hash = (hash ^ tail) * multiplier;
+  return hash ^ (hash >> 29);
+}
+
+
+
+/**
+ * Appends the fields of a linked unit image to a byte buffer. Fields are
+ * written in host byte order, as with bytecode.
+ */
+struct vm_unit_image_writer
+{
+  std::string buffer;
+
+
+  template <typename T>
+  void write(T value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "Image fields must be trivially copyable");
+    buffer.append(reinterpret_cast<char const *>(&value), sizeof value);
+  }
+
+
+  void write_value(vm_value value)
+  {
+    write<int32_t>(value.type);
+    write<uint64_t>(value.u64_);
+  }
+
+
+  void write_bytes(void const *data, size_t size)
+  {
+    buffer.append(static_cast<char const *>(data), size);
+  }
+};
+
+
+
+/**
+ * Reads the fields of a linked unit image from a byte buffer. Throws
+ * vm_bad_unit if a field runs past the end of the buffer.
+ */
+struct vm_unit_image_reader
+{
+  char const *cursor;
+  char const *end;
+
+
+  void require(size_t size) const
+  {
+    if (static_cast<size_t>(end - cursor) < size) {
+      throw vm_bad_unit("Unit image is truncated.");
+    }
+  }
+
+
+  template <typename T>
+  T read()
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "Image fields must be trivially copyable");
+    require(sizeof(T));
+    T value;
+    std::memcpy(&value, cursor, sizeof value);
+    cursor += sizeof value;
+    return value;
+  }
+
+
+  vm_value read_value()
+  {
+    int32_t const type = read<int32_t>();
+    return vm_value { type, read<uint64_t>() };
+  }
+
+
+  /**
+   * Reads a count of items, each at least min_item_size bytes, and checks
+   * that they fit in what's left of the buffer.
+   */
+  size_t read_count(size_t min_item_size)
+  {
+    uint64_t const count = read<uint64_t>();
+    if (count > static_cast<uint64_t>(end - cursor) / min_item_size) {
+      throw vm_bad_unit("Unit image is truncated.");
+    }
+    return static_cast<size_t>(count);
+  }
+
+
+  void read_bytes(void *data, size_t size)
+  {
+    require(size);
+    std::memcpy(data, cursor, size);
+    cursor += size;
+  }
+};
@@ -8,23 +8,14 @@
 
 #pragma once
 
-#include "vm_unit+chunk_types.inl"
-
-
-/**
- * Reads a fixed-length string from the given input stream.
- *
- * The resulting string may contain null characters.
- */
-std::string
-read_string(std::istream &input, int32_t length)
-{
-  std::string result;
-  result.resize(length, '\0');
-  input.read(&result[0], length);
-  return result;
-}
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#include "vm_exception.h"
+#include "vm_unit+chunk_types.inl"
 
 
 /**
@@ -44,17 +35,6 @@ T read_primitive(std::istream &input)
 
 
 
-/**
- * Reads a vm_value from the stream.
- */
-template <>
-vm_value read_primitive<vm_value>(std::istream &input)
-{
-  return vm_value { read_primitive<double>(input) };
-}
-
-
-
 /**
  * Reads a vm_chunk_header from the stream.
  */
@@ -70,110 +50,256 @@ vm_chunk_header read_primitive<vm_chunk_header>(std::istream &input)
 
 
 /**
- * Reads a vm_table_header from the stream.
+ * A chunk read from a unit stream in one go. The chunk's fields are then
+ * decoded from memory by the vm_chunk_buffer overloads of read_primitive and
+ * friends below, instead of going through the stream once per field.
+ *
+ * Reads past the end of the chunk throw vm_bad_unit.
  */
-template <>
-vm_table_header read_primitive<vm_table_header>(std::istream &input)
+class vm_chunk_buffer
 {
-  return vm_table_header {
-    read_primitive<vm_chunk_header>(input),
-    read_primitive<int32_t>(input)
-  };
+  std::vector<char> _data;
+  size_t _cursor = 0;
+
+public:
+  vm_chunk_header header {};
+
+
+  /**
+   * Reads a chunk header and the rest of the chunk from the stream, replacing
+   * the buffer's contents. Returns false if the stream couldn't be read or
+   * the header's byte size is too small to include the header itself.
+   */
+  bool read(std::istream &input)
+  {
+    header = read_primitive<vm_chunk_header>(input);
+    _cursor = 0;
+    _data.clear();
+
+    if (!input || header.byte_size < static_cast<int32_t>(sizeof header)) {
+      return false;
+    }
+
+    // Read in runs so a corrupt byte size fails on the stream running out
+    // instead of on one huge allocation.
+    size_t const run_size = 1 << 20;
+    for (size_t remaining = static_cast<size_t>(header.byte_size) - sizeof header; remaining > 0; ) {
+      size_t const offset = _data.size();
+      size_t const run = std::min(remaining, run_size);
+      _data.resize(offset + run);
+      if (!input.read(&_data[offset], static_cast<std::streamsize>(run))) {
+        return false;
+      }
+      remaining -= run;
+    }
+
+    return true;
+  }
+
+
+  /** Returns the number of bytes left to decode. */
+  size_t remaining() const { return _data.size() - _cursor; }
+
+
+  /**
+   * Returns a pointer to the next size bytes of the chunk and skips past them.
+   */
+  char const *take(size_t size)
+  {
+    if (remaining() < size) {
+      throw vm_bad_unit("Chunk is truncated.");
+    }
+    char const *const bytes = _data.data() + _cursor;
+    _cursor += size;
+    return bytes;
+  }
+
+
+  /** Decodes a T stored in the unit's (host) byte order. */
+  template <typename T>
+  T load()
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "Chunk fields must be trivially copyable");
+    T value;
+    std::memcpy(&value, take(sizeof value), sizeof value);
+    return value;
+  }
+};
+
+
+
+/**
+ * Reads a value of type T from a chunk buffer.
+ */
+template <typename T>
+T read_primitive(vm_chunk_buffer &input)
+{
+  return input.load<T>();
 }
 
 
 
 /**
- * Reads a table of unknown contents from the stream.
- *
- * The table is read by reading the table header and then iteratively calling
- * the given `func` as many times as there are entries in the table.
+ * Operand encodings in bytecode version 10. Each operand starts with a tag
+ * byte whose low three bits are the encoding.
  *
- * It does not advance the read pointer for the stream for each row, so it's
- * assumed that `func` will do this.
+ * For the varint encodings, bit 3 of the tag is set if more bytes follow, and
+ * its high four bits are the low four bits of the value. Following bytes hold
+ * seven bits of the value each, least significant first, with their high bit
+ * set if another byte follows.
  */
-template <typename Func>
-bool read_table(std::istream &input, vm_chunk_id id, Func &&func)
+enum vm_operand_encoding : uint8_t
 {
-  vm_table_header const itable = read_primitive<vm_table_header>(input);
+  /** Undefined value. Its bits are a varint. */
+  OPERAND_UNDEFINED      = 0,
+  /** Unsigned integer as a varint. */
+  OPERAND_UNSIGNED       = 1,
+  /** Signed integer as a zigzag varint. */
+  OPERAND_SIGNED         = 2,
+  /** Double stored as 8 bytes after the tag. The tag's other bits are zero. */
+  OPERAND_FLOAT          = 3,
+  /** Data ID as a varint. */
+  OPERAND_DATA           = 4,
+  /** Double with an integral value, stored as a zigzag varint. */
+  OPERAND_INTEGRAL_FLOAT = 5,
+  /**
+   * Any other value, stored as in version 9: a 32-bit type and 8 bytes of
+   * value data after the tag. The tag's other bits are zero.
+   */
+  OPERAND_TYPED          = 7,
+
+  OPERAND_ENCODING_MASK  = 0x7,
+  OPERAND_VARINT_MORE    = 0x8,
+};
 
-  if (itable.header.id == id) {
-    for (int counter = 0; counter < itable.count; ++counter) {
-      func(counter);
-    }
 
-    return true;
+
+/**
+ * Reads the rest of a varint whose first four bits are in the operand tag.
+ */
+inline uint64_t read_operand_varint(vm_chunk_buffer &input, uint8_t tag)
+{
+  uint64_t bits = static_cast<uint64_t>(tag >> 4);
+
+  if (tag & OPERAND_VARINT_MORE) {
+    for (int shift = 4; ; shift += 7) {
+      if (shift >= 64) {
+        throw vm_bad_unit("Operand varint is too long.");
+      }
+
+      uint8_t const byte = read_primitive<uint8_t>(input);
+      bits |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+    }
   }
 
-  return false;
+  return bits;
 }
 
 
 
-/**
- * Reads a table of unknown contents from the stream. Same as the other
- * read_table implementation except that `init` will be called prior to
- * iteration if the table header was successfully read and had a matching
- * chunk ID.
- */
-template <typename InitFunc, typename Func>
-bool read_table(std::istream &input, vm_chunk_id id, InitFunc &&init, Func &&func)
+/** Decodes a zigzag-encoded signed integer. */
+inline int64_t zigzag_decode(uint64_t bits)
 {
-  vm_table_header const itable = read_primitive<vm_table_header>(input);
+  return static_cast<int64_t>((bits >> 1) ^ (~(bits & 1) + 1));
+}
 
-  if (itable.header.id == id) {
-    init(itable.count);
 
-    for (int counter = 0; counter < itable.count; ++counter) {
-      func(counter);
-    }
 
-    return true;
+/**
+ * Reads a fixed-length string from a chunk buffer.
+ */
+std::string read_string(vm_chunk_buffer &input, int32_t length)
+{
+  if (length < 0) {
+    throw vm_bad_unit("Negative string length.");
   }
-
-  return false;
+  char const *const bytes = input.take(static_cast<size_t>(length));
+  return std::string(bytes, static_cast<size_t>(length));
 }
 
 
 
 /**
- * Same as read_table (sans init), except returns the table header by receiving
- * a reference to some storage for a vm_table_header object.
+ * Reads a table from a chunk buffer. The chunk's header has already been read,
+ * so only the entry count is read. If the chunk has the given ID, `init` is
+ * called with the count and then `func` once per entry, and true is returned.
+ * `func` is expected to read its entry from the buffer.
+ *
+ * Every entry takes at least min_entry_size bytes, so a count that couldn't fit
+ * in the rest of the chunk throws vm_bad_unit before `init` can reserve
+ * storage for it, as does a negative count.
  */
-template <typename Func>
+template <typename InitFunc, typename Func>
 bool read_table(
-  std::istream &input,
+  vm_chunk_buffer &input,
   vm_chunk_id id,
-  vm_table_header &header_out,
+  size_t min_entry_size,
+  InitFunc &&init,
   Func &&func
   )
 {
-  vm_table_header const itable = read_primitive<vm_table_header>(input);
-  header_out = itable;
+  if (input.header.id != id) {
+    return false;
+  }
 
-  if (itable.header.id == id) {
-    for (int counter = 0; counter < itable.count; ++counter) {
-      func(counter);
-    }
+  int32_t const count = read_primitive<int32_t>(input);
+  if (count < 0) {
+    throw vm_bad_unit("Negative table count.");
+  } else if (static_cast<size_t>(count) > input.remaining() / min_entry_size) {
+    throw vm_bad_unit("Table count exceeds its chunk.");
+  }
 
-    return true;
+  init(count);
+
+  for (int counter = 0; counter < count; ++counter) {
+    func(counter);
   }
 
-  return false;
+  return true;
+}
+
+
+
+template <typename Func>
+bool read_table(vm_chunk_buffer &input, vm_chunk_id id, size_t min_entry_size, Func &&func)
+{
+  return read_table(input, id, min_entry_size, [](int32_t) { /* nop */ }, std::forward<Func>(func));
+}
+
+
+
+template <typename Func>
+bool read_table(
+  vm_chunk_buffer &input,
+  vm_chunk_id id,
+  vm_table_header &header_out,
+  size_t min_entry_size,
+  Func &&func
+  )
+{
+  header_out = vm_table_header { input.header, 0 };
+  return read_table(input, id, min_entry_size, [&](int32_t count) {
+      header_out.count = count;
+    },
+    std::forward<Func>(func));
 }
 
 
 
 /**
- * Reads a vm_label object from a stream.
+ * Reads a vm_label object from a chunk buffer.
  *
  * A label is defined as a 32-bit address and 32-bit length followed by a name
  * string with the previously-read length.
  */
-vm_label read_label(std::istream &input)
+vm_label read_label(vm_chunk_buffer &input)
 {
   int64_t const address = static_cast<int64_t>(read_primitive<int32_t>(input));
-  int64_t const length = static_cast<int64_t>(read_primitive<int32_t>(input));
+  int32_t const length = read_primitive<int32_t>(input);
   std::string name = read_string(input, length);
   return vm_label { std::move(name), address };
 }
@@ -181,15 +307,11 @@ vm_label read_label(std::istream &input)
 
 
 /**
- * Reads a variable-length string (an LString) from the stream. An LString is
- * prefixed by a 32-bit integer defining its length. The string may contain
+ * Reads a variable-length string (an LString) from a chunk buffer. An LString
+ * is prefixed by a 32-bit integer defining its length. The string may contain
  * null characters.
  */
-std::string read_lstring(std::istream &input)
+std::string read_lstring(vm_chunk_buffer &input)
 {
-  std::string result;
-  int64_t length = static_cast<int64_t>(read_primitive<int32_t>(input));
-  result.resize(length, '\0');
-  input.read(&result[0], length);
-  return result;
+  return read_string(input, read_primitive<int32_t>(input));
 }
@@ -6,6 +6,8 @@
  *          http://www.boost.org/LICENSE_1_0.txt)
  */
 
+#include <algorithm>
+#include <cstring>
 #include <set>
 
 #include "vm_unit.h"
@@ -13,8 +15,10 @@
 #include "vm_unit+chunk_types.inl"
 #include "vm_unit+io.inl"
 #include "vm_unit+chunk_offsets.inl"
+#include "vm_unit+image.inl"
 #include "vm_opcode.h"
 #include "vm_exception.h"
+#include "vm_lz.h"
 #include "hash.h"
 
 
@@ -24,8 +28,19 @@ static uint64_t string_hash(std::string const &str)
 }
 
 
+// Smallest encoded size of each kind of table entry, used to bound counts.
+/** A 32-bit instruction pointer and 32-bit operand mask. */
+static constexpr size_t RELOCATION_ENTRY_SIZE = sizeof(int32_t) + sizeof(uint32_t);
+/** A 32-bit address and name length. */
+static constexpr size_t LABEL_ENTRY_SIZE = sizeof(int32_t) + sizeof(int32_t);
+/** A name length. */
+static constexpr size_t LSTRING_ENTRY_SIZE = sizeof(int32_t);
+/** A 16-bit opcode and litflag. */
+static constexpr size_t INSTRUCTION_ENTRY_SIZE = 2 * sizeof(uint16_t);
 
-auto vm_unit::read_relocation_ptr(std::istream &input) -> relocation_ptr
+
+
+auto vm_unit::read_relocation_ptr(vm_chunk_buffer &input) -> relocation_ptr
 {
   return relocation_ptr {
     static_cast<int64_t>(read_primitive<int32_t>(input)),
@@ -135,17 +150,30 @@ vm_unit &vm_unit::operator = (vm_unit &&m)
 
 
 
-void vm_unit::read_instruction(std::istream &input)
+/** Returns the most operands any instruction takes. */
+static size_t max_opcode_argc()
+{
+  static size_t const max_argc = static_cast<size_t>(
+    *std::max_element(std::begin(g_opcode_argc), std::end(g_opcode_argc))
+    );
+  return max_argc;
+}
+
+
+
+template <vm_unit::value_reader_t *READER>
+void vm_unit::read_instruction(vm_chunk_buffer &input)
 {
-  vm_opcode const opcode = static_cast<vm_opcode>(read_primitive<uint16_t>(input));
+  uint16_t const opcode_code = read_primitive<uint16_t>(input);
   uint64_t const litflag = static_cast<uint64_t>(read_primitive<uint16_t>(input));
   int arg_base = static_cast<int>(instruction_argv.size());
-  value_reader_t *reader = value_reader();
 
-  if (reader == nullptr) {
-    throw vm_bad_unit("No defined value reader for unit version.");
+  if (opcode_code >= OP_COUNT) {
+    throw vm_bad_unit("Invalid opcode in instruction table.");
   }
 
+  vm_opcode const opcode = static_cast<vm_opcode>(opcode_code);
+
   instructions.emplace_back(
     instruction_ptr {
       opcode,
@@ -156,32 +184,75 @@ void vm_unit::read_instruction(std::istream &input)
   int const argc = g_opcode_argc[opcode] - (opcode_has_litflag(opcode) ? 1 : 0);
 
   for (int counter = 0; counter < argc; ++counter) {
-    vm_value arg = reader(input);
-    instruction_argv.push_back(arg);
+    instruction_argv.push_back(READER(input));
   }
 }
 
 
 
-void vm_unit::read_instructions(std::istream &input)
+/**
+ * Reads the instruction table using a value reader fixed at compile time, so
+ * operands are decoded inline rather than through a call per operand.
+ *
+ * Storage is reserved up front: one instruction per table entry, and as many
+ * operands as could fit in the rest of the chunk at operand_size bytes each.
+ */
+template <vm_unit::value_reader_t *READER>
+void vm_unit::read_instruction_table(vm_chunk_buffer &input, size_t operand_size)
 {
-  read_table(input, CHUNK_INST, [&](int index) {
-    (void)index;
-    read_instruction(input);
-  });
+  read_table(input, CHUNK_INST, INSTRUCTION_ENTRY_SIZE, [&](int count) {
+      // read_table has checked that the count's headers fit in the chunk.
+      size_t const header_bytes = INSTRUCTION_ENTRY_SIZE * static_cast<size_t>(count);
+      size_t const remaining = input.remaining();
+
+      // Variable-length operands can be as small as a byte, so the estimate
+      // is also capped by the most operands the instructions could have.
+      size_t const max_operands = static_cast<size_t>(count) * max_opcode_argc();
+
+      instructions.reserve(instructions.size() + count);
+      if (remaining > header_bytes) {
+        instruction_argv.reserve(
+          instruction_argv.size() +
+          std::min((remaining - header_bytes) / operand_size, max_operands)
+          );
+      }
+    },
+    [&](int index) {
+      (void)index;
+      read_instruction<READER>(input);
+    });
+}
+
+
+
+void vm_unit::read_instructions(vm_chunk_buffer &input)
+{
+  switch (version) {
+  case 8:
+    read_instruction_table<&vm_unit::read_value_v8>(input, sizeof(double));
+    break;
+  case 9:
+    read_instruction_table<&vm_unit::read_value_v9>(input, sizeof(int32_t) + sizeof(uint64_t));
+    break;
+  case 10:
+    read_instruction_table<&vm_unit::read_value_v10>(input, sizeof(uint8_t));
+    break;
+  default:
+    throw vm_bad_unit("No defined value reader for unit version.");
+  }
 }
 
 
 
 void vm_unit::read_extern_relocations(
-  std::istream &input,
+  vm_chunk_buffer &input,
   int64_t instruction_base,
   extern_relocations_t const &relocations
   )
 {
   extern_relocations_t::const_iterator not_found = relocations.cend();
 
-  read_table(input, CHUNK_EREL, [&](int rel_index) {
+  read_table(input, CHUNK_EREL, RELOCATION_ENTRY_SIZE, [&](int rel_index) {
     (void)rel_index;
 
     relocation_ptr rel = read_relocation_ptr(input);
@@ -198,6 +269,9 @@ void vm_unit::read_extern_relocations(
         return;
       }
 
+      // Either the export's address or the extern's index in the linked
+      // unit's extern table, which resolve_externs relocates later.
+      arg = iter->second.pointer;
       if (!iter->second.resolved) {
         /* unresolved */
         unresolved_relocations.emplace_back(rel);
@@ -209,14 +283,14 @@ void vm_unit::read_extern_relocations(
 
 
 void vm_unit::read_label_relocations(
-  std::istream &input,
+  vm_chunk_buffer &input,
   int64_t instruction_base,
   relocation_map_t const &relocations
   )
 {
   relocation_map_t::const_iterator not_found = relocations.cend();
 
-  read_table(input, CHUNK_LREL, [&](int rel_index) {
+  read_table(input, CHUNK_LREL, RELOCATION_ENTRY_SIZE, [&](int rel_index) {
     relocation_ptr rel = read_relocation_ptr(input);
     rel.pointer += instruction_base;
     int64_t const arg_base = instructions[rel.pointer].arg_pointer;
@@ -229,7 +303,7 @@ void vm_unit::read_label_relocations(
       int64_t orig_base = arg;
       int64_t new_base;
 
-      if (iter != not_found && iter->first == arg) {
+      if (iter != not_found) {
         new_base = iter->second;
         arg = iter->second;
       } else if (arg >= 0) {
@@ -245,99 +319,111 @@ void vm_unit::read_label_relocations(
 
 
 void vm_unit::read_externs(
-  std::istream &input,
+  vm_chunk_buffer &input,
   extern_relocations_t &relocations
   )
 {
-  read_table(input, CHUNK_EXTS, [&](int index) {
-    std::string name = read_lstring(input);
-    uint64_t name_key = string_hash(name);
-
-    auto export_iter = exports.find(name_key);
-    if (export_iter != exports.end()) {
-      relocations.emplace(
-        vm_value { index },
-        extern_relocation { vm_value { export_iter->second }, true }
-        );
-      return;
-    }
+  read_table(input, CHUNK_EXTS, LSTRING_ENTRY_SIZE, [&](int count) {
+      relocations.reserve(relocations.size() + count);
+      externs.reserve(externs.size() + count);
+    },
+    [&](int index) {
+      std::string name = read_lstring(input);
+      uint64_t name_key = string_hash(name);
 
-    auto extern_iter = externs.find(name_key);
-    if (extern_iter != externs.end()) {
-      if (extern_iter->second != index) {
+      auto export_iter = exports.find(name_key);
+      if (export_iter != exports.end()) {
         relocations.emplace(
           vm_value { index },
-          extern_relocation { vm_value { extern_iter->second }, false }
+          extern_relocation { vm_value { export_iter->second }, true }
           );
+        return;
       }
-      return;
-    }
 
-    int64_t new_address = static_cast<int64_t>(externs.size());
-    if (index != new_address) {
-      relocations.emplace(
-        vm_value { index },
-        extern_relocation { vm_value { new_address }, false }
-        );
-    }
+      auto extern_iter = externs.find(name_key);
+      if (extern_iter != externs.end()) {
+        if (extern_iter->second != index) {
+          relocations.emplace(
+            vm_value { index },
+            extern_relocation { vm_value { extern_iter->second }, false }
+            );
+        }
+        return;
+      }
 
-    externs.emplace(name_key, new_address);
-  });
+      int64_t new_address = static_cast<int64_t>(externs.size());
+      if (index != new_address) {
+        relocations.emplace(
+          vm_value { index },
+          extern_relocation { vm_value { new_address }, false }
+          );
+      }
+
+      externs.emplace(name_key, new_address);
+    });
 }
 
 
 
-void vm_unit::read_imports(std::istream &input, relocation_map_t &relocations)
+void vm_unit::read_imports(vm_chunk_buffer &input, relocation_map_t &relocations)
 {
-  read_table(input, CHUNK_IMPT, [&](int index) {
-    vm_label label = read_label(input);
-    uint64_t name_key = string_hash(label.name);
+  read_table(input, CHUNK_IMPT, LABEL_ENTRY_SIZE, [&](int count) {
+      relocations.reserve(relocations.size() + count);
+      imports.reserve(imports.size() + count);
+    },
+    [&](int index) {
+      vm_label label = read_label(input);
+      uint64_t name_key = string_hash(label.name);
 
-    auto iter = imports.find(name_key);
-    if (iter == imports.end()) {
-      int64_t const orig_address = label.address;
-      label.address = --last_import;
+      auto iter = imports.find(name_key);
+      if (iter == imports.end()) {
+        int64_t const orig_address = label.address;
+        label.address = --last_import;
 
-      if (orig_address != label.address) {
-        relocations.emplace(vm_value { orig_address }, vm_value { label.address });
+        if (orig_address != label.address) {
+          relocations.emplace(vm_value { orig_address }, vm_value { label.address });
+        }
+      } else if (iter->second == label.address) {
+        return;
+      } else {
+        relocations.emplace(vm_value { label.address }, vm_value { iter->second });
       }
-    } else if (iter->second == label.address) {
-      return;
-    } else {
-      relocations.emplace(vm_value { label.address }, vm_value { iter->second });
-    }
 
-    imports.emplace(name_key, label.address);
-  });
+      imports.emplace(name_key, label.address);
+    });
 }
 
 
 
 void vm_unit::read_exports(
-  std::istream &input,
+  vm_chunk_buffer &input,
   int64_t base,
   relocation_map_t &relocations
   )
 {
-  read_table(input, CHUNK_EXPT, [&](int index) {
-    vm_label label = read_label(input);
-    uint64_t name_key = string_hash(label.name);
-    label_table_t::const_iterator iter = exports.find(name_key);
-    int64_t address = label.address;
-
-    if (iter != exports.cend()) {
-      if (base != 0) {
+  read_table(input, CHUNK_EXPT, LABEL_ENTRY_SIZE, [&](int count) {
+      relocations.reserve(relocations.size() + count);
+      exports.reserve(exports.size() + count);
+    },
+    [&](int index) {
+      vm_label label = read_label(input);
+      uint64_t name_key = string_hash(label.name);
+      label_table_t::const_iterator iter = exports.find(name_key);
+      int64_t address = label.address;
+
+      if (iter != exports.cend()) {
+        if (base != 0) {
+          address += base;
+          relocations.emplace(vm_value { label.address }, vm_value { address });
+        }
+        return;
+      } else if (base != 0) {
         address += base;
         relocations.emplace(vm_value { label.address }, vm_value { address });
       }
-      return;
-    } else if (base != 0) {
-      address += base;
-      relocations.emplace(vm_value { label.address }, vm_value { address });
-    }
 
-    exports.emplace(name_key, address);
-  });
+      exports.emplace(name_key, address);
+    });
 }
 
 
@@ -396,25 +482,43 @@ void vm_unit::resolve_externs()
 
 
 
+/**
+ * Reads a DATA or ZDAT chunk. Blocks in a ZDAT chunk are stored with both
+ * their size and their stored size, and are kept compressed if the two
+ * differ.
+ */
 void vm_unit::read_data_table(
-  std::istream &input,
+  vm_chunk_buffer &input,
   int64_t data_base,
   relocation_map_t &relocations
   )
 {
-  read_table(input, CHUNK_DATA, [&](int max_count) {
+  bool const compressed = input.header.id == CHUNK_ZDAT;
+
+  // Each block starts with its size, and compressed blocks its stored size.
+  size_t const min_entry_size = (compressed ? 2 : 1) * sizeof(int32_t);
+  read_table(input, compressed ? CHUNK_ZDAT : CHUNK_DATA, min_entry_size, [&](int max_count) {
       _data_blocks.reserve(_data_blocks.size() + max_count);
+      relocations.reserve(relocations.size() + max_count);
     },
     [&](int data_index) {
       // base is always 1 (0 reserved for null, basically)
       int64_t const block_id = 1 + data_base + data_index;
       int64_t const block_size = static_cast<int64_t>(read_primitive<int32_t>(input));
+      int64_t const stored_size =
+        compressed ? static_cast<int64_t>(read_primitive<int32_t>(input)) : block_size;
       int64_t const offset = _data.size();
 
-      _data.resize(static_cast<size_t>(offset + block_size));
-      input.read((char *)&_data[offset], block_size);
+      if (block_size < 0) {
+        throw vm_bad_unit("Negative data block size.");
+      } else if (stored_size < 0 || stored_size > block_size) {
+        throw vm_bad_unit("Invalid compressed data block size.");
+      }
+
+      char const *const bytes = input.take(static_cast<size_t>(stored_size));
+      _data.insert(_data.end(), bytes, bytes + stored_size);
 
-      _data_blocks.emplace_back(data_block { block_id, offset, block_size });
+      _data_blocks.emplace_back(data_block { block_id, offset, block_size, stored_size });
 
       if (data_base > 0) {
         relocations.emplace(vm_value { 1 + data_index }, vm_value { block_id });
@@ -425,14 +529,14 @@ void vm_unit::read_data_table(
 
 
 void vm_unit::read_data_relocations(
-  std::istream &input,
+  vm_chunk_buffer &input,
   int64_t instr_base,
   int64_t data_base,
   relocation_map_t &load_relocations
   )
 {
   relocation_map_t::const_iterator not_found = load_relocations.cend();
-  read_table(input, CHUNK_DREL, [&](int count) {
+  read_table(input, CHUNK_DREL, RELOCATION_ENTRY_SIZE, [&](int count) {
       _data_relocations.reserve(_data_relocations.size() + count);
     }, [&](int index) {
       relocation_ptr rel = read_relocation_ptr(input);
@@ -455,81 +559,485 @@ void vm_unit::read_data_relocations(
 
 
 
-void vm_unit::read(std::istream &input)
+namespace {
+
+
+/** Chunks that follow the version and offsets chunks, in the order read loads them. */
+vm_chunk_id const LOAD_ORDER[] = {
+  CHUNK_INST,
+  CHUNK_IMPT,
+  CHUNK_EXPT,
+  CHUNK_LREL,
+  CHUNK_EXTS,
+  CHUNK_EREL,
+  CHUNK_DATA,
+  CHUNK_DREL,
+};
+
+
+
+/**
+ * Returns the chunk to load in place of the given one. Units hold either a DATA
+ * or a ZDAT chunk.
+ */
+vm_chunk_id load_chunk_id(vm_chunk_id id, vm_chunk_offsets const &offsets)
+{
+  if (id == CHUNK_DATA && offsets.offset_for(CHUNK_ZDAT) >= 0) {
+    return CHUNK_ZDAT;
+  }
+  return id;
+}
+
+
+
+/** Returns a bit for the chunk's position in LOAD_ORDER, or 0 if not loaded. */
+unsigned load_bit(vm_chunk_id id)
+{
+  if (id == CHUNK_ZDAT) {
+    id = CHUNK_DATA;
+  }
+
+  for (unsigned index = 0; index < sizeof(LOAD_ORDER) / sizeof(LOAD_ORDER[0]); ++index) {
+    if (LOAD_ORDER[index] == id) {
+      return 1u << index;
+    }
+  }
+  return 0;
+}
+
+
+
+/**
+ * Returns the load bits of the chunks that have to be loaded before the given
+ * chunk. Relocation tables patch instructions and use the relocations built
+ * by their label or data tables, and externs may resolve to the unit's own
+ * exports.
+ */
+unsigned load_dependencies(vm_chunk_id id)
+{
+  switch (id) {
+  case CHUNK_LREL: return load_bit(CHUNK_INST) | load_bit(CHUNK_IMPT) | load_bit(CHUNK_EXPT);
+  case CHUNK_EXTS: return load_bit(CHUNK_EXPT);
+  case CHUNK_EREL: return load_bit(CHUNK_INST) | load_bit(CHUNK_EXTS);
+  case CHUNK_DREL: return load_bit(CHUNK_INST) | load_bit(CHUNK_DATA);
+  default: return 0;
+  }
+}
+
+
+
+/** Returns the error message for a chunk that couldn't be found. */
+char const *missing_chunk_message(vm_chunk_id id)
+{
+  switch (id) {
+  case CHUNK_INST: return "Unable to seek to instruction table.";
+  case CHUNK_IMPT: return "Unable to seek to imported labels table.";
+  case CHUNK_EXPT: return "Unable to seek to exported labels table.";
+  case CHUNK_LREL: return "Unable to seek to relocated labels table.";
+  case CHUNK_EXTS: return "Unable to seek to extern labels table.";
+  case CHUNK_EREL: return "Unable to seek to relocated labels table.";
+  case CHUNK_DATA:
+  case CHUNK_ZDAT: return "Unable to seek to data table.";
+  case CHUNK_DREL: return "Unable to seek to data relocation table.";
+  default: return "Unable to seek to chunk.";
+  }
+}
+
+
+} // namespace
+
+
+
+/**
+ * Relocations and bases carried between the chunks of a unit being read.
+ */
+struct vm_unit::read_context
+{
+  int64_t instruction_base;
+  int64_t data_base;
+  relocation_map_t label_relocations;
+  extern_relocations_t extern_relocations;
+  relocation_map_t data_relocations;
+};
+
+
+
+void vm_unit::read_version(std::istream &input)
 {
   vm_version_chunk const filehead {
     read_primitive<vm_chunk_header>(input),  // header
     read_primitive<int32_t>(input)          // version
   };
 
-  int64_t instruction_base = static_cast<int64_t>(instructions.size());
-
-  relocation_map_t label_relocations;
-
   if (filehead.version < 8) {
     // TODO: Use own exceptions for these things
     throw vm_unsupported_unit_version("Invalid bytecode version.");
   }
   version = filehead.version;
+}
+
 
-  vm_chunk_offsets const offsets { input };
 
-  if (offsets.seek_to_offset(input, CHUNK_INST)) {
+/**
+ * Loads one chunk of a unit. Chunks must be loaded after the chunks they
+ * depend on (see load_dependencies).
+ */
+void vm_unit::read_chunk(vm_chunk_id id, vm_chunk_buffer &input, read_context &context)
+{
+  switch (id) {
+  case CHUNK_INST:
     read_instructions(input);
-  } else {
-    throw vm_bad_unit("Unable to seek to instruction table.");
+    break;
+  case CHUNK_IMPT:
+    read_imports(input, context.label_relocations);
+    break;
+  case CHUNK_EXPT:
+    read_exports(input, context.instruction_base, context.label_relocations);
+    break;
+  case CHUNK_LREL:
+    read_label_relocations(input, context.instruction_base, context.label_relocations);
+    break;
+  case CHUNK_EXTS:
+    read_externs(input, context.extern_relocations);
+    break;
+  case CHUNK_EREL:
+    read_extern_relocations(input, context.instruction_base, context.extern_relocations);
+    break;
+  case CHUNK_DATA:
+  case CHUNK_ZDAT:
+    read_data_table(input, context.data_base, context.data_relocations);
+    break;
+  case CHUNK_DREL:
+    read_data_relocations(input, context.instruction_base, context.data_base, context.data_relocations);
+    break;
+  default:
+    break;
+  }
+}
+
+
+
+void vm_unit::read(std::istream &input)
+{
+  read_version(input);
+
+  read_context context;
+  context.instruction_base = static_cast<int64_t>(instructions.size());
+  context.data_base = static_cast<int64_t>(_data_blocks.size());
+
+  vm_chunk_offsets const offsets { input };
+  vm_chunk_buffer chunk;
+
+  for (vm_chunk_id const load_id : LOAD_ORDER) {
+    vm_chunk_id const id = load_chunk_id(load_id, offsets);
+    if (id == CHUNK_LREL && context.label_relocations.size() == 0) {
+      continue;
+    } else if (!offsets.seek_to_offset(input, id) || !chunk.read(input)) {
+      throw vm_bad_unit(missing_chunk_message(id));
+    }
+
+    read_chunk(id, chunk, context);
   }
 
-  if (offsets.seek_to_offset(input, CHUNK_IMPT)) {
-    read_imports(input, label_relocations);
-  } else {
-    throw vm_bad_unit("Unable to seek to imported labels table.");
+  resolve_externs();
+}
+
+
+
+void vm_unit::read_stream(std::istream &input)
+{
+  read_version(input);
+
+  read_context context;
+  context.instruction_base = static_cast<int64_t>(instructions.size());
+  context.data_base = static_cast<int64_t>(_data_blocks.size());
+
+  vm_chunk_offsets const offsets { input };
+  // Bytes read so far: the version chunk's header and version, then offsets.
+  int64_t position = sizeof(vm_version_chunk) + offsets.header.header.byte_size;
+
+  // Loaded chunks, in the order they appear in the unit.
+  std::vector<vm_chunk_offsets::chunk_offset> layout;
+  for (vm_chunk_id const load_id : LOAD_ORDER) {
+    vm_chunk_id const id = load_chunk_id(load_id, offsets);
+    int32_t const offset = offsets.offset_for(id);
+    if (offset < 0) {
+      throw vm_bad_unit(missing_chunk_message(id));
+    }
+    layout.push_back(vm_chunk_offsets::chunk_offset { id, offset });
   }
+  std::sort(layout.begin(), layout.end(),
+    [](vm_chunk_offsets::chunk_offset const &lhs, vm_chunk_offsets::chunk_offset const &rhs) {
+      return lhs.offset < rhs.offset;
+    });
+
+  unsigned loaded = 0;
+  // Chunks read before the chunks they depend on.
+  std::vector<vm_chunk_buffer> deferred;
+
+  auto load = [&](vm_chunk_buffer &chunk) {
+    vm_chunk_id const id = chunk.header.id;
+    if (id != CHUNK_LREL || context.label_relocations.size() > 0) {
+      read_chunk(id, chunk, context);
+    }
+    loaded |= load_bit(id);
+  };
+
+  for (vm_chunk_offsets::chunk_offset const &entry : layout) {
+    if (entry.offset < position) {
+      throw vm_bad_unit("Unit chunks overlap.");
+    } else if (entry.offset > position) {
+      std::streamsize const gap = static_cast<std::streamsize>(entry.offset - position);
+      if (!input.ignore(gap) || input.gcount() != gap) {
+        throw vm_bad_unit(missing_chunk_message(entry.id));
+      }
+    }
 
-  if (offsets.seek_to_offset(input, CHUNK_EXPT)) {
-    read_exports(input, instruction_base, label_relocations);
-  } else {
-    throw vm_bad_unit("Unable to seek to exported labels table.");
+    vm_chunk_buffer chunk;
+    if (!chunk.read(input)) {
+      throw vm_bad_unit(missing_chunk_message(entry.id));
+    } else if (chunk.header.id != entry.id) {
+      throw vm_bad_unit("Unit chunk doesn't match its offset.");
+    }
+    position = static_cast<int64_t>(entry.offset) + chunk.header.byte_size;
+
+    unsigned const needs = load_dependencies(entry.id);
+    if ((loaded & needs) != needs) {
+      deferred.push_back(std::move(chunk));
+      continue;
+    }
+    load(chunk);
+
+    // Load any deferred chunks whose dependencies have now been loaded.
+    for (bool progress = true; progress; ) {
+      progress = false;
+      for (auto iter = deferred.begin(); iter != deferred.end(); ++iter) {
+        unsigned const waiting = load_dependencies(iter->header.id);
+        if ((loaded & waiting) == waiting) {
+          load(*iter);
+          deferred.erase(iter);
+          progress = true;
+          break;
+        }
+      }
+    }
   }
 
-  if (label_relocations.size() > 0) {
-    if (offsets.seek_to_offset(input, CHUNK_LREL)) {
-      read_label_relocations(input, instruction_base, label_relocations);
-    } else {
-      throw vm_bad_unit("Unable to seek to relocated labels table.");
+  resolve_externs();
+}
+
+
+
+void vm_unit::write_image(std::ostream &output) const
+{
+  vm_unit_image_writer payload;
+
+  // Labels are sorted so the same unit always produces the same image.
+  auto write_labels = [&payload](label_table_t const &table) {
+    std::vector<std::pair<uint64_t, int64_t>> sorted(table.cbegin(), table.cend());
+    std::sort(sorted.begin(), sorted.end());
+    payload.write<uint64_t>(sorted.size());
+    for (auto const &label : sorted) {
+      payload.write<uint64_t>(label.first);
+      payload.write<int64_t>(label.second);
+    }
+  };
+
+  auto write_relocations = [&payload](relocation_table_t const &table) {
+    payload.write<uint64_t>(table.size());
+    for (relocation_ptr const &rel : table) {
+      payload.write<int64_t>(rel.pointer);
+      payload.write<uint64_t>(rel.args_mask);
     }
+  };
+
+  payload.write<int32_t>(version);
+  payload.write<int64_t>(last_import);
+
+  payload.write<uint64_t>(instructions.size());
+  for (instruction_ptr const &ins : instructions) {
+    payload.write<uint16_t>(ins.opcode);
+    payload.write<uint64_t>(ins.litflag);
+    payload.write<int64_t>(ins.arg_pointer);
   }
 
-  extern_relocations_t extern_relocations;
+  payload.write<uint64_t>(instruction_argv.size());
+  for (vm_value const &arg : instruction_argv) {
+    payload.write_value(arg);
+  }
+
+  write_labels(imports);
+  write_labels(exports);
+  write_labels(externs);
+  write_relocations(unresolved_relocations);
+
+  payload.write<uint64_t>(_data.size());
+  payload.write_bytes(_data.data(), _data.size());
 
-  if (offsets.seek_to_offset(input, CHUNK_EXTS)) {
-    read_externs(input, extern_relocations);
-  } else {
-    throw vm_bad_unit("Unable to seek to extern labels table.");
+  payload.write<uint64_t>(_data_blocks.size());
+  for (data_block const &block : _data_blocks) {
+    payload.write<int64_t>(block.id);
+    payload.write<int64_t>(block.offset);
+    payload.write<int64_t>(block.size);
+    payload.write<int64_t>(block.stored_size);
   }
 
-  if (offsets.seek_to_offset(input, CHUNK_EREL)) {
-    read_extern_relocations(input, instruction_base, extern_relocations);
-  } else {
-    throw vm_bad_unit("Unable to seek to relocated labels table.");
+  write_relocations(_data_relocations);
+
+  vm_unit_image_header const header {
+    VM_UNIT_IMAGE_MAGIC,
+    VM_UNIT_IMAGE_VERSION,
+    payload.buffer.size(),
+    vm_unit_image_hash(payload.buffer.data(), payload.buffer.size())
+  };
+
+  output.write(reinterpret_cast<char const *>(&header), sizeof header);
+  output.write(payload.buffer.data(), static_cast<std::streamsize>(payload.buffer.size()));
+  if (!output) {
+    throw vm_unit_io_error("Unable to write unit image.");
   }
+}
 
-  relocation_map_t data_relocations;
-  int64_t data_base = static_cast<int64_t>(_data_blocks.size());
 
-  if (offsets.seek_to_offset(input, CHUNK_DATA)) {
-    read_data_table(input, data_base, data_relocations);
-  } else {
-    throw vm_bad_unit("Unable to seek to data table.");
+
+void vm_unit::read_image(std::istream &input)
+{
+  // Read in runs so a corrupt payload size fails on the stream running out
+  // instead of on one huge allocation.
+  size_t const run_size = 1 << 20;
+  std::string buffer(sizeof(vm_unit_image_header), '\0');
+
+  if (!input.read(&buffer[0], sizeof(vm_unit_image_header))) {
+    throw vm_bad_unit("Unit image is truncated.");
   }
 
-  if (offsets.seek_to_offset(input, CHUNK_DREL)) {
-    read_data_relocations(input, instruction_base, data_base, data_relocations);
-  } else {
-    throw vm_bad_unit("Unable to seek to data relocation table.");
+  vm_unit_image_header header;
+  std::memcpy(&header, buffer.data(), sizeof header);
+
+  for (uint64_t remaining = header.payload_size; remaining > 0; ) {
+    size_t const offset = buffer.size();
+    size_t const run = static_cast<size_t>(std::min<uint64_t>(remaining, run_size));
+    buffer.resize(offset + run);
+    if (!input.read(&buffer[offset], static_cast<std::streamsize>(run))) {
+      throw vm_bad_unit("Unit image is truncated.");
+    }
+    remaining -= run;
   }
 
-  resolve_externs();
+  read_image(buffer.data(), buffer.size());
+}
+
+
+
+void vm_unit::read_image(void const *data, size_t size)
+{
+  vm_unit_image_reader input {
+    static_cast<char const *>(data),
+    static_cast<char const *>(data) + size
+  };
+
+  vm_unit_image_header const header = input.read<vm_unit_image_header>();
+  if (header.magic != VM_UNIT_IMAGE_MAGIC) {
+    throw vm_bad_unit("Not a unit image.");
+  } else if (header.version != VM_UNIT_IMAGE_VERSION) {
+    throw vm_bad_unit("Unsupported unit image version.");
+  } else if (header.payload_size != static_cast<uint64_t>(input.end - input.cursor)) {
+    throw vm_bad_unit("Unit image is truncated.");
+  } else if (vm_unit_image_hash(input.cursor, static_cast<size_t>(header.payload_size)) != header.payload_hash) {
+    throw vm_bad_unit("Unit image doesn't match its hash.");
+  }
+
+  auto read_labels = [&input](label_table_t &table) {
+    size_t const count = input.read_count(16);
+    table.clear();
+    table.reserve(count);
+    for (size_t index = 0; index < count; ++index) {
+      uint64_t const key = input.read<uint64_t>();
+      table.emplace(key, input.read<int64_t>());
+    }
+  };
+
+  auto read_relocations = [&input](relocation_table_t &table) {
+    table.resize(input.read_count(16));
+    for (relocation_ptr &rel : table) {
+      rel.pointer = input.read<int64_t>();
+      rel.args_mask = input.read<uint64_t>();
+    }
+  };
+
+  int32_t const image_unit_version = input.read<int32_t>();
+  int64_t const image_last_import = input.read<int64_t>();
+
+  instruction_ptrs_t image_instructions(input.read_count(18));
+  for (instruction_ptr &ins : image_instructions) {
+    ins.opcode = static_cast<vm_opcode>(input.read<uint16_t>());
+    ins.litflag = input.read<uint64_t>();
+    ins.arg_pointer = input.read<int64_t>();
+  }
+
+  instruction_argv_t image_argv(input.read_count(12));
+  for (vm_value &arg : image_argv) {
+    arg = input.read_value();
+  }
+
+  for (instruction_ptr const &ins : image_instructions) {
+    if (ins.opcode >= OP_COUNT) {
+      throw vm_bad_unit("Unit image has an invalid opcode.");
+    }
+    int64_t const argc = g_opcode_argc[ins.opcode] - (opcode_has_litflag(ins.opcode) ? 1 : 0);
+    if (ins.arg_pointer < 0 || ins.arg_pointer + argc > static_cast<int64_t>(image_argv.size())) {
+      throw vm_bad_unit("Unit image has an instruction with out-of-range operands.");
+    }
+  }
+
+  label_table_t image_imports;
+  label_table_t image_exports;
+  label_table_t image_externs;
+  relocation_table_t image_unresolved;
+  read_labels(image_imports);
+  read_labels(image_exports);
+  read_labels(image_externs);
+  read_relocations(image_unresolved);
+
+  std::vector<uint8_t> image_data(input.read_count(1));
+  input.read_bytes(image_data.data(), image_data.size());
+
+  std::vector<data_block> image_blocks(input.read_count(32));
+  for (data_block &block : image_blocks) {
+    block.id = input.read<int64_t>();
+    block.offset = input.read<int64_t>();
+    block.size = input.read<int64_t>();
+    block.stored_size = input.read<int64_t>();
+    if (block.offset < 0 || block.stored_size < 0 || block.stored_size > block.size ||
+        block.offset + block.stored_size > static_cast<int64_t>(image_data.size())) {
+      throw vm_bad_unit("Unit image has an out-of-range data block.");
+    }
+  }
+
+  relocation_table_t image_data_relocations;
+  read_relocations(image_data_relocations);
+
+  auto const check_relocations = [&image_instructions](relocation_table_t const &table) {
+    for (relocation_ptr const &rel : table) {
+      if (rel.pointer < 0 || rel.pointer >= static_cast<int64_t>(image_instructions.size())) {
+        throw vm_bad_unit("Unit image has an out-of-range relocation.");
+      }
+    }
+  };
+  check_relocations(image_unresolved);
+  check_relocations(image_data_relocations);
+
+  version = image_unit_version;
+  last_import = image_last_import;
+  instructions = std::move(image_instructions);
+  instruction_argv = std::move(image_argv);
+  imports = std::move(image_imports);
+  exports = std::move(image_exports);
+  externs = std::move(image_externs);
+  unresolved_relocations = std::move(image_unresolved);
+  _data = std::move(image_data);
+  _data_blocks = std::move(image_blocks);
+  _data_relocations = std::move(image_data_relocations);
 }
 
 
@@ -553,6 +1061,20 @@ void vm_unit::debug_write_instructions(std::ostream &out) const
 
 
 
+void vm_unit::copy_data_block(size_t index, void *dest) const
+{
+  data_block const &block = _data_blocks[index];
+  uint8_t const *const stored = _data.data() + block.offset;
+
+  if (block.stored_size == block.size) {
+    std::memcpy(dest, stored, static_cast<size_t>(block.size));
+  } else if (!vm_lz_decompress(stored, static_cast<size_t>(block.stored_size), dest, static_cast<size_t>(block.size))) {
+    throw vm_bad_unit("Compressed data block is corrupt.");
+  }
+}
+
+
+
 bool vm_unit::relocate_static_data(data_id_ary_t const &new_ids)
 {
   relocation_map_t relocations;
@@ -620,18 +1142,7 @@ vm_op vm_unit::fetch_op(int64_t ip) const
 
 
 
-auto vm_unit::value_reader() const -> value_reader_t *
-{
-  switch (version) {
-  case 8: return &vm_unit::read_value_v8;
-  case 9: return &vm_unit::read_value_v9;
-  default: return nullptr;
-  }
-}
-
-
-
-vm_value vm_unit::read_value_v8(std::istream &input)
+vm_value vm_unit::read_value_v8(vm_chunk_buffer &input)
 {
   return vm_value {
     vm_value::FLOAT,
@@ -641,10 +1152,47 @@ vm_value vm_unit::read_value_v8(std::istream &input)
 
 
 
-vm_value vm_unit::read_value_v9(std::istream &input)
+vm_value vm_unit::read_value_v9(vm_chunk_buffer &input)
 {
   return vm_value {
     read_primitive<int32_t>(input),
     read_primitive<uint64_t>(input)
   };
 }
+
+
+
+vm_value vm_unit::read_value_v10(vm_chunk_buffer &input)
+{
+  uint8_t const tag = read_primitive<uint8_t>(input);
+
+  switch (tag & OPERAND_ENCODING_MASK) {
+  case OPERAND_UNDEFINED:
+    return vm_value { vm_value::UNDEFINED, read_operand_varint(input, tag) };
+  case OPERAND_UNSIGNED:
+    return vm_value { vm_value::UNSIGNED, read_operand_varint(input, tag) };
+  case OPERAND_SIGNED:
+    return vm_value { vm_value::SIGNED, zigzag_decode(read_operand_varint(input, tag)) };
+  case OPERAND_DATA:
+    return vm_value { vm_value::DATA, read_operand_varint(input, tag) };
+  case OPERAND_INTEGRAL_FLOAT:
+    return vm_value {
+      vm_value::FLOAT,
+      static_cast<double>(zigzag_decode(read_operand_varint(input, tag)))
+    };
+  case OPERAND_FLOAT:
+    if (tag == OPERAND_FLOAT) {
+      return vm_value { vm_value::FLOAT, read_primitive<double>(input) };
+    }
+    break;
+  case OPERAND_TYPED:
+    if (tag == OPERAND_TYPED) {
+      return read_value_v9(input);
+    }
+    break;
+  default:
+    break;
+  }
+
+  throw vm_bad_unit("Invalid operand encoding.");
+}
@@ -11,7 +11,7 @@
 #include <cstdint>
 #include <array>
 #include <iterator>
-#include <map>
+#include <unordered_map>
 #include <vector>
 
 #include "vm_opcode.h"
@@ -31,6 +31,11 @@
  *   - 9:
  *     Adds typed values as 32-bit signed integers. Values should be read as
  *     a signed 32-bit type ID integer followed by a 8-byte value data.
+ *
+ *   - 10:
+ *     Operands are a tag byte followed by a varint, a double, or a version 9
+ *     value, depending on the tag (see vm_operand_encoding). Small integers
+ *     and register numbers take one or two bytes.
  */
 
 
@@ -44,6 +49,7 @@ enum vm_chunk_id : int32_t
   CHUNK_LREL = 'LERL',
   CHUNK_DREL = 'LERD',
   CHUNK_DATA = 'ATAD',
+  CHUNK_ZDAT = 'TADZ', // DATA with compressed blocks
   CHUNK_IMPT = 'TPMI',
   CHUNK_EXPT = 'TPXE',
   CHUNK_EXTS = 'STXE',
@@ -51,6 +57,9 @@ enum vm_chunk_id : int32_t
 };
 
 
+class vm_chunk_buffer;
+
+
 
 /**
  * vm_unit is a unit of loaded Rusalka bytecode. It defines all instructions,
@@ -65,6 +74,7 @@ class vm_unit
 {
   friend class vm_op;
   friend class vm_state;
+  friend class vm_state_pool;
 
   /**
    * A relocation marker. Defines which instruction needs relocation and which
@@ -78,7 +88,7 @@ class vm_unit
     // Mask indicating which arguments are to be relocated.
     uint64_t args_mask;
   };
-  static relocation_ptr read_relocation_ptr(std::istream &);
+  static relocation_ptr read_relocation_ptr(vm_chunk_buffer &input);
 
   /**
    * An instruction in the unit. Contains the opcode of the instruction, which
@@ -95,12 +105,17 @@ class vm_unit
   /**
    * A static data block in the unit. Has a predefined ID, an offset, and the
    * size of the data block.
+   *
+   * Blocks read from a ZDAT chunk may be kept compressed, in which case their
+   * stored size is less than their size. They're decompressed when copied out
+   * of the unit.
    */
   struct data_block
   {
     int64_t id;
-    int64_t offset; // offset into _data
-    int64_t size;   // size in bytes of the block
+    int64_t offset;      // offset into _data
+    int64_t size;        // size in bytes of the block
+    int64_t stored_size; // size in bytes of the block in _data
   };
 
   /**
@@ -116,19 +131,46 @@ class vm_unit
     bool resolved;
   };
 
-  using value_reader_t       = vm_value (std::istream &);
+  /**
+   * Hashes and compares relocated operands by their integer value, so relocation
+   * lookups are hash lookups rather than walks through vm_value's ordering,
+   * which doesn't order non-arithmetic values. Arithmetic operands are keyed by
+   * their value as an int64_t, so a FLOAT -1 read from a version 8 unit matches
+   * the SIGNED -1 a table was keyed by, and other operands (e.g., DATA) by their
+   * raw bits. Types are otherwise ignored, since a DATA operand has to match the
+   * SIGNED block index its relocation is keyed by.
+   */
+  struct operand_key
+  {
+    static uint64_t bits(vm_value value)
+    {
+      return value.is_arithmetic() ? static_cast<uint64_t>(value.i64()) : value.u64_;
+    }
+
+    size_t operator () (vm_value value) const
+    {
+      return std::hash<uint64_t>{}(bits(value));
+    }
+
+    bool operator () (vm_value lhs, vm_value rhs) const
+    {
+      return bits(lhs) == bits(rhs);
+    }
+  };
+
+  using value_reader_t       = vm_value (vm_chunk_buffer &);
   using relocation_table_t   = std::vector<relocation_ptr>;
-  using relocation_map_t     = std::map<vm_value, vm_value>;
+  using relocation_map_t     = std::unordered_map<vm_value, vm_value, operand_key, operand_key>;
   // Externs may be relocated in two ways:
   // 1) The extern might just need to be adjusted because there are prior
   //  unresolved externs, in which case the second field is false (unresolved).
   // 2) The extern might've been resolved in the process of loading the extern
   //  table, so the second field is true (resolved).
-  using extern_relocations_t = std::map<vm_value, extern_relocation>;
+  using extern_relocations_t = std::unordered_map<vm_value, extern_relocation, operand_key, operand_key>;
 
   using instruction_ptrs_t   = std::vector<instruction_ptr>;
   using instruction_argv_t   = std::vector<vm_value>;
-  using label_table_t        = std::map<uint64_t, int64_t>;
+  using label_table_t        = std::unordered_map<uint64_t, int64_t>;
   using data_id_ary_t        = std::vector<int64_t>;
 
   /** The last version code the unit was loaded with. Currently unused. */
@@ -153,26 +195,34 @@ class vm_unit
   std::vector<data_block> _data_blocks;
   relocation_table_t _data_relocations;
 
-  void read_instruction(std::istream &input);
-  void read_instructions(std::istream &input);
+  template <value_reader_t *READER>
+  void read_instruction(vm_chunk_buffer &input);
+  template <value_reader_t *READER>
+  void read_instruction_table(vm_chunk_buffer &input, size_t operand_size);
+  void read_instructions(vm_chunk_buffer &input);
 
-  void read_imports(std::istream &input, relocation_map_t &relocations);
+  struct read_context;
+
+  void read_version(std::istream &input);
+  void read_chunk(vm_chunk_id id, vm_chunk_buffer &input, read_context &context);
+
+  void read_imports(vm_chunk_buffer &input, relocation_map_t &relocations);
   void read_exports(
-    std::istream &input,
+    vm_chunk_buffer &input,
     int64_t base,
     relocation_map_t &relocations
     );
 
-  void read_externs(std::istream &input, extern_relocations_t &relocations);
+  void read_externs(vm_chunk_buffer &input, extern_relocations_t &relocations);
 
   void read_label_relocations(
-    std::istream &input,
+    vm_chunk_buffer &input,
     int64_t instruction_base,
     relocation_map_t const &relocations
     );
 
   void read_extern_relocations(
-    std::istream &input,
+    vm_chunk_buffer &input,
     int64_t instruction_base,
     extern_relocations_t const &relocations
     );
@@ -180,13 +230,13 @@ class vm_unit
   void resolve_externs();
 
   void read_data_table(
-    std::istream &input,
+    vm_chunk_buffer &input,
     int64_t data_base,
     relocation_map_t &relocations
     );
 
   void read_data_relocations(
-    std::istream &input,
+    vm_chunk_buffer &input,
     int64_t instr_base,
     int64_t data_base,
     relocation_map_t &load_relocations
@@ -203,10 +253,9 @@ class vm_unit
     relocation_map_t const &relocations
     );
 
-  value_reader_t *value_reader() const;
-
-  static vm_value read_value_v8(std::istream &);
-  static vm_value read_value_v9(std::istream &);
+  static vm_value read_value_v8(vm_chunk_buffer &input);
+  static vm_value read_value_v9(vm_chunk_buffer &input);
+  static vm_value read_value_v10(vm_chunk_buffer &input);
 
 public:
 
@@ -225,6 +274,40 @@ public:
    */
   void read(std::istream &input);
 
+  /**
+   * Reads a unit and links it into this unit, like read, but without seeking,
+   * so units can be read from pipes, sockets, and other non-seekable streams.
+   * Chunks are read in the order they appear in the unit. A chunk is only
+   * kept after it's read if chunks it depends on come later in the unit, so
+   * for units whose chunks are in the usual order, at most one chunk is held
+   * in memory at a time. Reading stops at the end of the last chunk.
+   */
+  void read_stream(std::istream &input);
+
+  /**
+   * Writes the unit, as linked so far, to a stream as a unit image. An image
+   * holds the decoded instructions and operands, label tables, and static
+   * data, along with a hash of its contents, so it can be loaded again
+   * without decoding bytecode or relocating anything.
+   *
+   * Images are meant for caching linked units on the host that wrote them, as
+   * they're written in host byte order.
+   */
+  void write_image(std::ostream &output) const;
+
+  /**
+   * Replaces the unit with one read from a unit image written by write_image.
+   * Throws vm_bad_unit if the image is malformed or doesn't match its hash.
+   * More bytecode may be read into the unit afterward as usual.
+   */
+  void read_image(std::istream &input);
+
+  /**
+   * Replaces the unit with one read from a unit image in memory, such as a
+   * mapped image file. The memory isn't referenced once this returns.
+   */
+  void read_image(void const *data, size_t size);
+
   /**
    * Returns whether the unit valid. A valid unit has no unresolved relocations
    * or externs -- so, it is fully linked and ready to use if valid. If there
@@ -250,9 +333,20 @@ public:
    */
   vm_op fetch_op(int64_t ip) const;
 
+  /** Returns the number of static data blocks defined by the unit. */
+  size_t data_block_count() const { return _data_blocks.size(); }
+
+  /**
+   * Copies the static data block at the given index into dest, which must
+   * have room for the block's size, decompressing it if needed. Throws
+   * vm_bad_unit if a compressed block is corrupt.
+   */
+  void copy_data_block(size_t index, void *dest) const;
+
   /**
    * Iterates over all static data defined by the unit and passes its data to
-   * that function.
+   * that function. Compressed blocks are decompressed into a temporary buffer
+   * first, so prefer copy_data_block for copying blocks elsewhere.
    *
    * Func is of the type `void(int index, int64_t block, void const *data, bool &stop)`.
    * The enumerator function may not modify the block, but it is permitted to
@@ -269,8 +363,15 @@ void vm_unit::each_data(Func &&fn) const
 {
   int index = 0;
   bool stop = false;
+  std::vector<uint8_t> decompressed;
   for (data_block const &blk : _data_blocks) {
-    fn(index++, blk.id, blk.size, (void const *)&_data[blk.offset], stop);
+    void const *data = (void const *)&_data[blk.offset];
+    if (blk.stored_size != blk.size) {
+      decompressed.resize(static_cast<size_t>(blk.size));
+      copy_data_block(static_cast<size_t>(index), decompressed.data());
+      data = decompressed.data();
+    }
+    fn(index++, blk.id, blk.size, data, stop);
     if (stop) {
       return;
     }